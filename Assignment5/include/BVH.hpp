@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "Bounds3.hpp"
+#include "Vector.hpp"
+
+// Bounding volume hierarchy over primitives known only by their bounds, so
+// the same tree serves the objects of a Scene and the triangles of a
+// MeshTriangle. Nodes are laid out depth first in one array, the first
+// child right after its parent.
+class BVH {
+public:
+	// maxPrimsInNode bounds the leaf size; splits are chosen by the surface
+	// area heuristic over a few buckets of the longest axis
+	void build(const std::vector<Bounds3>& bounds, int maxPrimsInNode = 4);
+
+	bool empty() const { return nodes.empty(); }
+	Bounds3 bounds() const { return nodes.empty() ? Bounds3() : nodes[0].bounds; }
+
+	// Calls hit(primitive, tNear) for every primitive whose box the ray
+	// enters no farther than tNear, near child first. hit returns true when
+	// it has a new closest hit and lowers tNear to it, which prunes the rest
+	// of the walk. With anyHit the walk stops at the first such hit.
+	template <typename Hit>
+	bool traverse(const Vector3f& orig, const Vector3f& dir, float& tNear, Hit&& hit, bool anyHit = false) const;
+
+private:
+	// deeper than kMaxSAHDepth nodes split at the median, which keeps the
+	// tree within the traversal stack for any primitive count
+	static constexpr int kMaxSAHDepth = 48;
+	static constexpr int kMaxDepth = 128;
+
+	struct Node {
+		Bounds3 bounds;
+		// leaves: primitives [offset, offset + count); interior nodes:
+		// count == 0 and offset is the second child
+		uint32_t offset;
+		uint16_t count;
+		uint8_t axis;
+	};
+
+	uint32_t build(const std::vector<Bounds3>& bounds, const std::vector<Vector3f>& centroids, uint32_t start,
+	               uint32_t end, int maxPrimsInNode, int depth);
+
+	std::vector<Node> nodes;
+	// primitive indices in leaf order
+	std::vector<uint32_t> primitives;
+};
+
+template <typename Hit>
+bool BVH::traverse(const Vector3f& orig, const Vector3f& dir, float& tNear, Hit&& hit, bool anyHit) const {
+	if (nodes.empty())
+		return false;
+	Vector3f invDir(1 / dir.x, 1 / dir.y, 1 / dir.z);
+	// from invDir so a direction of -0 counts as negative like its -inf
+	int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+	bool found = false;
+	uint32_t stack[kMaxDepth];
+	int top = 0;
+	uint32_t current = 0;
+	while (true) {
+		const Node& node = nodes[current];
+		if (node.bounds.IntersectP(orig, invDir, dirIsNeg, tNear)) {
+			if (node.count > 0) {
+				for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+					if (hit(primitives[i], tNear)) {
+						found = true;
+						if (anyHit)
+							return true;
+					}
+				}
+			}
+			else if (dirIsNeg[node.axis]) {
+				stack[top++] = current + 1;
+				current = node.offset;
+				continue;
+			}
+			else {
+				stack[top++] = node.offset;
+				current = current + 1;
+				continue;
+			}
+		}
+		if (top == 0)
+			break;
+		current = stack[--top];
+	}
+	return found;
+}
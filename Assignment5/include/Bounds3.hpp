@@ -0,0 +1,63 @@
+#pragma once
+
+#include <algorithm>
+#include <limits>
+#include "Vector.hpp"
+
+// Axis aligned bounding box; a default constructed one is empty
+class Bounds3 {
+public:
+	Vector3f pMin, pMax;
+
+	Bounds3()
+		: pMin(std::numeric_limits<float>::max()), pMax(std::numeric_limits<float>::lowest()) {}
+
+	Bounds3(const Vector3f& p1, const Vector3f& p2)
+		: pMin(std::min(p1.x, p2.x), std::min(p1.y, p2.y), std::min(p1.z, p2.z)),
+		  pMax(std::max(p1.x, p2.x), std::max(p1.y, p2.y), std::max(p1.z, p2.z)) {}
+
+	Vector3f Diagonal() const { return pMax - pMin; }
+	Vector3f Centroid() const { return pMin * 0.5f + pMax * 0.5f; }
+
+	int maxExtent() const {
+		Vector3f d = Diagonal();
+		if (d.x > d.y && d.x > d.z)
+			return 0;
+		return d.y > d.z ? 1 : 2;
+	}
+
+	float SurfaceArea() const {
+		Vector3f d = Diagonal();
+		return 2 * (d.x * d.y + d.x * d.z + d.y * d.z);
+	}
+
+	// Whether the ray enters the box at a distance in [0, tMax]. Flat boxes,
+	// such as the one around a floor quad, count as hit, and the exit
+	// distance is rounded up so no hit on a face of the box is lost.
+	bool IntersectP(const Vector3f& orig, const Vector3f& invDir, const int* dirIsNeg, float tMax) const {
+		float tEnter = 0, tExit = tMax;
+		const float o[3] = {orig.x, orig.y, orig.z}, inv[3] = {invDir.x, invDir.y, invDir.z};
+		const float lo[3] = {pMin.x, pMin.y, pMin.z}, hi[3] = {pMax.x, pMax.y, pMax.z};
+		for (int i = 0; i < 3; ++i) {
+			float t0 = ((dirIsNeg[i] ? hi[i] : lo[i]) - o[i]) * inv[i];
+			float t1 = ((dirIsNeg[i] ? lo[i] : hi[i]) - o[i]) * inv[i];
+			t1 *= 1 + 4 * std::numeric_limits<float>::epsilon();
+			// NaN, from a zero direction on the plane of a face, leaves the
+			// interval unchanged
+			tEnter = t0 > tEnter ? t0 : tEnter;
+			tExit = t1 < tExit ? t1 : tExit;
+			if (tEnter > tExit)
+				return false;
+		}
+		return true;
+	}
+};
+
+inline Bounds3 Union(const Bounds3& a, const Bounds3& b) {
+	Bounds3 ret;
+	ret.pMin = Vector3f(std::min(a.pMin.x, b.pMin.x), std::min(a.pMin.y, b.pMin.y), std::min(a.pMin.z, b.pMin.z));
+	ret.pMax = Vector3f(std::max(a.pMax.x, b.pMax.x), std::max(a.pMax.y, b.pMax.y), std::max(a.pMax.z, b.pMax.z));
+	return ret;
+}
+
+inline Bounds3 Union(const Bounds3& b, const Vector3f& p) { return Union(b, Bounds3(p, p)); }
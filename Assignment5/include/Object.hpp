@@ -1,5 +1,6 @@
 #pragma once
 
+#include "Bounds3.hpp"
 #include "Vector.hpp"
 #include "global.hpp"
 
@@ -19,6 +20,18 @@ public:
 
     virtual bool intersect(const Vector3f&, const Vector3f&, float&, uint32_t&, Vector2f&) const = 0;
 
+    // Whether the ray hits the object at a distance t with t * t < maxDistance2,
+    // for shadow rays that only need to know if anything is in the way
+    virtual bool occluded(const Vector3f& orig, const Vector3f& dir, float maxDistance2) const
+    {
+        float tNear = kInfinity;
+        uint32_t index;
+        Vector2f uv;
+        return intersect(orig, dir, tNear, index, uv) && tNear * tNear < maxDistance2;
+    }
+
+    virtual Bounds3 getBounds() const = 0;
+
     virtual void getSurfaceProperties(const Vector3f&, const Vector3f&, const uint32_t&, const Vector2f&, Vector3f&,
                                       Vector2f&) const = 0;
 
@@ -2,6 +2,7 @@
 
 #include <vector>
 #include <memory>
+#include "BVH.hpp"
 #include "Vector.hpp"
 #include "Object.hpp"
 #include "Light.hpp"
@@ -26,8 +27,20 @@ public:
     [[nodiscard]] const std::vector<std::unique_ptr<Object> >& get_objects() const { return objects; }
     [[nodiscard]] const std::vector<std::unique_ptr<Light> >&  get_lights() const { return lights; }
 
+    // Build the BVH over the objects; call again after adding objects
+    void buildBVH();
+
+    // The closest object hit by the ray, with the arguments of Object::intersect
+    // for it, or nullptr. Of objects hit at the same distance the one added
+    // first wins.
+    Object* intersect(const Vector3f& orig, const Vector3f& dir, float& tNear, uint32_t& index, Vector2f& uv) const;
+    // Whether any object is hit at a distance t with t * t < maxDistance2
+    bool occluded(const Vector3f& orig, const Vector3f& dir, float maxDistance2) const;
+
 private:
     // creating the scene (adding objects and lights)
     std::vector<std::unique_ptr<Object> > objects;
     std::vector<std::unique_ptr<Light> > lights;
+    // over objects, by index
+    BVH bvh;
 };
\ No newline at end of file
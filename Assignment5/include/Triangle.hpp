@@ -1,5 +1,6 @@
 #pragma once
 
+#include "BVH.hpp"
 #include "Object.hpp"
 
 #include <cstring>
@@ -41,28 +42,49 @@ public:
 		numTriangles = numTris;
 		stCoordinates = std::unique_ptr<Vector2f[]>(new Vector2f[maxIndex]);
 		memcpy(stCoordinates.get(), st, sizeof(Vector2f) * maxIndex);
+
+		std::vector<Bounds3> bounds;
+		bounds.reserve(numTris);
+		for (uint32_t k = 0; k < numTris; ++k) {
+			const Vector3f& v0 = vertices[vertexIndex[k * 3]];
+			bounds.push_back(Union(Bounds3(v0, vertices[vertexIndex[k * 3 + 1]]), vertices[vertexIndex[k * 3 + 2]]));
+		}
+		bvh.build(bounds);
 	}
 
 	bool intersect(const Vector3f& orig, const Vector3f& dir, float& tnear, uint32_t& index,
 	               Vector2f& uv) const override {
 		bool intersect = false;
-		for (uint32_t k = 0; k < numTriangles; ++k) {
-			const Vector3f& v0 = vertices[vertexIndex[k * 3]];
-			const Vector3f& v1 = vertices[vertexIndex[k * 3 + 1]];
-			const Vector3f& v2 = vertices[vertexIndex[k * 3 + 2]];
+		bvh.traverse(orig, dir, tnear, [&](uint32_t k, float& tNear) {
 			float t, u, v;
-			if (rayTriangleIntersect(v0, v1, v2, orig, dir, t, u, v) && t < tnear) {
-				tnear = t;
+			if (!intersectTriangle(k, orig, dir, t, u, v))
+				return false;
+			// on a tie the lower index wins, as in a loop over the triangles
+			if (t < tNear || (t == tNear && intersect && k < index)) {
+				tNear = t;
 				uv.x = u;
 				uv.y = v;
 				index = k;
-				intersect |= true;
+				intersect = true;
+				return true;
 			}
-		}
+			return false;
+		});
 
 		return intersect;
 	}
 
+	bool occluded(const Vector3f& orig, const Vector3f& dir, float maxDistance2) const override {
+		// boxes are only culled beyond the light, the exact test is per triangle
+		float tMax = std::sqrt(maxDistance2) * 1.0001f;
+		return bvh.traverse(orig, dir, tMax, [&](uint32_t k, float&) {
+			float t, u, v;
+			return intersectTriangle(k, orig, dir, t, u, v) && t * t < maxDistance2;
+		}, true);
+	}
+
+	Bounds3 getBounds() const override { return bvh.bounds(); }
+
 	void getSurfaceProperties(const Vector3f&, const Vector3f&, const uint32_t& index, const Vector2f& uv, Vector3f& N,
 	                          Vector2f& st) const override {
 		const Vector3f& v0 = vertices[vertexIndex[index * 3]];
@@ -87,4 +109,12 @@ public:
 	uint32_t numTriangles;
 	std::unique_ptr<uint32_t[]> vertexIndex;
 	std::unique_ptr<Vector2f[]> stCoordinates;
+	// over the triangles, by index
+	BVH bvh;
+
+private:
+	bool intersectTriangle(uint32_t k, const Vector3f& orig, const Vector3f& dir, float& t, float& u, float& v) const {
+		return rayTriangleIntersect(vertices[vertexIndex[k * 3]], vertices[vertexIndex[k * 3 + 1]],
+		                            vertices[vertexIndex[k * 3 + 2]], orig, dir, t, u, v);
+	}
 };
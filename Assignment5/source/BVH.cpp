@@ -0,0 +1,96 @@
+#include <algorithm>
+#include <numeric>
+#include "BVH.hpp"
+
+void BVH::build(const std::vector<Bounds3>& bounds, int maxPrimsInNode) {
+	nodes.clear();
+	primitives.resize(bounds.size());
+	std::iota(primitives.begin(), primitives.end(), 0u);
+	if (bounds.empty())
+		return;
+	std::vector<Vector3f> centroids;
+	centroids.reserve(bounds.size());
+	for (const Bounds3& b : bounds)
+		centroids.push_back(b.Centroid());
+	nodes.reserve(2 * bounds.size());
+	build(bounds, centroids, 0, (uint32_t)bounds.size(), std::max(1, std::min(maxPrimsInNode, 255)), 0);
+}
+
+static float component(const Vector3f& v, int axis) { return axis == 0 ? v.x : axis == 1 ? v.y : v.z; }
+
+uint32_t BVH::build(const std::vector<Bounds3>& bounds, const std::vector<Vector3f>& centroids, uint32_t start,
+                    uint32_t end, int maxPrimsInNode, int depth) {
+	uint32_t index = (uint32_t)nodes.size();
+	nodes.emplace_back();
+	Bounds3 nodeBounds, centroidBounds;
+	for (uint32_t i = start; i < end; ++i) {
+		nodeBounds = Union(nodeBounds, bounds[primitives[i]]);
+		centroidBounds = Union(centroidBounds, centroids[primitives[i]]);
+	}
+	nodes[index].bounds = nodeBounds;
+
+	uint32_t count = end - start;
+	auto makeLeaf = [&] {
+		nodes[index].offset = start;
+		nodes[index].count = (uint16_t)count;
+		return index;
+	};
+	if (count <= (uint32_t)maxPrimsInNode)
+		return makeLeaf();
+
+	int axis = centroidBounds.maxExtent();
+	float lo = component(centroidBounds.pMin, axis), hi = component(centroidBounds.pMax, axis);
+	auto centroid = [&](uint32_t prim) { return component(centroids[prim], axis); };
+	uint32_t mid = start;
+	if (hi > lo && depth < kMaxSAHDepth) {
+		constexpr int kBuckets = 12;
+		auto bucketOf = [&](uint32_t prim) {
+			return std::min(kBuckets - 1, (int)(kBuckets * (centroid(prim) - lo) / (hi - lo)));
+		};
+		int counts[kBuckets] = {};
+		Bounds3 bucketBounds[kBuckets];
+		for (uint32_t i = start; i < end; ++i) {
+			int b = bucketOf(primitives[i]);
+			counts[b]++;
+			bucketBounds[b] = Union(bucketBounds[b], bounds[primitives[i]]);
+		}
+		// cost of splitting after each bucket, relative to intersecting one
+		// primitive, from a sweep in each direction
+		float cost[kBuckets - 1];
+		Bounds3 below, above;
+		int countBelow = 0, countAbove = 0;
+		for (int b = 0; b < kBuckets - 1; ++b) {
+			below = Union(below, bucketBounds[b]);
+			countBelow += counts[b];
+			cost[b] = countBelow ? countBelow * below.SurfaceArea() : 0;
+		}
+		for (int b = kBuckets - 1; b > 0; --b) {
+			above = Union(above, bucketBounds[b]);
+			countAbove += counts[b];
+			cost[b - 1] += countAbove ? countAbove * above.SurfaceArea() : 0;
+		}
+		float area = nodeBounds.SurfaceArea();
+		int best = 0;
+		for (int b = 1; b < kBuckets - 1; ++b)
+			if (cost[b] < cost[best])
+				best = b;
+		float splitCost = area > 0 ? .125f + cost[best] / area : 0;
+		// a small node stays a leaf if splitting does not pay off
+		if (count <= 16 && splitCost >= count)
+			return makeLeaf();
+		mid = (uint32_t)(std::partition(primitives.begin() + start, primitives.begin() + end,
+		                                [&](uint32_t prim) { return bucketOf(prim) <= best; })
+			- primitives.begin());
+	}
+	if (mid == start || mid == end) {
+		mid = start + count / 2;
+		std::nth_element(primitives.begin() + start, primitives.begin() + mid, primitives.begin() + end,
+		                 [&](uint32_t a, uint32_t b) { return centroid(a) < centroid(b); });
+	}
+
+	nodes[index].axis = (uint8_t)axis;
+	nodes[index].count = 0;
+	build(bounds, centroids, start, mid, maxPrimsInNode, depth + 1);
+	nodes[index].offset = build(bounds, centroids, mid, end, maxPrimsInNode, depth + 1);
+	return index;
+}
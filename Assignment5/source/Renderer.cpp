@@ -69,34 +69,23 @@ float fresnel(const Vector3f& I, const Vector3f& N, const float& ior) {
 }
 
 // [comment]
-// Returns true if the ray intersects an object, false otherwise.
+// Returns the closest hit of the ray, or nothing if it misses every object.
 //
 // \param orig is the ray origin
 // \param dir is the ray direction
-// \param objects is the list of objects the scene contains
-// \param[out] tNear contains the distance to the cloesest intersected object.
-// \param[out] index stores the index of the intersect triangle if the interesected object is a mesh.
-// \param[out] uv stores the u and v barycentric coordinates of the intersected point
-// \param[out] *hitObject stores the pointer to the intersected object (used to retrieve material information, etc.)
-// \param isShadowRay is it a shadow ray. We can return from the function sooner as soon as we have found a hit.
+// \param scene is the scene, whose BVH finds the closest object
 // [/comment]
-std::optional<hit_payload> trace(
-	const Vector3f& orig, const Vector3f& dir,
-	const std::vector<std::unique_ptr<Object>>& objects) {
+std::optional<hit_payload> trace(const Vector3f& orig, const Vector3f& dir, const Scene& scene) {
 	float tNear = kInfinity;
 	std::optional<hit_payload> payload;
-	for (const auto& object : objects) {
-		float tNearK = kInfinity;
-		uint32_t indexK;
-		Vector2f uvK;
-		if (object->intersect(orig, dir, tNearK, indexK, uvK) && tNearK < tNear) {
-			payload.emplace();
-			payload->hit_obj = object.get();
-			payload->tNear = tNearK;
-			payload->index = indexK;
-			payload->uv = uvK;
-			tNear = tNearK;
-		}
+	uint32_t index = 0;
+	Vector2f uv;
+	if (Object* hitObject = scene.intersect(orig, dir, tNear, index, uv)) {
+		payload.emplace();
+		payload->hit_obj = hitObject;
+		payload->tNear = tNear;
+		payload->index = index;
+		payload->uv = uv;
 	}
 
 	return payload;
@@ -126,7 +115,7 @@ Vector3f castRay(
 	}
 
 	Vector3f hitColor = scene.backgroundColor;
-	if (auto payload = trace(orig, dir, scene.get_objects()); payload) {
+	if (auto payload = trace(orig, dir, scene); payload) {
 		Vector3f hitPoint = orig + dir * payload->tNear;
 		Vector3f N; // normal
 		Vector2f st; // st coordinates
@@ -176,8 +165,8 @@ Vector3f castRay(
 				lightDir = normalize(lightDir);
 				float LdotN = std::max(0.f, dotProduct(lightDir, N));
 				// is the point in shadow, and is the nearest occluding object closer to the object than the light itself?
-				auto shadow_res = trace(shadowPointOrig, lightDir, scene.get_objects());
-				bool inShadow = shadow_res && (shadow_res->tNear * shadow_res->tNear < lightDistance2);
+				// Any hit will do, the nearest one is not needed
+				bool inShadow = scene.occluded(shadowPointOrig, lightDir, lightDistance2);
 
 				lightAmt += inShadow ? 0 : light->intensity * LdotN;
 				Vector3f reflectionDirection = reflect(-lightDir, N);
@@ -3,3 +3,44 @@
 //
 
 #include "Scene.hpp"
+#include <cmath>
+
+void Scene::buildBVH() {
+	std::vector<Bounds3> bounds;
+	bounds.reserve(objects.size());
+	for (const auto& object : objects)
+		bounds.push_back(object->getBounds());
+	bvh.build(bounds);
+}
+
+Object* Scene::intersect(const Vector3f& orig, const Vector3f& dir, float& tNear, uint32_t& index,
+                         Vector2f& uv) const {
+	Object* hitObject = nullptr;
+	uint32_t hitIndex = 0;
+	bvh.traverse(orig, dir, tNear, [&](uint32_t k, float& t) {
+		float tNearK = kInfinity;
+		uint32_t indexK;
+		Vector2f uvK;
+		if (!objects[k]->intersect(orig, dir, tNearK, indexK, uvK))
+			return false;
+		if (tNearK < t || (tNearK == t && hitObject && k < hitIndex)) {
+			hitObject = objects[k].get();
+			hitIndex = k;
+			t = tNearK;
+			index = indexK;
+			uv = uvK;
+			return true;
+		}
+		return false;
+	});
+	return hitObject;
+}
+
+bool Scene::occluded(const Vector3f& orig, const Vector3f& dir, float maxDistance2) const
+{
+	// boxes are only culled beyond the light, the exact test is per object
+	float tMax = std::sqrt(maxDistance2) * 1.0001f;
+	return bvh.traverse(orig, dir, tMax, [&](uint32_t k, float&) {
+		return objects[k]->occluded(orig, dir, maxDistance2);
+	}, true);
+}
@@ -3,13 +3,33 @@
 #include "Triangle.hpp"
 #include "Light.hpp"
 #include "Renderer.hpp"
+#include <random>
+#include <string>
+#include <vector>
 
 
 // In the main function of the program, we create the scene (create objects and lights)
 // as well as set the options for the render (image width and height, maximum recursion
 // depth, field-of-view, etc.). We then call the render function().
-int main() {
+//
+// --grid n splits the floor quad into n x n cells of two triangles each and
+// --spheres n scatters n small spheres over it, to see how the render time
+// grows with the size of the scene.
+int main(int argc, char** argv) {
 	Scene scene(1280, 960);
+	uint32_t gridSize = 1;
+	int extraSpheres = 0;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--grid" && i + 1 < argc)
+			gridSize = std::max(1, std::stoi(argv[++i]));
+		else if (arg == "--spheres" && i + 1 < argc)
+			extraSpheres = std::max(0, std::stoi(argv[++i]));
+		else {
+			std::cerr << "usage: " << argv[0] << " [--grid n] [--spheres n]\n";
+			return 1;
+		}
+	}
 
 	auto sph1 = std::make_unique<Sphere>(Vector3f(-1, 0, -12), 2);
 	sph1->materialType = DIFFUSE_AND_GLOSSY;
@@ -22,13 +42,40 @@ int main() {
 	scene.Add(std::move(sph1));
 	scene.Add(std::move(sph2));
 
-	Vector3f verts[4] = {{-5, -3, -6}, {5, -3, -6}, {5, -3, -16}, {-5, -3, -16}};
-	uint32_t vertIndex[6] = {0, 1, 3, 1, 2, 3};
-	Vector2f st[4] = {{0, 0}, {1, 0}, {1, 1}, {0, 1}};
-	auto mesh = std::make_unique<MeshTriangle>(verts, vertIndex, 2, st);
+	// The floor quad from (-5, -3, -6) to (5, -3, -16), as gridSize x
+	// gridSize cells of two triangles each
+	uint32_t n = gridSize;
+	std::vector<Vector3f> verts;
+	std::vector<Vector2f> st;
+	for (uint32_t j = 0; j <= n; ++j) {
+		for (uint32_t i = 0; i <= n; ++i) {
+			float s = i / (float)n, t = j / (float)n;
+			verts.emplace_back(-5 + 10 * s, -3, -6 - 10 * t);
+			st.emplace_back(s, t);
+		}
+	}
+	std::vector<uint32_t> vertIndex;
+	for (uint32_t j = 0; j < n; ++j) {
+		for (uint32_t i = 0; i < n; ++i) {
+			uint32_t v00 = j * (n + 1) + i, v10 = v00 + 1, v01 = v00 + n + 1, v11 = v01 + 1;
+			vertIndex.insert(vertIndex.end(), {v00, v10, v01, v10, v11, v01});
+		}
+	}
+	auto mesh = std::make_unique<MeshTriangle>(verts.data(), vertIndex.data(), 2 * n * n, st.data());
 	mesh->materialType = DIFFUSE_AND_GLOSSY;
 
 	scene.Add(std::move(mesh));
+
+	std::mt19937 rng(7);
+	std::uniform_real_distribution<float> across(-5, 5), along(-16, -6), size(0.05f, 0.2f);
+	for (int i = 0; i < extraSpheres; ++i) {
+		float r = size(rng);
+		auto sph = std::make_unique<Sphere>(Vector3f(across(rng), -3 + r, along(rng)), r);
+		sph->diffuseColor = Vector3f(0.8, 0.6, 0.5);
+		scene.Add(std::move(sph));
+	}
+	scene.buildBVH();
+
 	scene.Add(std::make_unique<Light>(Vector3f(-20, 70, 20), 0.5));
 	scene.Add(std::make_unique<Light>(Vector3f(30, 50, -12), 0.5));
 
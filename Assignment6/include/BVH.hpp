@@ -9,20 +9,55 @@
 #include <atomic>
 #include <vector>
 #include <memory>
-#include <ctime>
+#include <chrono>
 #include "Object.hpp"
 #include "Ray.hpp"
 #include "Bounds3.hpp"
 #include "Intersection.hpp"
 #include "Vector.hpp"
+#include "RayPacket.hpp"
 
 
 struct BVHBuildNode;
 // BVHAccel Forward Declarations
 struct BVHPrimitiveInfo;
 
-// BVHAccel Declarations
-inline int leafNodes, totalLeafNodes, totalPrimitives, interiorNodes;
+struct BVHPrimitiveInfo {
+	BVHPrimitiveInfo() {
+	}
+
+	BVHPrimitiveInfo(size_t primitiveNumber, const Bounds3& bounds)
+		: primitiveNumber(primitiveNumber), bounds(bounds), centroid(.5f * bounds.pMin + .5f * bounds.pMax) {
+	}
+
+	size_t primitiveNumber;
+	Bounds3 bounds;
+	Vector3f centroid;
+};
+
+// Tuning knobs of SAHBuild. The defaults reproduce the original builder.
+struct SAHOptions {
+	// equal slabs of the node bounds the centroids are binned into, per axis
+	int buckets = 7;
+	// evaluate the split planes along all three axes, not only the longest one
+	bool allAxes = false;
+	// cost of visiting a node and of intersecting one primitive
+	float traversalCost = 0.125f;
+	float intersectionCost = 1;
+};
+
+// Shape of a finished BVH, printed after every build
+struct BVHQualityReport {
+	int interiorNodes = 0;
+	int leafNodes = 0;
+	// leavesAtDepth[d] leaves at depth d, the root is at depth 0
+	std::vector<int> leavesAtDepth;
+	// leavesOfSize[n] leaves holding n primitives
+	std::vector<int> leavesOfSize;
+	// expected cost of a ray that hits the root bounds, in the units of SAHOptions
+	double sahCost = 0;
+	double buildMs = 0;
+};
 
 class BVHAccel {
 public:
@@ -30,29 +65,54 @@ public:
 	enum class SplitMethod { NAIVE, SAH };
 
 	// BVHAccel Public Methods
-	BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE);
+	BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE,
+	         const SAHOptions& sah = {});
 	Bounds3 WorldBound() const;
 	~BVHAccel();
 
 	Intersection Intersect(const Ray& ray) const;
 	Intersection getIntersection(BVHBuildNode* node, const Ray& ray) const;
 	bool IntersectP(const Ray& ray) const;
+	// Packet versions of Intersect and of Intersect(ray).happened for the rays
+	// of mask, with the same results. A packet whose directions differ in sign
+	// on some axis is traced one ray at a time.
+	void IntersectPacket(const RayPacket& packet, uint32_t mask, Intersection* hits) const;
+	uint32_t OccludedPacket(const RayPacket& packet, uint32_t mask) const;
 	BVHBuildNode* root;
 
 	// BVHAccel Private Methods
 	BVHBuildNode* BVHBuild(std::vector<Object*> objects);
 
-	BVHBuildNode* SAHBuild(std::vector<Object*> objects);
+	BVHBuildNode* SAHBuild(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end, int depth);
+	void addToReport(const BVHBuildNode* node, int depth, double rootArea);
+	void printReport() const;
+	void intersectLeafPacket(const BVHBuildNode* node, const RayPacket& packet, uint32_t mask, double* tClosest,
+	                         int* closestLeaf, int* closestPrim, Intersection* hits) const;
+	uint32_t occludedLeafPacket(const BVHBuildNode* node, const RayPacket& packet, uint32_t mask) const;
+	// ranges larger than this are built as parallel subtasks
+	static constexpr int parallelBuildThreshold = 4096;
+	// ranges larger than this also compute bounds and SAH buckets in parallel
+	static constexpr int parallelBinThreshold = 65536;
+	// SAHBuild splits at the median below this depth, so no leaf is deeper
+	// than maxDepth - 1 and the packet stacks of maxDepth entries never overflow
+	static constexpr int maxSAHDepth = 32;
+	static constexpr int maxDepth = 64;
 	// BVHAccel Private Data
 	const int maxPrimsInNode;
 	const SplitMethod splitMethod;
+	const SAHOptions sah;
+	// in leaf order after an SAH build, leaves index a range of it
 	std::vector<Object*> primitives;
+	BVHQualityReport report;
+	// The primitives again for the packet kernels, if they are all triangles
+	PacketTriangles triangles;
 };
 
 struct BVHBuildNode {
 	Bounds3 bounds;
 	BVHBuildNode* left;
 	BVHBuildNode* right;
+	// leaf of BVHBuild; SAHBuild leaves hold primitives[firstPrimOffset, +nPrimitives)
 	Object* object;
 
 public:
@@ -10,6 +10,7 @@
 #include "Bounds3.hpp"
 #include "Ray.hpp"
 #include "Intersection.hpp"
+#include "RayPacket.hpp"
 
 class Object
 {
@@ -22,6 +23,24 @@ public:
     virtual void getSurfaceProperties(const Vector3f &, const Vector3f &, const uint32_t &, const Vector2f &, Vector3f &, Vector2f &) const = 0;
     virtual Vector3f evalDiffuseColor(const Vector2f &) const =0;
     virtual Bounds3 getBounds()=0;
+
+    // Packet versions of getIntersection and of getIntersection().happened
+    // for the rays of packet whose bit is set in mask. By default the rays
+    // are traced one at a time.
+    virtual void getIntersections(const RayPacket& packet, uint32_t mask, Intersection* hits) {
+        for (int k = 0; k < packet.size; ++k)
+            if (mask >> k & 1) hits[k] = getIntersection(packet.ray(k));
+    }
+    virtual uint32_t occluded(const RayPacket& packet, uint32_t mask) {
+        uint32_t hit = 0;
+        for (int k = 0; k < packet.size; ++k)
+            if ((mask >> k & 1) && getIntersection(packet.ray(k)).happened) hit |= 1u << k;
+        return hit;
+    }
+
+    // Triangles return their first vertex, edges and normal so BVHAccel can
+    // test them against packets with SIMD kernels
+    virtual bool getTriangle(Vector3f &v0, Vector3f &e1, Vector3f &e2, Vector3f &normal) const { return false; }
 };
 
 
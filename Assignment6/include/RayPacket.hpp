@@ -0,0 +1,52 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "Ray.hpp"
+
+// Up to kMaxPacketSize rays traced through the BVH together, e.g. the primary
+// rays of a 4x4 pixel block or their shadow rays toward one light. The rays
+// are stored as arrays of components so four of them load into one SSE
+// register; the lanes past size stay zero. Masks select rays by bit.
+constexpr int kMaxPacketSize = 16;
+
+struct RayPacket {
+	int size = 0;
+	alignas(16) float ox[kMaxPacketSize] = {}, oy[kMaxPacketSize] = {}, oz[kMaxPacketSize] = {};
+	alignas(16) float dx[kMaxPacketSize] = {}, dy[kMaxPacketSize] = {}, dz[kMaxPacketSize] = {};
+	// Ray::direction_inv of every ray
+	alignas(16) float ix[kMaxPacketSize] = {}, iy[kMaxPacketSize] = {}, iz[kMaxPacketSize] = {};
+
+	void add(const Ray& ray) {
+		int k = size++;
+		ox[k] = ray.origin.x, oy[k] = ray.origin.y, oz[k] = ray.origin.z;
+		dx[k] = ray.direction.x, dy[k] = ray.direction.y, dz[k] = ray.direction.z;
+		ix[k] = ray.direction_inv.x, iy[k] = ray.direction_inv.y, iz[k] = ray.direction_inv.z;
+	}
+
+	Ray ray(int k) const { return Ray(Vector3f(ox[k], oy[k], oz[k]), Vector3f(dx[k], dy[k], dz[k])); }
+
+	uint32_t all() const { return (1u << size) - 1; }
+};
+
+// Triangles in structure-of-arrays form for the packet kernels: first
+// vertex, the two edges and the normal, as kept by Triangle
+struct PacketTriangles {
+	std::vector<float> v0x, v0y, v0z;
+	std::vector<float> e1x, e1y, e1z;
+	std::vector<float> e2x, e2y, e2z;
+	std::vector<float> nx, ny, nz;
+
+	int size() const { return (int)v0x.size(); }
+	void add(const Vector3f& v0, const Vector3f& e1, const Vector3f& e2, const Vector3f& normal);
+
+	// Rays of mask that hit triangle tri, with their distances written to
+	// t. Same arithmetic as Triangle::getIntersection, so the results match
+	// it exactly; the single precision part runs four rays at a time.
+	uint32_t intersect(int tri, const RayPacket& packet, uint32_t mask, double* t) const;
+};
+
+// Rays of mask that pass the slab test of Bounds3::IntersectP against the
+// box [pMin, pMax] and enter it no later than tMax. dirIsNeg is shared by
+// all rays of the packet.
+uint32_t packetEntersBox(const Vector3f& pMin, const Vector3f& pMax, const RayPacket& packet, uint32_t mask,
+                         const int* dirIsNeg, const double* tMax);
@@ -3,7 +3,10 @@
 //
 #pragma once
 
+#include <vector>
 #include "Scene.hpp"
+#include "TaskQueue.hpp"
+#include "ThreadPool.hpp"
 
 struct hit_payload {
 	float tNear;
@@ -12,9 +15,27 @@ struct hit_payload {
 	Object* hit_obj;
 };
 
+struct RenderOptions {
+	// edge length of the square tiles handed to the worker threads
+	int tileSize = 32;
+	// trace the primary rays of packetSize x packetSize pixel blocks together,
+	// 2 or 4; 1 traces every pixel on its own. The image is the same.
+	int packetSize = 1;
+};
+
 class Renderer {
 public:
+	explicit Renderer(const RenderOptions& options = {}) : options(options) {}
+
+	// Render with the global thread pool and write binary.ppm
 	void Render(const Scene& scene);
+	// Trace every pixel into a framebuffer, on the tiles of pool or serially
+	// row by row if pool is null. Every pixel is computed on its own, so the
+	// result is the same for any pool size.
+	std::vector<Vector3f> RenderFramebuffer(const Scene& scene, ThreadPool* pool, bool showProgress = true) const;
 
 private:
+	void renderTile(const Scene& scene, const TileTask& tile, std::vector<Vector3f>& framebuffer) const;
+
+	RenderOptions options;
 };
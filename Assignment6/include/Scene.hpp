@@ -34,6 +34,17 @@ public:
 	BVHAccel* bvh;
 	void buildBVH();
 	Vector3f castRay(const Ray& ray_in, int depth) const;
+	// castRay for the primary rays of packet, written to colors. The closest
+	// hits and the shadow rays toward each point light are traced as packets;
+	// reflection and refraction continue one ray at a time.
+	void castPacket(const RayPacket& packet, Vector3f* colors) const;
+	// Color along ray_in given its closest hit. shadowed, if set, holds for
+	// every light whether it is blocked, instead of tracing shadow rays.
+	Vector3f shade(const Ray& ray_in, const Intersection& intersection, int depth,
+	               const char* shadowed = nullptr) const;
+	// Shadow ray from hitPoint toward the point light at lightPos, offset to
+	// the side of the surface with normal N that ray_in came from
+	Ray shadowRay(const Ray& ray_in, const Vector3f& hitPoint, const Vector3f& N, const Vector3f& lightPos) const;
 	bool trace(const Ray& ray, const std::vector<Object*>& objects, float& tNear, uint32_t& index, Object** hitObject);
 	std::tuple<Vector3f, Vector3f> HandleAreaLight(const AreaLight& light, const Vector3f& hitPoint, const Vector3f& N,
 	                                               const Vector3f& shadowPointOrig,
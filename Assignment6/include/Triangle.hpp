@@ -67,11 +67,17 @@ public:
 
 	Vector3f evalDiffuseColor(const Vector2f&) const override;
 	Bounds3 getBounds() override;
+
+	bool getTriangle(Vector3f& v0, Vector3f& e1, Vector3f& e2, Vector3f& normal) const override {
+		v0 = this->v0, e1 = this->e1, e2 = this->e2, normal = this->normal;
+		return true;
+	}
 };
 
 class MeshTriangle : public Object {
 public:
-	MeshTriangle(const std::string& filename) {
+	// maxPrimsInNode and sah tune the BVH over the triangles
+	MeshTriangle(const std::string& filename, int maxPrimsInNode = 1, const SAHOptions& sah = {}) {
 		objl::Loader loader;
 		loader.LoadFile(filename);
 
@@ -122,7 +128,7 @@ public:
 		for (auto& tri : triangles)
 			ptrs.push_back(&tri);
 
-		bvh = new BVHAccel(ptrs);
+		bvh = new BVHAccel(ptrs, maxPrimsInNode, BVHAccel::SplitMethod::SAH, sah);
 	}
 
 	bool intersect(const Ray& ray) { return true; }
@@ -179,6 +185,12 @@ public:
 		return intersec;
 	}
 
+	void getIntersections(const RayPacket& packet, uint32_t mask, Intersection* hits) override {
+		bvh->IntersectPacket(packet, mask, hits);
+	}
+
+	uint32_t occluded(const RayPacket& packet, uint32_t mask) override { return bvh->OccludedPacket(packet, mask); }
+
 	Bounds3 bounding_box;
 	std::unique_ptr<Vector3f[]> vertices;
 	uint32_t numTriangles;
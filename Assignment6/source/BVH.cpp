@@ -1,26 +1,91 @@
 #include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <mutex>
 #include "BVH.hpp"
+#include "ThreadPool.hpp"
 
 
-BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode, SplitMethod splitMethod)
-	: maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod), primitives(std::move(p)) {
-	time_t start, stop;
-	time(&start);
+BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode, SplitMethod splitMethod, const SAHOptions& sah)
+	: root(nullptr), maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod), sah(sah),
+	  primitives(std::move(p)) {
+	auto start = std::chrono::steady_clock::now();
 	if (primitives.empty()) {
 		return;
 	}
 
+	// Cache bounds and centroids once; SAHBuild partitions this one array in place
+	std::vector<BVHPrimitiveInfo> primitiveInfo(primitives.size());
+	parallelFor((int)primitives.size(), parallelBuildThreshold, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			primitiveInfo[i] = {(size_t)i, primitives[i]->getBounds()};
+		}
+	});
+
 	//root = BVHBuild(primitives);
-	root = SAHBuild(primitives);
+	root = SAHBuild(primitiveInfo, 0, (int)primitiveInfo.size(), 0);
 
-	time(&stop);
-	double diff = difftime(stop, start);
-	int hrs = (int)diff / 3600;
-	int mins = ((int)diff / 60) - (hrs * 60);
-	int secs = (int)diff - (hrs * 3600) - (mins * 60);
+	// Leaves refer to ranges of primitiveInfo, put the primitives in that order
+	std::vector<Object*> ordered(primitives.size());
+	for (size_t i = 0; i < ordered.size(); ++i)
+		ordered[i] = primitives[primitiveInfo[i].primitiveNumber];
+	primitives.swap(ordered);
 
-	printf("\rBVH Generation complete: \nTime Taken: %i hrs, %i mins, %i secs\n\n", hrs, mins, secs);
+	Vector3f v0, e1, e2, normal;
+	if (std::all_of(primitives.begin(), primitives.end(),
+	                [&](Object* prim) { return prim->getTriangle(v0, e1, e2, normal); })) {
+		for (Object* prim : primitives) {
+			prim->getTriangle(v0, e1, e2, normal);
+			triangles.add(v0, e1, e2, normal);
+		}
+	}
+
+	report.buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	addToReport(root, 0, root->bounds.SurfaceArea());
+	// a leaf at depth d leaves at most d + 1 entries on the packet stacks
+	assert((int)report.leavesAtDepth.size() <= maxDepth);
+	printReport();
+}
+
+void BVHAccel::addToReport(const BVHBuildNode* node, int depth, double rootArea) {
+	// probability that a ray through the root bounds also hits the node
+	double hitProbability = rootArea > 0 ? node->bounds.SurfaceArea() / rootArea : 1;
+	if (node->left == nullptr && node->right == nullptr) {
+		report.leafNodes++;
+		if ((int)report.leavesAtDepth.size() <= depth)
+			report.leavesAtDepth.resize(depth + 1);
+		report.leavesAtDepth[depth]++;
+		int n = node->object ? 1 : node->nPrimitives;
+		if ((int)report.leavesOfSize.size() <= n)
+			report.leavesOfSize.resize(n + 1);
+		report.leavesOfSize[n]++;
+		report.sahCost += hitProbability * n * sah.intersectionCost;
+		return;
+	}
+	report.interiorNodes++;
+	report.sahCost += hitProbability * sah.traversalCost;
+	if (node->left)
+		addToReport(node->left, depth + 1, rootArea);
+	if (node->right)
+		addToReport(node->right, depth + 1, rootArea);
+}
+
+void BVHAccel::printReport() const {
+	printf("\rBVH Generation complete: \nTime Taken: %.2f ms\n", report.buildMs);
+	printf("SAH build, %d buckets (%s), %zu primitives, %d interior nodes, %d leaves, depth %d, SAH cost %.2f\n",
+	       sah.buckets, sah.allAxes ? "all axes" : "longest axis", primitives.size(), report.interiorNodes,
+	       report.leafNodes, (int)report.leavesAtDepth.size() - 1, report.sahCost);
+	printf("  leaves by depth:");
+	for (int d = 0; d < (int)report.leavesAtDepth.size(); ++d) {
+		if (report.leavesAtDepth[d] > 0)
+			printf(" %d:%d", d, report.leavesAtDepth[d]);
+	}
+	printf("\n  leaves by size: ");
+	for (int n = 0; n < (int)report.leavesOfSize.size(); ++n) {
+		if (report.leavesOfSize[n] > 0)
+			printf(" %d:%d", n, report.leavesOfSize[n]);
+	}
+	printf("\n\n");
 }
 
 BVHBuildNode* BVHAccel::BVHBuild(std::vector<Object*> objects) {
@@ -88,74 +153,177 @@ BVHBuildNode* BVHAccel::BVHBuild(std::vector<Object*> objects) {
 	return node;
 }
 
-BVHBuildNode* BVHAccel::SAHBuild(std::vector<Object*> objects) {
+BVHBuildNode* BVHAccel::SAHBuild(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end, int depth) {
 	BVHBuildNode* node = new BVHBuildNode();
-	if (objects.size() == 1) {
-		node->bounds = objects[0]->getBounds();
-		node->object = objects[0];
-		node->left = nullptr;
-		node->right = nullptr;
-		return node;
-	}
+	int nPrimitives = end - start;
 
-	const static float tTisect = 1;
-	const static float tTrav = 0.125;
-	const static int buckets_num = 7;
+	struct Bucket {
+		int count = 0;
+		Bounds3 bounds;
+	};
 
+	// Bounds of the node, summed over chunks in parallel for large ranges
 	Bounds3 bounds3;
-	for (auto& object : objects) {
-		bounds3 = Union(bounds3, object->getBounds());
+	auto boundRange = [&](int begin, int stop, Bounds3& b) {
+		for (int i = begin; i < stop; i++) {
+			b = Union(b, primitiveInfo[i].bounds);
+		}
+	};
+	std::mutex mutex;
+	if (nPrimitives < parallelBinThreshold) {
+		boundRange(start, end, bounds3);
+	}
+	else {
+		parallelFor(nPrimitives, parallelBinThreshold / 4, [&](int begin, int stop) {
+			Bounds3 b;
+			boundRange(start + begin, start + stop, b);
+			std::lock_guard<std::mutex> lock(mutex);
+			bounds3 = Union(bounds3, b);
+		});
 	}
 	node->bounds = bounds3;
-	double bounds3_S = bounds3.SurfaceArea();
+	node->left = nullptr;
+	node->right = nullptr;
+	if (nPrimitives == 1) {
+		node->firstPrimOffset = start;
+		node->nPrimitives = 1;
+		return node;
+	}
 
-	int axis = bounds3.maxExtent();
-	std::ranges::sort(objects, [axis](auto f1, auto f2) {
-		return f1->getBounds().Centroid()[axis] < f2->getBounds().Centroid()[axis];
-	});
+	auto splitAtMedian = [&](int axis) {
+		int mid = (start + end) / 2;
+		std::nth_element(&primitiveInfo[start], &primitiveInfo[mid], &primitiveInfo[end - 1] + 1,
+		                 [axis](const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b) {
+			                 return a.centroid[axis] < b.centroid[axis];
+		                 });
+		return mid;
+	};
+	auto buildChildren = [&](int mid) {
+		if (nPrimitives > parallelBuildThreshold) {
+			// Both halves are disjoint ranges of primitiveInfo, build them concurrently
+			TaskGroup group;
+			group.run([&]() { node->left = SAHBuild(primitiveInfo, start, mid, depth + 1); });
+			node->right = SAHBuild(primitiveInfo, mid, end, depth + 1);
+			group.wait();
+		}
+		else {
+			node->left = SAHBuild(primitiveInfo, start, mid, depth + 1);
+			node->right = SAHBuild(primitiveInfo, mid, end, depth + 1);
+		}
+	};
 
-	unsigned int best_mid = 0;
-	double min_cost = std::numeric_limits<double>::max();
+	// Deeper than maxSAHDepth split at the median, which keeps the tree
+	// within the packet traversal stacks for any primitive count
+	if (depth >= maxSAHDepth) {
+		if (nPrimitives <= maxPrimsInNode) {
+			node->firstPrimOffset = start;
+			node->nPrimitives = nPrimitives;
+			return node;
+		}
+		node->splitAxis = bounds3.maxExtent();
+		buildChildren(splitAtMedian(node->splitAxis));
+		return node;
+	}
 
-	for (int i(1); i < buckets_num; i++) {
-		float mid = bounds3.pMin[axis] + i * bounds3.Diagonal()[axis] / buckets_num;
-		unsigned int current_mid = 0;
-		double cost = min_cost;
-		Bounds3 left_bounds3;
-		Bounds3 right_bounds3;
-		for (unsigned j(0); j < objects.size(); j++) {
-			if (objects[j]->getBounds().Centroid()[axis] <= mid) {
-				left_bounds3 = Union(left_bounds3, objects[j]->getBounds());
+	// Drop the centroids into equal slabs of the node along its longest axis,
+	// or along all three
+	int nBuckets = std::max(2, sah.buckets);
+	int longestAxis = bounds3.maxExtent();
+	int firstAxis = sah.allAxes ? 0 : longestAxis;
+	int lastAxis = sah.allAxes ? 2 : longestAxis;
+	Vector3f axisMin = bounds3.pMin;
+	Vector3f axisExtent = bounds3.Diagonal();
+	auto bucketOf = [&](const BVHPrimitiveInfo& info, int axis) {
+		int b = axisExtent[axis] > 0 ? (int)(nBuckets * (info.centroid[axis] - axisMin[axis]) / axisExtent[axis]) : 0;
+		return std::clamp(b, 0, nBuckets - 1);
+	};
+	// buckets[axis * nBuckets + b]
+	std::vector<Bucket> buckets(3 * nBuckets);
+	auto binRange = [&](int begin, int stop, Bucket* bins) {
+		for (int i = begin; i < stop; i++) {
+			for (int axis = firstAxis; axis <= lastAxis; axis++) {
+				Bucket& bin = bins[axis * nBuckets + bucketOf(primitiveInfo[i], axis)];
+				bin.count++;
+				bin.bounds = Union(bin.bounds, primitiveInfo[i].bounds);
 			}
-			else {
-				if (current_mid == 0) {
-					current_mid = j;
-				}
-				right_bounds3 = Union(right_bounds3, objects[j]->getBounds());
+		}
+	};
+	if (nPrimitives < parallelBinThreshold) {
+		binRange(start, end, buckets.data());
+	}
+	else {
+		parallelFor(nPrimitives, parallelBinThreshold / 4, [&](int begin, int stop) {
+			std::vector<Bucket> bins(3 * nBuckets);
+			binRange(start + begin, start + stop, bins.data());
+			std::lock_guard<std::mutex> lock(mutex);
+			for (int b = 0; b < 3 * nBuckets; b++) {
+				buckets[b].count += bins[b].count;
+				buckets[b].bounds = Union(buckets[b].bounds, bins[b].bounds);
 			}
+		});
+	}
+
+	// Evaluate the split planes between buckets, both sides must keep a
+	// primitive. The right sides are summed up first so every axis takes
+	// one sweep in each direction.
+	int best_axis = longestAxis;
+	int best_split = 0;
+	double min_cost = std::numeric_limits<double>::max();
+	std::vector<Bounds3> right_bounds(nBuckets);
+	std::vector<int> right_counts(nBuckets);
+	for (int axis = firstAxis; axis <= lastAxis; axis++) {
+		const Bucket* bins = &buckets[axis * nBuckets];
+		Bounds3 right_bounds3;
+		int right_count = 0;
+		for (int i = nBuckets - 1; i >= 1; i--) {
+			right_bounds3 = Union(right_bounds3, bins[i].bounds);
+			right_count += bins[i].count;
+			right_bounds[i] = right_bounds3;
+			right_counts[i] = right_count;
 		}
-		cost = (
-			left_bounds3.SurfaceArea() * (current_mid - 1) +
-			right_bounds3.SurfaceArea() * (objects.size() - current_mid)
-		) * tTisect / bounds3.SurfaceArea() + tTrav;
+		Bounds3 left_bounds3;
+		int left_count = 0;
+		for (int i = 1; i < nBuckets; i++) {
+			left_bounds3 = Union(left_bounds3, bins[i - 1].bounds);
+			left_count += bins[i - 1].count;
+			if (left_count == 0 || right_counts[i] == 0) {
+				continue;
+			}
+			double cost = (
+				left_bounds3.SurfaceArea() * left_count +
+				right_bounds[i].SurfaceArea() * right_counts[i]
+			) * sah.intersectionCost / bounds3.SurfaceArea() + sah.traversalCost;
 
-		if (cost < min_cost) {
-			min_cost = cost;
-			best_mid = current_mid;
+			if (cost < min_cost) {
+				min_cost = cost;
+				best_axis = axis;
+				best_split = i;
+			}
 		}
 	}
-	if (best_mid == 0 || best_mid == objects.size() - 1) {
-		best_mid = std::ceil((objects.size() - 1) / 2.0f);
-	}
-
-	auto mid = objects.begin() + best_mid;
-	std::vector<Object*> leftshapes(objects.begin(), mid);
-	std::vector<Object*> rightshapes(mid, objects.end());
-	assert(objects.size() == (leftshapes.size() + rightshapes.size()));
 
-	node->left = SAHBuild(leftshapes);
-	node->right = SAHBuild(rightshapes);
+	// Stop if intersecting everything here is no more expensive than any split
+	if (nPrimitives <= maxPrimsInNode && nPrimitives * sah.intersectionCost <= min_cost) {
+		node->firstPrimOffset = start;
+		node->nPrimitives = nPrimitives;
+		return node;
+	}
 
+	int mid;
+	if (best_split == 0) {
+		// All centroids fall into one bucket, split at the median instead
+		mid = splitAtMedian(best_axis);
+	}
+	else {
+		BVHPrimitiveInfo* pmid = std::partition(&primitiveInfo[start], &primitiveInfo[end - 1] + 1,
+		                                        [&](const BVHPrimitiveInfo& info) {
+			                                        return bucketOf(info, best_axis) < best_split;
+		                                        });
+		mid = (int)(pmid - &primitiveInfo[0]);
+	}
+	assert(start < mid && mid < end);
+	node->splitAxis = best_axis;
+	buildChildren(mid);
 	return node;
 }
 
@@ -174,7 +342,13 @@ Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
 	const std::array<int, 3> dirIsNeg{int(ray.direction.x > 0), int(ray.direction.y > 0), int(ray.direction.z > 0)};
 	if (node->bounds.IntersectP(ray, ray.direction_inv, dirIsNeg)) {
 		if (node->left == nullptr && node->right == nullptr) {
-			isect = node->object->getIntersection(ray);
+			if (node->object)
+				return node->object->getIntersection(ray);
+			for (int i = 0; i < node->nPrimitives; ++i) {
+				Intersection hit = primitives[node->firstPrimOffset + i]->getIntersection(ray);
+				if (hit.happened && hit.distance < isect.distance)
+					isect = hit;
+			}
 			return isect;
 		}
 		else {
@@ -191,3 +365,222 @@ Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
 	}
 	return isect;
 }
+
+// Ranges of the origins and inverse directions of the rays of a packet. If
+// every axis has one direction sign, interval arithmetic on them bounds the
+// slab distances of all rays at once.
+struct PacketInterval {
+	bool coherent = true;
+	std::array<int, 3> dirIsNeg;
+	float oMin[3], oMax[3], invMin[3], invMax[3];
+
+	PacketInterval(const RayPacket& packet, uint32_t mask) {
+		const float* origin[3] = {packet.ox, packet.oy, packet.oz};
+		const float* dir[3] = {packet.dx, packet.dy, packet.dz};
+		const float* invDir[3] = {packet.ix, packet.iy, packet.iz};
+		int first = 0;
+		while (!(mask >> first & 1))
+			++first;
+		for (int i = 0; i < 3; ++i) {
+			dirIsNeg[i] = int(dir[i][first] > 0);
+			oMin[i] = oMax[i] = origin[i][first];
+			invMin[i] = invMax[i] = invDir[i][first];
+			for (int k = first; k < packet.size; ++k) {
+				if (!(mask >> k & 1))
+					continue;
+				// zero directions make the slab distances infinite or undefined
+				if (dir[i][k] == 0 || int(dir[i][k] > 0) != dirIsNeg[i])
+					coherent = false;
+				oMin[i] = std::min(oMin[i], origin[i][k]);
+				oMax[i] = std::max(oMax[i], origin[i][k]);
+				invMin[i] = std::min(invMin[i], invDir[i][k]);
+				invMax[i] = std::max(invMax[i], invDir[i][k]);
+			}
+		}
+	}
+
+	// False if no ray can pass the slab test of b or enter it before tMax.
+	// Rounding is monotonic, so the corners bound the per ray values exactly.
+	bool mayHit(const Bounds3& b, double tMax) const {
+		float tIn = std::numeric_limits<float>::lowest();
+		float tOut = std::numeric_limits<float>::max();
+		for (int i = 0; i < 3; ++i) {
+			float nearPlane = dirIsNeg[i] > 0 ? b.pMin[i] : b.pMax[i];
+			float farPlane = dirIsNeg[i] > 0 ? b.pMax[i] : b.pMin[i];
+			float n0 = (nearPlane - oMax[i]), n1 = (nearPlane - oMin[i]);
+			float f0 = (farPlane - oMax[i]), f1 = (farPlane - oMin[i]);
+			tIn = std::max(tIn, std::min({n0 * invMin[i], n0 * invMax[i], n1 * invMin[i], n1 * invMax[i]}));
+			tOut = std::min(tOut, std::max({f0 * invMin[i], f0 * invMax[i], f1 * invMin[i], f1 * invMax[i]}));
+		}
+		return tIn < tOut && tOut > 0 && tIn <= tMax;
+	}
+};
+
+// Masked packet traversal: every stack entry carries the rays that entered
+// all boxes above it, the whole packet skips a node if the interval test
+// rules it out, and children are visited near first along the split axis.
+void BVHAccel::IntersectPacket(const RayPacket& packet, uint32_t mask, Intersection* hits) const {
+	for (int k = 0; k < packet.size; ++k) {
+		if (mask >> k & 1)
+			hits[k] = Intersection();
+	}
+	if (!root || mask == 0)
+		return;
+	PacketInterval interval(packet, mask);
+	if (!interval.coherent) {
+		for (int k = 0; k < packet.size; ++k) {
+			if (mask >> k & 1)
+				hits[k] = Intersect(packet.ray(k));
+		}
+		return;
+	}
+
+	// Closest hit so far of every ray, and the leaf it is in. A later leaf
+	// wins a tie like in getIntersection, an earlier primitive of the same leaf.
+	double tClosest[kMaxPacketSize];
+	int closestLeaf[kMaxPacketSize], closestPrim[kMaxPacketSize];
+	std::fill(tClosest, tClosest + kMaxPacketSize, std::numeric_limits<double>::max());
+	std::fill(closestLeaf, closestLeaf + kMaxPacketSize, -1);
+	std::fill(closestPrim, closestPrim + kMaxPacketSize, -1);
+
+	struct StackEntry {
+		const BVHBuildNode* node;
+		uint32_t mask;
+	};
+	StackEntry stack[maxDepth];
+	int top = 0;
+	stack[top++] = {root, mask};
+	while (top > 0) {
+		StackEntry entry = stack[--top];
+		const BVHBuildNode* node = entry.node;
+		double tMax = 0;
+		for (int k = 0; k < packet.size; ++k) {
+			if (entry.mask >> k & 1)
+				tMax = std::max(tMax, tClosest[k]);
+		}
+		if (!interval.mayHit(node->bounds, tMax))
+			continue;
+		uint32_t active = packetEntersBox(node->bounds.pMin, node->bounds.pMax, packet, entry.mask,
+		                                  interval.dirIsNeg.data(), tClosest);
+		if (active == 0)
+			continue;
+		if (node->left == nullptr && node->right == nullptr) {
+			intersectLeafPacket(node, packet, active, tClosest, closestLeaf, closestPrim, hits);
+			continue;
+		}
+		// the left child holds the lower coordinates along the split axis
+		const BVHBuildNode* nearChild = interval.dirIsNeg[node->splitAxis] ? node->left : node->right;
+		const BVHBuildNode* farChild = nearChild == node->left ? node->right : node->left;
+		if (farChild)
+			stack[top++] = {farChild, active};
+		if (nearChild)
+			stack[top++] = {nearChild, active};
+	}
+
+	for (int k = 0; k < packet.size; ++k) {
+		if (closestPrim[k] >= 0)
+			hits[k] = primitives[closestPrim[k]]->getIntersection(packet.ray(k));
+	}
+}
+
+void BVHAccel::intersectLeafPacket(const BVHBuildNode* node, const RayPacket& packet, uint32_t mask,
+                                   double* tClosest, int* closestLeaf, int* closestPrim, Intersection* hits) const {
+	int leaf = node->firstPrimOffset;
+	auto closer = [&](int k, double t) {
+		return t < tClosest[k] || (t == tClosest[k] && leaf > closestLeaf[k]);
+	};
+	if (triangles.size() > 0) {
+		double t[kMaxPacketSize];
+		for (int i = 0; i < node->nPrimitives; ++i) {
+			int prim = node->firstPrimOffset + i;
+			uint32_t hit = triangles.intersect(prim, packet, mask, t);
+			for (int k = 0; hit != 0; ++k, hit >>= 1) {
+				if ((hit & 1) && closer(k, t[k])) {
+					tClosest[k] = t[k];
+					closestLeaf[k] = leaf;
+					closestPrim[k] = prim;
+				}
+			}
+		}
+		return;
+	}
+
+	Intersection objectHits[kMaxPacketSize];
+	int nPrimitives = node->object ? 1 : node->nPrimitives;
+	for (int i = 0; i < nPrimitives; ++i) {
+		Object* object = node->object ? node->object : primitives[node->firstPrimOffset + i];
+		object->getIntersections(packet, mask, objectHits);
+		for (int k = 0; k < packet.size; ++k) {
+			if ((mask >> k & 1) && objectHits[k].happened && closer(k, objectHits[k].distance)) {
+				tClosest[k] = objectHits[k].distance;
+				closestLeaf[k] = leaf;
+				hits[k] = objectHits[k];
+			}
+		}
+	}
+}
+
+uint32_t BVHAccel::OccludedPacket(const RayPacket& packet, uint32_t mask) const {
+	if (!root || mask == 0)
+		return 0;
+	PacketInterval interval(packet, mask);
+	if (!interval.coherent) {
+		uint32_t occluded = 0;
+		for (int k = 0; k < packet.size; ++k) {
+			if ((mask >> k & 1) && Intersect(packet.ray(k)).happened)
+				occluded |= 1u << k;
+		}
+		return occluded;
+	}
+
+	double tMax[kMaxPacketSize];
+	std::fill(tMax, tMax + kMaxPacketSize, std::numeric_limits<double>::max());
+	uint32_t occluded = 0;
+	struct StackEntry {
+		const BVHBuildNode* node;
+		uint32_t mask;
+	};
+	StackEntry stack[maxDepth];
+	int top = 0;
+	stack[top++] = {root, mask};
+	while (top > 0 && occluded != mask) {
+		StackEntry entry = stack[--top];
+		// rays that found an occluder meanwhile are done
+		uint32_t active = entry.mask & ~occluded;
+		if (active == 0 || !interval.mayHit(entry.node->bounds, std::numeric_limits<double>::max()))
+			continue;
+		active = packetEntersBox(entry.node->bounds.pMin, entry.node->bounds.pMax, packet, active,
+		                         interval.dirIsNeg.data(), tMax);
+		if (active == 0)
+			continue;
+		const BVHBuildNode* node = entry.node;
+		if (node->left == nullptr && node->right == nullptr) {
+			occluded |= occludedLeafPacket(node, packet, active);
+			continue;
+		}
+		const BVHBuildNode* nearChild = interval.dirIsNeg[node->splitAxis] ? node->left : node->right;
+		const BVHBuildNode* farChild = nearChild == node->left ? node->right : node->left;
+		if (farChild)
+			stack[top++] = {farChild, active};
+		if (nearChild)
+			stack[top++] = {nearChild, active};
+	}
+	return occluded;
+}
+
+uint32_t BVHAccel::occludedLeafPacket(const BVHBuildNode* node, const RayPacket& packet, uint32_t mask) const {
+	uint32_t occluded = 0;
+	int nPrimitives = node->object ? 1 : node->nPrimitives;
+	for (int i = 0; i < nPrimitives && occluded != mask; ++i) {
+		uint32_t active = mask & ~occluded;
+		if (triangles.size() > 0) {
+			double t[kMaxPacketSize];
+			occluded |= triangles.intersect(node->firstPrimOffset + i, packet, active, t);
+		}
+		else {
+			Object* object = node->object ? node->object : primitives[node->firstPrimOffset + i];
+			occluded |= object->occluded(packet, active);
+		}
+	}
+	return occluded;
+}
@@ -0,0 +1,137 @@
+#include <algorithm>
+#include <cmath>
+#include "RayPacket.hpp"
+#include "global.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64)
+// SSE2 is part of x86-64, no runtime check needed
+#define RT_PACKET_SSE
+#include <emmintrin.h>
+#endif
+
+void PacketTriangles::add(const Vector3f& v0, const Vector3f& e1, const Vector3f& e2, const Vector3f& normal) {
+	v0x.push_back(v0.x), v0y.push_back(v0.y), v0z.push_back(v0.z);
+	e1x.push_back(e1.x), e1y.push_back(e1.y), e1z.push_back(e1.z);
+	e2x.push_back(e2.x), e2y.push_back(e2.y), e2z.push_back(e2.z);
+	nx.push_back(normal.x), ny.push_back(normal.y), nz.push_back(normal.z);
+}
+
+// The single precision dot and cross products of Triangle::getIntersection
+// for the four rays from first, each in the order Vector.hpp evaluates them
+static void triangleProducts(const PacketTriangles& tris, int tri, const RayPacket& packet, int first,
+                             float* facing, float* det, float* uDot, float* vDot, float* tDot) {
+#ifdef RT_PACKET_SSE
+	__m128 dx = _mm_load_ps(packet.dx + first), dy = _mm_load_ps(packet.dy + first), dz = _mm_load_ps(packet.dz + first);
+	__m128 e1x = _mm_set1_ps(tris.e1x[tri]), e1y = _mm_set1_ps(tris.e1y[tri]), e1z = _mm_set1_ps(tris.e1z[tri]);
+	__m128 e2x = _mm_set1_ps(tris.e2x[tri]), e2y = _mm_set1_ps(tris.e2y[tri]), e2z = _mm_set1_ps(tris.e2z[tri]);
+	auto dot = [](__m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by, __m128 bz) {
+		return _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)), _mm_mul_ps(az, bz));
+	};
+	_mm_storeu_ps(facing, dot(dx, dy, dz, _mm_set1_ps(tris.nx[tri]), _mm_set1_ps(tris.ny[tri]),
+	                          _mm_set1_ps(tris.nz[tri])));
+	// pvec = dir x e2
+	__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+	__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+	__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+	_mm_storeu_ps(det, dot(e1x, e1y, e1z, px, py, pz));
+	// tvec = orig - v0
+	__m128 tx = _mm_sub_ps(_mm_load_ps(packet.ox + first), _mm_set1_ps(tris.v0x[tri]));
+	__m128 ty = _mm_sub_ps(_mm_load_ps(packet.oy + first), _mm_set1_ps(tris.v0y[tri]));
+	__m128 tz = _mm_sub_ps(_mm_load_ps(packet.oz + first), _mm_set1_ps(tris.v0z[tri]));
+	_mm_storeu_ps(uDot, dot(tx, ty, tz, px, py, pz));
+	// qvec = tvec x e1
+	__m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+	__m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+	__m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+	_mm_storeu_ps(vDot, dot(dx, dy, dz, qx, qy, qz));
+	_mm_storeu_ps(tDot, dot(e2x, e2y, e2z, qx, qy, qz));
+#else
+	Vector3f e1(tris.e1x[tri], tris.e1y[tri], tris.e1z[tri]);
+	Vector3f e2(tris.e2x[tri], tris.e2y[tri], tris.e2z[tri]);
+	Vector3f v0(tris.v0x[tri], tris.v0y[tri], tris.v0z[tri]);
+	Vector3f normal(tris.nx[tri], tris.ny[tri], tris.nz[tri]);
+	for (int lane = 0; lane < 4; ++lane) {
+		int k = first + lane;
+		Vector3f dir(packet.dx[k], packet.dy[k], packet.dz[k]);
+		facing[lane] = dotProduct(dir, normal);
+		Vector3f pvec = crossProduct(dir, e2);
+		det[lane] = dotProduct(e1, pvec);
+		Vector3f tvec = Vector3f(packet.ox[k], packet.oy[k], packet.oz[k]) - v0;
+		uDot[lane] = dotProduct(tvec, pvec);
+		Vector3f qvec = crossProduct(tvec, e1);
+		vDot[lane] = dotProduct(dir, qvec);
+		tDot[lane] = dotProduct(e2, qvec);
+	}
+#endif
+}
+
+uint32_t PacketTriangles::intersect(int tri, const RayPacket& packet, uint32_t mask, double* t) const {
+	uint32_t hits = 0;
+	for (int first = 0; first < packet.size; first += 4) {
+		if (((mask >> first) & 0xF) == 0)
+			continue;
+		float facing[4], det[4], uDot[4], vDot[4], tDot[4];
+		triangleProducts(*this, tri, packet, first, facing, det, uDot, vDot, tDot);
+		// The rest is in double precision, as in Triangle::getIntersection
+		for (int lane = 0; lane < 4; ++lane) {
+			int k = first + lane;
+			if (!(mask >> k & 1) || facing[lane] > 0 || fabs((double)det[lane]) < EPSILON)
+				continue;
+			double detInv = 1. / (double)det[lane];
+			double u = uDot[lane] * detInv;
+			if (u < 0 || u > 1)
+				continue;
+			double v = vDot[lane] * detInv;
+			if (v < 0 || u + v > 1)
+				continue;
+			double tHit = tDot[lane] * detInv;
+			if (tHit <= 0)
+				continue;
+			t[k] = tHit;
+			hits |= 1u << k;
+		}
+	}
+	return hits;
+}
+
+uint32_t packetEntersBox(const Vector3f& pMin, const Vector3f& pMax, const RayPacket& packet, uint32_t mask,
+                         const int* dirIsNeg, const double* tMax) {
+	const float* origin[3] = {packet.ox, packet.oy, packet.oz};
+	const float* invDir[3] = {packet.ix, packet.iy, packet.iz};
+	uint32_t entered = 0;
+	for (int first = 0; first < packet.size; first += 4) {
+		if (((mask >> first) & 0xF) == 0)
+			continue;
+		float tIn[4], tOut[4];
+#ifdef RT_PACKET_SSE
+		__m128 in = _mm_set1_ps(std::numeric_limits<float>::lowest());
+		__m128 out = _mm_set1_ps(std::numeric_limits<float>::max());
+		for (int i = 0; i < 3; ++i) {
+			__m128 o = _mm_load_ps(origin[i] + first), inv = _mm_load_ps(invDir[i] + first);
+			__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(pMin[i]), o), inv);
+			__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(pMax[i]), o), inv);
+			in = _mm_max_ps(in, dirIsNeg[i] > 0 ? t0 : t1);
+			out = _mm_min_ps(out, dirIsNeg[i] > 0 ? t1 : t0);
+		}
+		_mm_storeu_ps(tIn, in);
+		_mm_storeu_ps(tOut, out);
+#else
+		for (int lane = 0; lane < 4; ++lane) {
+			tIn[lane] = std::numeric_limits<float>::lowest();
+			tOut[lane] = std::numeric_limits<float>::max();
+			for (int i = 0; i < 3; ++i) {
+				float t0 = (pMin[i] - origin[i][first + lane]) * invDir[i][first + lane];
+				float t1 = (pMax[i] - origin[i][first + lane]) * invDir[i][first + lane];
+				tIn[lane] = std::max(tIn[lane], dirIsNeg[i] > 0 ? t0 : t1);
+				tOut[lane] = std::min(tOut[lane], dirIsNeg[i] > 0 ? t1 : t0);
+			}
+		}
+#endif
+		for (int lane = 0; lane < 4; ++lane) {
+			int k = first + lane;
+			if ((mask >> k & 1) && tIn[lane] < tOut[lane] && tOut[lane] > 0 && tIn[lane] <= tMax[k])
+				entered |= 1u << k;
+		}
+	}
+	return entered;
+}
@@ -2,7 +2,10 @@
 // Created by goksu on 2/25/20.
 //
 
+#include <atomic>
+#include <chrono>
 #include <fstream>
+#include <thread>
 #include "Scene.hpp"
 #include "Renderer.hpp"
 
@@ -11,38 +14,33 @@ inline float deg2rad(const float& deg) { return deg * M_PI / 180.0; }
 
 const float EPSILON = 0.00001;
 
+// Primary ray through the center of pixel (i, j)
+static Ray primaryRay(const Scene& scene, uint32_t i, uint32_t j) {
+	float scale = tan(deg2rad(scene.fov * 0.5));
+	float imageAspectRatio = scene.width / (float)scene.height;
+	Vector3f eye_pos(-1, 5, 10);
+
+	float y = (1 - 2 * (j + 0.5) / (float)scene.height) * scale;
+	float x = (2 * (i + 0.5) / (float)scene.width - 1) * imageAspectRatio * scale;
+
+	// TODO: Find the x and y positions of the current pixel to get the
+	// direction
+	//  vector that passes through it.
+	// Also, don't forget to multiply both of them with the variable
+	// *scale*, and x (horizontal) variable with the *imageAspectRatio*
+
+	// Don't forget to normalize this direction!
+
+	Vector3f ray_dir = Vector3f{x, y, -1};
+	ray_dir = normalize(ray_dir);
+	return Ray(eye_pos, ray_dir);
+}
+
 // The main render function. This where we iterate over all pixels in the image,
 // generate primary rays and cast these rays into the scene. The content of the
 // framebuffer is saved to a file.
 void Renderer::Render(const Scene& scene) {
-	std::vector<Vector3f> framebuffer(scene.width * scene.height);
-
-	float scale = tan(deg2rad(scene.fov * 0.5));
-	float imageAspectRatio = scene.width / (float)scene.height;
-	Vector3f eye_pos(-1, 5, 10);
-	int m(0);
-	for (uint32_t j = 0; j < scene.height; ++j) {
-		float y = (1 - 2 * (j + 0.5) / (float)scene.height) * scale;
-		for (uint32_t i = 0; i < scene.width; ++i) {
-			// generate primary ray direction
-			float x = (2 * (i + 0.5) / (float)scene.width - 1) * imageAspectRatio * scale;
-
-			// TODO: Find the x and y positions of the current pixel to get the
-			// direction
-			//  vector that passes through it.
-			// Also, don't forget to multiply both of them with the variable
-			// *scale*, and x (horizontal) variable with the *imageAspectRatio*
-
-			// Don't forget to normalize this direction!
-
-			Vector3f ray_dir = Vector3f{x, y, -1};
-			ray_dir = normalize(ray_dir);
-			Ray ray = Ray(eye_pos, ray_dir);
-			framebuffer[m++] = scene.castRay(ray, 0);
-		}
-		UpdateProgress(j / (float)scene.height);
-	}
-	UpdateProgress(1.f);
+	std::vector<Vector3f> framebuffer = RenderFramebuffer(scene, &ThreadPool::global());
 
 	// save framebuffer to file
 	FILE* fp = fopen("binary.ppm", "wb");
@@ -56,3 +54,70 @@ void Renderer::Render(const Scene& scene) {
 	}
 	fclose(fp);
 }
+
+std::vector<Vector3f> Renderer::RenderFramebuffer(const Scene& scene, ThreadPool* pool, bool showProgress) const {
+	std::vector<Vector3f> framebuffer(scene.width * scene.height);
+	if (pool == nullptr) {
+		// rows in bands as high as a packet
+		int rows = options.packetSize;
+		for (int j = 0; j < scene.height; j += rows) {
+			renderTile(scene, {0, j, scene.width, std::min(j + rows, scene.height)}, framebuffer);
+			if (showProgress)
+				UpdateProgress(j / (float)scene.height);
+		}
+		if (showProgress)
+			UpdateProgress(1.f);
+		return framebuffer;
+	}
+
+	// Every worker starts on its own contiguous run of the Morton-ordered
+	// tiles; idle workers steal the remaining tiles of the others. The
+	// calling thread only reports progress, so pool.size() threads render.
+	std::vector<TileTask> tiles = makeTiles(scene.width, scene.height, options.tileSize);
+	std::atomic<int> finished(0);
+	int nTiles = (int)tiles.size();
+	for (int i = 0; i < nTiles; ++i) {
+		int worker = (int)((long long)i * pool->size() / nTiles);
+		pool->submit(worker, [this, &tiles, &scene, &framebuffer, &finished, i]() {
+			renderTile(scene, tiles[i], framebuffer);
+			finished.fetch_add(1, std::memory_order_release);
+		});
+	}
+
+	while (finished.load(std::memory_order_acquire) < nTiles) {
+		if (showProgress)
+			UpdateProgress(finished.load(std::memory_order_relaxed) / (float)nTiles);
+		std::this_thread::sleep_for(std::chrono::milliseconds(showProgress ? 100 : 1));
+	}
+	if (showProgress)
+		UpdateProgress(1.f);
+	return framebuffer;
+}
+
+void Renderer::renderTile(const Scene& scene, const TileTask& tile, std::vector<Vector3f>& framebuffer) const {
+	if (options.packetSize > 1) {
+		// Blocks at the right and bottom edge of the tile may be smaller
+		int n = options.packetSize;
+		for (int y = tile.y0; y < tile.y1; y += n) {
+			for (int x = tile.x0; x < tile.x1; x += n) {
+				RayPacket packet;
+				for (int j = y; j < std::min(y + n, tile.y1); ++j) {
+					for (int i = x; i < std::min(x + n, tile.x1); ++i)
+						packet.add(primaryRay(scene, i, j));
+				}
+				Vector3f colors[kMaxPacketSize];
+				scene.castPacket(packet, colors);
+				int k = 0;
+				for (int j = y; j < std::min(y + n, tile.y1); ++j) {
+					for (int i = x; i < std::min(x + n, tile.x1); ++i)
+						framebuffer[j * scene.width + i] = colors[k++];
+				}
+			}
+		}
+		return;
+	}
+	for (int j = tile.y0; j < tile.y1; ++j) {
+		for (int i = tile.x0; i < tile.x1; ++i)
+			framebuffer[j * scene.width + i] = scene.castRay(primaryRay(scene, i, j), 0);
+	}
+}
@@ -52,7 +52,50 @@ Vector3f Scene::castRay(const Ray& ray_in, int depth) const {
 	if (depth > this->maxDepth) {
 		return Vector3f(0.0, 0.0, 0.0);
 	}
-	Intersection intersection = Scene::intersect(ray_in);
+	return shade(ray_in, Scene::intersect(ray_in), depth);
+}
+
+void Scene::castPacket(const RayPacket& packet, Vector3f* colors) const {
+	Intersection hits[kMaxPacketSize];
+	bvh->IntersectPacket(packet, packet.all(), hits);
+
+	// Shadow rays of the diffuse hits, one packet per point light
+	size_t nLights = get_lights().size();
+	std::vector<char> shadowed(packet.size * nLights, 0);
+	for (size_t i = 0; i < nLights; ++i) {
+		if (dynamic_cast<AreaLight*>(get_lights()[i].get()))
+			continue;
+		RayPacket shadowRays;
+		int rayOf[kMaxPacketSize];
+		for (int k = 0; k < packet.size; ++k) {
+			const Intersection& hit = hits[k];
+			// only the Phong case of shade looks at the lights
+			if (!hit.happened || hit.m->getType() == REFLECTION || hit.m->getType() == REFLECTION_AND_REFRACTION)
+				continue;
+			Ray ray = packet.ray(k);
+			Vector3f N = hit.normal;
+			Vector2f uv, st;
+			hit.obj->getSurfaceProperties(hit.coords, ray.direction, 0, uv, N, st);
+			rayOf[shadowRays.size] = k;
+			shadowRays.add(shadowRay(ray, hit.coords, N, get_lights()[i]->position));
+		}
+		uint32_t occluded = bvh->OccludedPacket(shadowRays, shadowRays.all());
+		for (int s = 0; s < shadowRays.size; ++s)
+			shadowed[rayOf[s] * nLights + i] = occluded >> s & 1;
+	}
+
+	for (int k = 0; k < packet.size; ++k)
+		colors[k] = shade(packet.ray(k), hits[k], 0, nLights > 0 ? &shadowed[k * nLights] : nullptr);
+}
+
+Ray Scene::shadowRay(const Ray& ray_in, const Vector3f& hitPoint, const Vector3f& N, const Vector3f& lightPos) const {
+	Vector3f shadowPointOrig = (dotProduct(ray_in.direction, N) < 0)
+		                           ? hitPoint + N * EPSILON
+		                           : hitPoint - N * EPSILON;
+	return Ray(shadowPointOrig, normalize(lightPos - hitPoint));
+}
+
+Vector3f Scene::shade(const Ray& ray_in, const Intersection& intersection, int depth, const char* shadowed) const {
 	Material* m = intersection.m;
 	Object* hitObject = intersection.obj;
 	Vector3f hitColor = this->backgroundColor;
@@ -98,9 +141,6 @@ Vector3f Scene::castRay(const Ray& ray_in, int depth) const {
 			// is composed of a diffuse and a specular reflection component.
 			// [/comment]
 			Vector3f lightAmt = 0, specularColor = 0;
-			Vector3f shadowPointOrig = (dotProduct(ray_in.direction, N) < 0)
-				                           ? hitPoint + N * EPSILON
-				                           : hitPoint - N * EPSILON;
 			// [comment]
 			// Loop over all lights in the scene and sum their contribution up
 			// We also apply the lambert cosine law
@@ -119,7 +159,9 @@ Vector3f Scene::castRay(const Ray& ray_in, int depth) const {
 					Object* shadowHitObject = nullptr;
 					float tNearShadow = kInfinity;
 					// is the point in shadow, and is the nearest occluding object closer to the object than the light itself?
-					bool inShadow = bvh->Intersect(Ray(shadowPointOrig, lightDir)).happened;
+					bool inShadow = shadowed
+						                ? shadowed[i]
+						                : bvh->Intersect(shadowRay(ray_in, hitPoint, N, get_lights()[i]->position)).happened;
 					lightAmt += (1 - inShadow) * get_lights()[i]->intensity * LdotN;
 					Vector3f reflectionDirection = reflect(-lightDir, N);
 					specularColor += powf(std::max(0.f, -dotProduct(reflectionDirection, ray_in.direction)),
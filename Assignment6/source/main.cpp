@@ -3,23 +3,120 @@
 #include "Scene.hpp"
 #include "Triangle.hpp"
 #include "Vector.hpp"
+#include "ThreadPool.hpp"
 #include <chrono>
+#include <cstdio>
+#include <string>
+
+// Render the scene serially once, then on pools of 1 to maxThreads threads,
+// and print the time, speedup and parallel efficiency of each against the
+// serial render, checking that every framebuffer matches it.
+static bool runScalingBenchmark(const Scene& scene, const Renderer& r, int maxThreads, int repeat) {
+	auto timeRender = [&](ThreadPool* pool, std::vector<Vector3f>& framebuffer) {
+		double best = 1e30;
+		for (int run = 0; run < repeat; ++run) {
+			auto start = std::chrono::steady_clock::now();
+			framebuffer = r.RenderFramebuffer(scene, pool, false);
+			best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+		}
+		return best;
+	};
+
+	std::vector<Vector3f> reference, framebuffer;
+	double serial = timeRender(nullptr, reference);
+	printf("%8s %10s %8s %10s %10s\n", "threads", "seconds", "speedup", "efficiency", "identical");
+	printf("%8s %10.3f %8.2f %10s %10s\n", "serial", serial, 1.0, "-", "-");
+	bool identical = true;
+	for (int n = 1; n <= maxThreads; ++n) {
+		ThreadPool pool(n);
+		double seconds = timeRender(&pool, framebuffer);
+		bool same = true;
+		for (size_t i = 0; i < reference.size() && same; ++i) {
+			same = framebuffer[i].x == reference[i].x && framebuffer[i].y == reference[i].y
+				&& framebuffer[i].z == reference[i].z;
+		}
+		identical = identical && same;
+		printf("%8d %10.3f %8.2f %9.0f%% %10s\n", n, seconds, serial / seconds, 100 * serial / seconds / n,
+		       same ? "yes" : "NO");
+	}
+	return identical;
+}
 
 // In the main function of the program, we create the scene (create objects and
 // lights) as well as set the options for the render (image width and height,
 // maximum recursion depth, field-of-view, etc.). We then call the render
 // function().
 int main(int argc, char** argv) {
+	RenderOptions options;
+	// run the thread scaling benchmark instead of rendering binary.ppm
+	bool scaling = false;
+	int repeat = 3;
+	// BVH over the bunny's triangles
+	SAHOptions sah;
+	int leafSize = 1;
+
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--threads" && i + 1 < argc) {
+			// 0 keeps the default of one thread per hardware thread
+			int threads = std::stoi(argv[++i]);
+			if (threads > 0) ThreadPool::defaultThreadCount = threads;
+		}
+		else if (arg == "--tile-size" && i + 1 < argc) {
+			options.tileSize = std::max(1, std::stoi(argv[++i]));
+		}
+		else if (arg == "--packet" && i + 1 < argc) {
+			int size = std::stoi(argv[++i]);
+			if (size != 1 && size != 2 && size != 4) {
+				std::cerr << "unsupported packet size: " << size << " (expected 1, 2 or 4)\n";
+				return 1;
+			}
+			options.packetSize = size;
+		}
+		else if (arg == "--scaling") {
+			scaling = true;
+		}
+		else if (arg == "--repeat" && i + 1 < argc) {
+			repeat = std::max(1, std::stoi(argv[++i]));
+		}
+		else if (arg == "--buckets" && i + 1 < argc) {
+			sah.buckets = std::max(2, std::stoi(argv[++i]));
+		}
+		else if (arg == "--sah-axes" && i + 1 < argc) {
+			sah.allAxes = std::string(argv[++i]) == "all";
+		}
+		else if (arg == "--traversal-cost" && i + 1 < argc) {
+			sah.traversalCost = std::stof(argv[++i]);
+		}
+		else if (arg == "--intersection-cost" && i + 1 < argc) {
+			sah.intersectionCost = std::stof(argv[++i]);
+		}
+		else if (arg == "--leaf-size" && i + 1 < argc) {
+			leafSize = std::max(1, std::stoi(argv[++i]));
+		}
+		else {
+			std::cerr << "usage: " << argv[0] << " [--threads N] [--tile-size N] [--packet 1|2|4] [--scaling] [--repeat N]"
+				" [--buckets N] [--sah-axes longest|all] [--traversal-cost X] [--intersection-cost X]"
+				" [--leaf-size N]\n";
+			return 1;
+		}
+	}
+
 	Scene scene(1280, 960);
 
-	MeshTriangle bunny(std::string(ASSIGNMENT6_SOURCE_DIR) + "/models/bunny/bunny.obj");
+	MeshTriangle bunny(std::string(ASSIGNMENT6_SOURCE_DIR) + "/models/bunny/bunny.obj", leafSize, sah);
 
 	scene.Add(&bunny);
 	scene.Add(std::make_unique<Light>(Vector3f(-20, 70, 20), 1));
 	scene.Add(std::make_unique<Light>(Vector3f(20, 70, 20), 1));
 	scene.buildBVH();
 
-	Renderer r;
+	Renderer r(options);
+
+	if (scaling) {
+		// --threads sets the largest pool measured
+		return runScalingBenchmark(scene, r, ThreadPool::defaultThreadCount, repeat) ? 0 : 1;
+	}
 
 	auto start = std::chrono::system_clock::now();
 	r.Render(scene);
@@ -8,61 +8,198 @@
 #include <atomic>
 #include <vector>
 #include <memory>
-#include <ctime>
+#include <chrono>
+#include <functional>
 #include "Object.hpp"
 #include "Ray.hpp"
 #include "Bounds3.hpp"
 #include "Intersection.hpp"
 #include "Vector.hpp"
+#include "Kernels.hpp"
+#include "Mesh.hpp"
+#include "Distribution.hpp"
 
 struct BVHBuildNode;
 // BVHAccel Forward Declarations
 struct BVHPrimitiveInfo;
+struct SpatialBuildContext;
+
+// Node of the flattened BVH. Nodes are laid out depth first, so the first
+// child of an interior node always follows it directly and only the offset
+// of the second child has to be stored.
+struct alignas(32) LinearBVHNode {
+    Bounds3 bounds;
+    union {
+        int primitivesOffset;   // leaf
+        int secondChildOffset;  // interior
+    };
+    uint16_t nPrimitives;  // 0 -> interior node
+    uint8_t axis;          // interior node: xyz
+    uint8_t pad[1];        // ensure 32 byte total size
+};
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should be 32 bytes");
+
+// Node of the collapsed wide BVH. The child bounds are stored as a BoxBlock so
+// one kernel call tests all children. A child >= 0 is another wide node, a
+// negative child ~i is the leaf nodes[i] of the binary tree.
+struct WideBVHNode {
+    BoxBlock childBounds;
+    int children[kBlockWidth];
+    int nChildren = 0;
+};
+
+struct BVHPrimitiveInfo {
+    BVHPrimitiveInfo() {}
+    BVHPrimitiveInfo(size_t primitiveNumber, const Bounds3 &bounds)
+        : primitiveNumber(primitiveNumber), bounds(bounds),
+          centroid(.5f * bounds.pMin + .5f * bounds.pMax) {}
+    size_t primitiveNumber;
+    Bounds3 bounds;
+    Vector3f centroid;
+};
+
+// Shape of a finished BVH, printed after every build
+struct BVHBuildStats {
+    size_t primitives = 0;
+    // leaf references, more than primitives when spatial splits duplicated some
+    size_t references = 0;
+    int interiorNodes = 0;
+    int leafNodes = 0;
+    int maxDepth = 0;
+    int maxLeafPrims = 0;
+    // expected cost of a random ray, in units of one primitive test
+    double sahCost = 0;
+    double buildMs = 0;
+};
 
-// BVHAccel Declarations
-inline int leafNodes, totalLeafNodes, totalPrimitives, interiorNodes;
 class BVHAccel {
 
 public:
     // BVHAccel Public Types
-    enum class SplitMethod { NAIVE, SAH };
+    // SBVH is SAH plus spatial splits, which may reference a primitive from
+    // several leaves, each clipped to the part inside its node
+    enum class SplitMethod { NAIVE, SAH, SBVH };
+
+    // number of centroid bins evaluated per SAH split
+    static constexpr int nBuckets = 16;
+    // cost of a node traversal relative to a primitive intersection
+    static constexpr float traversalCost = 0.125f;
+    // cost of testing a block of kBlockWidth triangles with the SIMD kernels
+    static constexpr float blockCost = 2.0f;
+    // ranges larger than this are built as parallel subtasks
+    static constexpr int parallelBuildThreshold = 4096;
+    // ranges larger than this also compute bounds and SAH bins in parallel
+    static constexpr int parallelBinThreshold = 65536;
+    // print the build time and tree shape after every build
+    static inline bool printBuildStats = true;
+    // extra references an SBVH build may create, as a fraction of the primitives
+    static inline float spatialSplitBudget = 0.3f;
+    // spatial splits are only tried where the children of the best object
+    // split overlap by more than this fraction of the root surface area
+    static constexpr double spatialSplitAlpha = 1e-5;
+    // SAH and spatial splits stop below this depth and deeper nodes split at
+    // the median, so even lopsided inputs stay under maxDepth (a median
+    // split halves the node, and no mesh has 2^31 primitives)
+    static constexpr int maxSAHDepth = 32;
+    // size of the traversal stacks: one entry per level of the binary tree,
+    // kBlockWidth per level of the wide ones
+    static constexpr int maxDepth = 64;
+    // clipped bounds of a primitive inside a box that overlaps its bounds
+    using ClipFunction = std::function<Bounds3(size_t primitiveNumber, const Bounds3& box)>;
 
     // BVHAccel Public Methods
-    BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE);
+    // width 4 or 8 collapses the binary tree into a 4- or 8-wide BVH after the build
+    BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE,
+             int width = 2);
+    // BVH directly over the triangles of mesh. Only the intersection data is
+    // copied; hits leave obj and m unset for the owner to fill in.
+    BVHAccel(const TriangleMesh& mesh, int maxPrimsInNode, SplitMethod splitMethod, int width = 2);
     Bounds3 WorldBound() const;
     ~BVHAccel();
 
     Intersection Intersect(const Ray &ray) const;
-    Intersection getIntersection(BVHBuildNode* node, const Ray& ray)const;
-    bool IntersectP(const Ray &ray) const;
-    BVHBuildNode* root;
+    // Any-hit query for shadow rays: true as soon as some primitive is hit in
+    // (0, tMax). Does not look for the closest hit or build an Intersection.
+    bool IntersectP(const Ray &ray, float tMax) const;
 
     // BVHAccel Private Methods
-    BVHBuildNode* recursiveBuild(std::vector<Object*>objects);
+    // primitiveInfo grows by the duplicated references of an SBVH build
+    void build(std::vector<BVHPrimitiveInfo>& primitiveInfo, const ClipFunction& clip);
+    // record the build time and print the stats
+    void printStats(std::chrono::steady_clock::time_point start);
+    BVHBuildNode* recursiveBuild(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end, int depth);
+    int splitNaive(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end, int dim);
+    int splitSAH(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end, int dim,
+                 const Bounds3& bounds, const Bounds3& centroidBounds);
+    // best binned SAH split along dim and the bounds of its two sides
+    struct ObjectSplit {
+        float cost = std::numeric_limits<float>::max();
+        int bucket = 0;
+        Bounds3 left, right;
+    };
+    ObjectSplit findObjectSplit(const std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end, int dim,
+                                const Bounds3& bounds, const Bounds3& centroidBounds) const;
+    int partitionObjectSplit(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end, int dim,
+                             const Bounds3& centroidBounds, int bucket);
+    // best plane through the node bounds, references straddling it go to both sides
+    struct SpatialSplit {
+        float cost = std::numeric_limits<float>::max();
+        int axis = 0;
+        float position = 0;
+    };
+    BVHBuildNode* spatialBuild(SpatialBuildContext& context, std::vector<BVHPrimitiveInfo>& refs, int depth);
+    SpatialSplit findSpatialSplit(const SpatialBuildContext& context, const std::vector<BVHPrimitiveInfo>& refs,
+                                  const Bounds3& bounds) const;
+    bool splitSpatial(SpatialBuildContext& context, const std::vector<BVHPrimitiveInfo>& refs, const Bounds3& bounds,
+                      const SpatialSplit& split, std::vector<BVHPrimitiveInfo>& left,
+                      std::vector<BVHPrimitiveInfo>& right);
+    int flattenBVHTree(BVHBuildNode* node, int* offset, int depth);
+    void deleteBuildTree(BVHBuildNode* node);
+    float intersectionCost(int nPrimitives) const;
+    int collapse(int nodeIndex);
+    Intersection intersectWide(const Ray &ray) const;
+    void intersectLeaf(int nodeIndex, const Ray &ray, const KernelTable &simd, float &tClosest,
+                       int &closestPrim, Intersection &isect) const;
+    Intersection hitRecord(const Ray &ray, int prim, float t) const;
+    bool intersectPWide(const Ray &ray, float tMax) const;
+    bool occludedLeaf(int nodeIndex, const Ray &ray, const KernelTable &simd, float tMax) const;
 
     // BVHAccel Private Data
     const int maxPrimsInNode;
     const SplitMethod splitMethod;
+    const int width;
     std::vector<Object*> primitives;
+    std::vector<LinearBVHNode> nodes;
+    std::atomic<int> totalNodes{0};
+    BVHBuildStats stats;
+
+    // When every primitive is a triangle they are also stored here in leaf
+    // order for the SIMD kernels. Mesh BVHs keep only this and no primitives.
+    bool blockLeaves = false;
+    TriangleSoA triangles;
+
+    // collapsed tree, empty unless width > 2; wideNodes[0] is the root
+    std::vector<WideBVHNode> wideNodes;
+
+    // primitive areas in leaf order, used to pick a primitive proportional to its area
+    AliasTable areaTable;
 
-    void getSample(BVHBuildNode* node, float p, Intersection &pos, float &pdf);
-    void Sample(Intersection &pos, float &pdf);
+    void Sample(Intersection &pos, float &pdf, Sampler &sampler);
 };
 
 struct BVHBuildNode {
     Bounds3 bounds;
     BVHBuildNode *left;
     BVHBuildNode *right;
-    Object* object;
-    float area;
 
 public:
     int splitAxis=0, firstPrimOffset=0, nPrimitives=0;
+    // references of an SBVH leaf until they are gathered in leaf order
+    std::vector<BVHPrimitiveInfo> refs;
     // BVHBuildNode Public Methods
     BVHBuildNode(){
         bounds = Bounds3();
         left = nullptr;right = nullptr;
-        object = nullptr;
     }
 };
 
@@ -82,6 +82,9 @@ public:
 
 	inline bool IntersectP(const Ray& ray, const Vector3f& invDir,
 	                       const std::array<int, 3>& dirisNeg) const;
+	// same slab test, also returns the distance at which the ray enters the box
+	inline bool IntersectP(const Ray& ray, const Vector3f& invDir,
+	                       const std::array<int, 3>& dirIsNeg, float& tEnter) const;
 };
 
 
@@ -89,13 +92,17 @@ inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir,
                                 const std::array<int, 3>& dirIsNeg) const {
 	// invDir: ray direction(x,y,z), invDir=(1.0/x,1.0/y,1.0/z), use this because Multiply is faster that Division
 	// dirIsNeg: ray direction(x,y,z), dirIsNeg=[int(x>0),int(y>0),int(z>0)], use this to simplify your logic
-	// TODO test if ray bound intersects
+	float tEnter;
+	return IntersectP(ray, invDir, dirIsNeg, tEnter);
+}
 
-	double tInMax = std::numeric_limits<double>::lowest();
-	double tOutMin = std::numeric_limits<double>::max();
+inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir,
+                                const std::array<int, 3>& dirIsNeg, float& tEnter) const {
+	float tInMax = std::numeric_limits<float>::lowest();
+	float tOutMin = std::numeric_limits<float>::max();
 	for (int i(0); i < 3; i++) {
-		double t0 = (pMin[i] - ray.origin[i]) * invDir[i];
-		double t1 = (pMax[i] - ray.origin[i]) * invDir[i];
+		float t0 = (pMin[i] - ray.origin[i]) * invDir[i];
+		float t1 = (pMax[i] - ray.origin[i]) * invDir[i];
 		if (dirIsNeg[i] > 0) {
 			tInMax = std::max(tInMax, t0);
 			tOutMin = std::min(tOutMin, t1);
@@ -105,8 +112,8 @@ inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir,
 			tOutMin = std::min(tOutMin, t0);
 		}
 	}
-	bool isIntersect = tInMax <= tOutMin && tOutMin >= 0;
-	return isIntersect;
+	tEnter = tInMax;
+	return tInMax <= tOutMin && tOutMin >= 0;
 }
 
 inline Bounds3 Union(const Bounds3& b1, const Bounds3& b2) {
@@ -0,0 +1,23 @@
+#pragma once
+#include "Scene.hpp"
+
+// Pinhole camera in front of the Cornell box, looking down +z. Shared by the
+// recursive and the wavefront integrators so both see the same primary rays.
+struct Camera {
+	explicit Camera(const Scene& scene)
+		: width(scene.width), height(scene.height),
+		  scale(std::tan(scene.fov * 0.5f * M_PI / 180.0f)), aspect(scene.width / (float)scene.height),
+		  eye_pos(278, 273, -800) {
+	}
+
+	// ray through the centre of pixel (px, py)
+	Ray generateRay(int px, int py) const {
+		float x = (2 * (px + 0.5) / (float)width - 1) * aspect * scale;
+		float y = (1 - 2 * (py + 0.5) / (float)height) * scale;
+		return Ray(eye_pos, normalize(Vector3f(-x, y, 1)));
+	}
+
+	int width, height;
+	float scale, aspect;
+	Vector3f eye_pos;
+};
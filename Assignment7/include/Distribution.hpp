@@ -0,0 +1,69 @@
+#pragma once
+#include <algorithm>
+#include <vector>
+
+// Discrete distribution proportional to a list of non-negative weights,
+// sampled in O(1) with Vose's alias method. Every entry i keeps the
+// probability of staying at i and the entry to jump to otherwise.
+class AliasTable {
+public:
+	AliasTable() = default;
+
+	explicit AliasTable(const std::vector<float>& weights) {
+		int n = (int)weights.size();
+		double sum = 0;
+		for (float w : weights)
+			sum += w;
+		if (n == 0 || sum <= 0)
+			return;
+
+		bins.resize(n);
+		std::vector<double> scaled(n);
+		std::vector<int> small, large;
+		for (int i = 0; i < n; ++i) {
+			bins[i].pmf = (float)(weights[i] / sum);
+			scaled[i] = weights[i] / sum * n;
+			(scaled[i] < 1 ? small : large).push_back(i);
+		}
+		// Fill every under-full bin with the remainder of an over-full one
+		while (!small.empty() && !large.empty()) {
+			int s = small.back(), l = large.back();
+			small.pop_back();
+			bins[s].q = (float)scaled[s];
+			bins[s].alias = l;
+			scaled[l] -= 1 - scaled[s];
+			if (scaled[l] < 1) {
+				large.pop_back();
+				small.push_back(l);
+			}
+		}
+		// What is left is exactly full up to rounding
+		for (int i : small)
+			bins[i].q = 1, bins[i].alias = i;
+		for (int i : large)
+			bins[i].q = 1, bins[i].alias = i;
+	}
+
+	int size() const { return (int)bins.size(); }
+
+	bool empty() const { return bins.empty(); }
+
+	// Probability of picking entry i
+	float pmf(int i) const { return bins[i].pmf; }
+
+	// Pick an entry with a single uniform number u in [0, 1)
+	int sample(float u) const {
+		int n = (int)bins.size();
+		float x = u * n;
+		int i = std::min((int)x, n - 1);
+		return x - i < bins[i].q ? i : bins[i].alias;
+	}
+
+private:
+	struct Bin {
+		float q = 1;
+		float pmf = 0;
+		int alias = 0;
+	};
+	std::vector<Bin> bins;
+};
@@ -0,0 +1,36 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "Vector.hpp"
+
+// Running statistics of the samples taken in one pixel. The colour is summed
+// for the final average; the luminance mean and variance are tracked with
+// Welford's update so the sampler can tell how converged the pixel is.
+struct PixelStats {
+	Vector3f sum;
+	int count = 0;
+	double mean = 0;
+	double m2 = 0;
+
+	void add(const Vector3f& L) {
+		sum += L;
+		++count;
+		double y = 0.2126 * L.x + 0.7152 * L.y + 0.0722 * L.z;
+		double delta = y - mean;
+		mean += delta / count;
+		m2 += delta * (y - mean);
+	}
+
+	Vector3f average() const { return count > 0 ? sum / (float)count : Vector3f(0); }
+
+	// Standard error of the luminance mean relative to the mean itself. Dark
+	// pixels are measured against a small floor instead, so an almost black
+	// but noisy pixel does not look infinitely unconverged.
+	float relativeError() const {
+		if (count < 2)
+			return std::numeric_limits<float>::infinity();
+		double variance = m2 / (count - 1);
+		return (float)(std::sqrt(variance / count) / std::max(mean, 1e-3));
+	}
+};
@@ -0,0 +1,44 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "Vector.hpp"
+
+// Raw float RGB image in PFM format, rows stored bottom to top. Written with
+// a single write of header and pixels.
+bool writePFM(const std::string& filename, int width, int height, const std::vector<Vector3f>& pixels);
+bool readPFM(const std::string& filename, int& width, int& height, std::vector<Vector3f>& pixels);
+
+// 8-bit binary PPM, rgb holds width * height * 3 bytes
+bool writePPM(const std::string& filename, int width, int height, const std::vector<uint8_t>& rgb);
+
+enum class ToneOperator { Clamp, Reinhard, ACES };
+
+const char* toneOperatorName(ToneOperator op);
+bool parseToneOperator(const std::string& name, ToneOperator& op);
+
+// Turns the HDR framebuffer into 8-bit display values in two stages over
+// flat float arrays: the tone operator compresses exposure-scaled radiance
+// into [0, 1], then quantize encodes with x^0.6 and rounds down to 8 bits.
+// Clamp with exposure 1 reproduces the original Save output exactly.
+class ToneMapper {
+public:
+	explicit ToneMapper(ToneOperator op = ToneOperator::Clamp, float exposure = 1);
+
+	void apply(const std::vector<Vector3f>& pixels, std::vector<uint8_t>& rgb) const;
+
+private:
+	void toneMap(float* v, int n) const;
+	void quantize(const float* v, uint8_t* out, int n) const;
+
+	static constexpr int lutSize = 1 << 16;
+
+	ToneOperator op;
+	float exposure;
+	// thresholds[k] is the smallest value that encodes to at least k, with
+	// a sentinel at 256. lut[i] is the code of i / lutSize; the thresholds
+	// are further apart than a LUT bucket, so one compare in each direction
+	// turns it into the exact code of any value in the bucket.
+	float thresholds[257];
+	std::vector<uint8_t> lut;
+};
@@ -0,0 +1,98 @@
+#pragma once
+#include <cmath>
+#include "Object.hpp"
+#include "Transform.hpp"
+
+// A placement of a shared prototype object, usually a MeshTriangle whose
+// own BVH is the bottom level, under an affine transform. The scene BVH over
+// the instances is the top level. Rays are taken into object space for the
+// prototype and its hits brought back, so any number of instances share one
+// copy of the geometry and its BVH. The prototype itself is not added to the
+// scene.
+class Instance : public Object {
+public:
+	// material replaces the prototype's if it is set
+	Instance(Object* prototype, const Transform& objectToWorld, Material* material = nullptr)
+		: prototype(prototype), objectToWorld(objectToWorld), worldToObject(objectToWorld.inverse()),
+		  material(material) {
+		bounds = objectToWorld.bounds(prototype->getBounds());
+		// exact for rotations, translations and uniform scales
+		area = prototype->getArea() * std::pow(std::abs(objectToWorld.determinant()), 2.0f / 3.0f);
+	}
+
+	bool intersect(const Ray& ray) {
+		float tScale;
+		return prototype->intersect(objectRay(ray, tScale));
+	}
+
+	bool intersect(const Ray& ray, float& tnear, uint32_t& index) const {
+		float tScale;
+		Ray local = objectRay(ray, tScale);
+		float t = tnear * tScale;
+		if (!prototype->intersect(local, t, index))
+			return false;
+		tnear = t / tScale;
+		return true;
+	}
+
+	Intersection getIntersection(Ray ray) {
+		float tScale;
+		Intersection hit = prototype->getIntersection(objectRay(ray, tScale));
+		if (hit.happened) {
+			hit.distance /= tScale;
+			hit.coords = ray(hit.distance);
+			hit.normal = normalize(objectToWorld.normal(hit.normal));
+			hit.obj = this;
+			if (material)
+				hit.m = material;
+		}
+		return hit;
+	}
+
+	bool occludes(const Ray& ray, float tMax) override {
+		float tScale;
+		Ray local = objectRay(ray, tScale);
+		return prototype->occludes(local, tMax * tScale);
+	}
+
+	void getSurfaceProperties(const Vector3f& P, const Vector3f& I, const uint32_t& index, const Vector2f& uv,
+	                          Vector3f& N, Vector2f& st) const {
+		prototype->getSurfaceProperties(worldToObject.point(P), worldToObject.vector(I), index, uv, N, st);
+		N = normalize(objectToWorld.normal(N));
+	}
+
+	Vector3f evalDiffuseColor(const Vector2f& st) const { return prototype->evalDiffuseColor(st); }
+
+	Bounds3 getBounds() { return bounds; }
+
+	float getArea() { return area; }
+
+	// Uniform over the prototype's surface, so the pdf is only exact where
+	// the area is (see the constructor)
+	void Sample(Intersection& pos, float& pdf, Sampler& sampler) {
+		prototype->Sample(pos, pdf, sampler);
+		pos.coords = objectToWorld.point(pos.coords);
+		pos.normal = normalize(objectToWorld.normal(pos.normal));
+		if (material)
+			pos.emit = material->getEmission();
+		pdf = 1 / area;
+	}
+
+	bool hasEmit() { return material ? material->hasEmission() : prototype->hasEmit(); }
+
+private:
+	// ray in object space with a unit direction again, since the triangle
+	// kernels test against an absolute epsilon. A hit at t on it is at
+	// t / tScale on ray.
+	Ray objectRay(const Ray& ray, float& tScale) const {
+		Vector3f direction = worldToObject.vector(ray.direction);
+		tScale = direction.norm();
+		return Ray(worldToObject.point(ray.origin), direction / tScale, ray.t);
+	}
+
+	Object* prototype;
+	Transform objectToWorld, worldToObject;
+	Material* material;
+	Bounds3 bounds;
+	float area;
+};
@@ -0,0 +1,64 @@
+#pragma once
+#include <vector>
+#include "Vector.hpp"
+
+// Ray vs. many primitives kernels used in BVH traversal. Each kernel has a
+// scalar, an SSE (4 lanes at a time) and an AVX2 (8 lanes) version; the best
+// one supported by the CPU is picked at startup.
+
+constexpr int kBlockWidth = 8;
+
+// Triangles in structure-of-arrays form: first vertex and the two edges used
+// by Moeller-Trumbore. BVHAccel stores them in leaf order, so the triangles of
+// a leaf are a contiguous range. The arrays are padded with kBlockWidth
+// degenerate triangles (never hit) so kernels may always load a full block.
+struct TriangleSoA {
+	std::vector<float> v0x, v0y, v0z;
+	std::vector<float> e1x, e1y, e1z;
+	std::vector<float> e2x, e2y, e2z;
+
+	int size() const { return count; }
+	void resize(int n);
+	void set(int i, const Vector3f& v0, const Vector3f& e1, const Vector3f& e2);
+	Vector3f vertex0(int i) const { return Vector3f(v0x[i], v0y[i], v0z[i]); }
+	Vector3f edge1(int i) const { return Vector3f(e1x[i], e1y[i], e1z[i]); }
+	Vector3f edge2(int i) const { return Vector3f(e2x[i], e2y[i], e2z[i]); }
+
+private:
+	int count = 0;
+};
+
+// Up to kBlockWidth boxes in structure-of-arrays form
+struct alignas(32) BoxBlock {
+	float minX[kBlockWidth], minY[kBlockWidth], minZ[kBlockWidth];
+	float maxX[kBlockWidth], maxY[kBlockWidth], maxZ[kBlockWidth];
+
+	BoxBlock();
+	void set(int lane, const Vector3f& pMin, const Vector3f& pMax);
+};
+
+enum class SimdLevel { Scalar, SSE, AVX2 };
+
+struct KernelTable {
+	// Closest front-facing hit among triangles [first, first + count) with
+	// 0 < t < tHit, count <= kBlockWidth. Returns the offset from first and
+	// lowers tHit, or -1 if nothing is closer.
+	int (*intersectTriangles)(const TriangleSoA& tris, int first, int count, const Vector3f& orig,
+	                          const Vector3f& dir, float& tHit);
+	// Slab test against the first count boxes of block. Returns a bit mask of
+	// the boxes entered before tMax and writes their entry distances to tEnter.
+	int (*intersectBoxes)(const BoxBlock& block, int count, const Vector3f& orig, const Vector3f& invDir,
+	                      float tMax, float* tEnter);
+	SimdLevel level;
+	const char* name;
+};
+
+// Highest level supported by the CPU (and the compiler)
+SimdLevel detectSimdLevel();
+
+// Kernels in use, initialised from detectSimdLevel() on first call
+const KernelTable& kernels();
+
+// Force a level, e.g. to compare against the scalar path. Levels the CPU does
+// not support fall back to the best supported one below them.
+void setSimdLevel(SimdLevel level);
@@ -6,6 +6,7 @@
 #define RAYTRACING_MATERIAL_H
 
 #include "Vector.hpp"
+#include "Sampler.hpp"
 
 enum MaterialType { DIFFUSE, MICROFACET };
 
@@ -71,8 +72,8 @@ private:
 		// kt = 1 - kr;
 	}
 
-	Vector3f toWorld(const Vector3f& a, const Vector3f& N) {
-		Vector3f B, C;
+	// Orthonormal tangents B, C so that (B, C, N) is a right-handed frame
+	void tangentFrame(const Vector3f& N, Vector3f& B, Vector3f& C) const {
 		if (std::fabs(N.x) > std::fabs(N.y)) {
 			float invLen = 1.0f / std::sqrt(N.x * N.x + N.z * N.z);
 			C = Vector3f(N.z * invLen, 0.0f, -N.x * invLen);
@@ -82,9 +83,47 @@ private:
 			C = Vector3f(0.0f, N.z * invLen, -N.y * invLen);
 		}
 		B = crossProduct(C, N);
+	}
+
+	Vector3f toWorld(const Vector3f& a, const Vector3f& N) {
+		Vector3f B, C;
+		tangentFrame(N, B, C);
 		return a.x * B + a.y * C + a.z * N;
 	}
 
+	Vector3f toLocal(const Vector3f& a, const Vector3f& N) {
+		Vector3f B, C;
+		tangentFrame(N, B, C);
+		return Vector3f(dotProduct(a, B), dotProduct(a, C), dotProduct(a, N));
+	}
+
+	// Cosine-weighted direction on the hemisphere around +z, pdf cos / PI
+	Vector3f sampleCosine(Sampler& sampler) {
+		float x_1 = sampler.get1D(), x_2 = sampler.get1D();
+		float r = std::sqrt(x_1), phi = 2 * M_PI * x_2;
+		return Vector3f(r * std::cos(phi), r * std::sin(phi), std::sqrt(std::max(0.0f, 1.0f - x_1)));
+	}
+
+	// GGX normal visible from V (local frame, +z up), Heitz 2018
+	Vector3f sampleGGXVNDF(const Vector3f& V, float alpha, Sampler& sampler) {
+		Vector3f Vh = Vector3f(alpha * V.x, alpha * V.y, V.z).normalized();
+		float lensq = Vh.x * Vh.x + Vh.y * Vh.y;
+		Vector3f T1 = lensq > 0 ? Vector3f(-Vh.y, Vh.x, 0) / std::sqrt(lensq) : Vector3f(1, 0, 0);
+		Vector3f T2 = crossProduct(Vh, T1);
+		float r = std::sqrt(sampler.get1D()), phi = 2 * M_PI * sampler.get1D();
+		float t1 = r * std::cos(phi), t2 = r * std::sin(phi);
+		float s = 0.5f * (1.0f + Vh.z);
+		t2 = (1.0f - s) * std::sqrt(std::max(0.0f, 1.0f - t1 * t1)) + s * t2;
+		Vector3f Nh = t1 * T1 + t2 * T2 + std::sqrt(std::max(0.0f, 1.0f - t1 * t1 - t2 * t2)) * Vh;
+		return Vector3f(alpha * Nh.x, alpha * Nh.y, std::max(0.0f, Nh.z)).normalized();
+	}
+
+	// Share of MICROFACET samples drawn from the GGX lobe, the rest are cosine-weighted
+	float specularSampleWeight() const {
+		float ks = Ks.x + Ks.y + Ks.z, kd = Kd.x + Kd.y + Kd.z;
+		return ks + kd > 0 ? clamp(0.1f, 0.9f, ks / (ks + kd)) : 0.5f;
+	}
+
 	float DistributionGGX(float NdotH, float roughness) {
 		float a = roughness * roughness;
 		float a2 = a * a;
@@ -94,6 +133,12 @@ private:
 		//ӳԷĸĽ
 	}
 
+	// Smith masking term of the GGX distribution with width alpha
+	float SmithG1GGX(float NdotV, float alpha) {
+		float a2 = alpha * alpha;
+		return 2.0f * NdotV / (NdotV + std::sqrt(a2 + (1 - a2) * NdotV * NdotV));
+	}
+
 	float SmithG_G(float NdotV, float roughness) {
 		float r = 0.5 + roughness / 2.0f;
 		float m = r * r + (1 - r * r) * NdotV * NdotV;
@@ -129,7 +174,7 @@ public:
 	inline bool hasEmission();
 
 	// sample a ray by Material properties
-	inline Vector3f sample(const Vector3f& wi, const Vector3f& N);
+	inline Vector3f sample(const Vector3f& wi, const Vector3f& N, Sampler& sampler);
 	// given a ray, calculate the PdF of this ray
 	inline float pdf(const Vector3f& wi, const Vector3f& wo, const Vector3f& N);
 	// given a ray, calculate the contribution of this ray
@@ -140,6 +185,7 @@ Material::Material(MaterialType t, Vector3f e) {
 	m_type = t;
 	//m_color = c;
 	m_emission = e;
+	roughness = 0.8f;
 }
 
 MaterialType Material::getType() { return m_type; }
@@ -156,52 +202,54 @@ Vector3f Material::getColorAt(double u, double v) {
 }
 
 
-Vector3f Material::sample(const Vector3f& wi, const Vector3f& N) {
+Vector3f Material::sample(const Vector3f& wi, const Vector3f& N, Sampler& sampler) {
 	switch (m_type) {
 		case DIFFUSE: {
-			// uniform sample on the hemisphere
-			float x_1 = get_random_float(), x_2 = get_random_float();
-			float z = std::fabs(1.0f - 2.0f * x_1);
-			float r = std::sqrt(1.0f - z * z), phi = 2 * M_PI * x_2;
-			Vector3f localRay(r * std::cos(phi), r * std::sin(phi), z);
-			return toWorld(localRay, N);
+			// cosine-weighted sample on the hemisphere
+			return toWorld(sampleCosine(sampler), N);
 
 			break;
 		}
 		case MICROFACET: {
-			//Todo
-			// uniform sample on the hemisphere
-			float x_1 = get_random_float(), x_2 = get_random_float();
-			float z = std::fabs(1.0f - 2.0f * x_1);
-			float r = std::sqrt(1.0f - z * z), phi = 2 * M_PI * x_2;
-			Vector3f localRay(r * std::cos(phi), r * std::sin(phi), z);
-			return toWorld(localRay, N);
+			// mix of the visible GGX normals (reflected about the view direction) and a cosine lobe
+			Vector3f V = toLocal(-wi, N);
+			if (V.z <= 0 || sampler.get1D() >= specularSampleWeight())
+				return toWorld(sampleCosine(sampler), N);
+			Vector3f H = sampleGGXVNDF(V, roughness * roughness, sampler);
+			Vector3f L = 2.0f * dotProduct(V, H) * H - V;
+			return toWorld(L, N);
 
 			break;
 		}
 	}
+	return N;
 }
 
 float Material::pdf(const Vector3f& wi, const Vector3f& wo, const Vector3f& N) {
+	float cosTheta = dotProduct(wo, N);
+	if (cosTheta <= 0.0f)
+		return 0.0f;
 	switch (m_type) {
 		case DIFFUSE: {
-			// uniform sample probability 1 / (2 * PI)
-			if (dotProduct(wo, N) > 0.0f)
-				return 0.5f / M_PI;
-			else
-				return 0.0f;
+			// cosine-weighted sample probability cos / PI
+			return cosTheta / M_PI;
 			break;
 		}
 		case MICROFACET: {
-			//Todo
-			// uniform sample probability 1 / (2 * PI)
-			if (dotProduct(wo, N) > 0.0f)
-				return 0.5f / M_PI;
-			else
-				return 0.0f;
+			float NdotV = dotProduct(-wi, N);
+			if (NdotV <= 0.0f)
+				return cosTheta / M_PI;
+			// visible normal pdf G1(V) D(H) / (4 NdotV) after the reflection Jacobian
+			Vector3f H = (-wi + wo).normalized();
+			float NdotH = std::max(dotProduct(N, H), 0.0f);
+			float alpha = roughness * roughness;
+			float specular = SmithG1GGX(NdotV, alpha) * DistributionGGX(NdotH, roughness) / (4 * NdotV);
+			float w = specularSampleWeight();
+			return w * specular + (1 - w) * cosTheta / M_PI;
 			break;
 		}
 	}
+	return 0.0f;
 }
 
 Vector3f Material::eval(const Vector3f& wi, const Vector3f& wo, const Vector3f& N) {
@@ -220,7 +268,6 @@ Vector3f Material::eval(const Vector3f& wi, const Vector3f& wo, const Vector3f&
 		case MICROFACET: {
 			//Todo
 			if (dotProduct(N, wo) > 0.0f) {
-				float roughness = 0.8;
 				Vector3f H = (-wi + wo).normalized();
 				float NdotH = std::max(dotProduct(N, H), 0.0f);
 				float NdotV = std::max(dotProduct(N, wo), 0.0f);
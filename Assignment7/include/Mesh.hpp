@@ -0,0 +1,25 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "Bounds3.hpp"
+#include "Vector.hpp"
+
+// Indexed triangle mesh: one shared position buffer and three indices per triangle
+struct TriangleMesh {
+	std::vector<Vector3f> positions;
+	std::vector<uint32_t> indices;
+
+	int triangleCount() const { return (int)(indices.size() / 3); }
+
+	const Vector3f& vertex(int tri, int k) const { return positions[indices[3 * tri + k]]; }
+
+	Bounds3 triangleBounds(int tri) const { return Union(Bounds3(vertex(tri, 0), vertex(tri, 1)), vertex(tri, 2)); }
+
+	Vector3f triangleNormal(int tri) const {
+		return normalize(crossProduct(vertex(tri, 1) - vertex(tri, 0), vertex(tri, 2) - vertex(tri, 0)));
+	}
+
+	float triangleArea(int tri) const {
+		return crossProduct(vertex(tri, 1) - vertex(tri, 0), vertex(tri, 2) - vertex(tri, 0)).norm() * 0.5f;
+	}
+};
@@ -0,0 +1,82 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+using socket_t = SOCKET;
+#else
+using socket_t = int;
+#endif
+
+// Blocking TCP connection with just enough of the BSD socket API for the
+// coordinator/worker protocol. Works on POSIX and on Winsock.
+class Socket {
+public:
+	Socket() = default;
+	explicit Socket(socket_t fd) : fd(fd) {}
+	~Socket() { close(); }
+
+	Socket(Socket&& other) noexcept : fd(other.fd) { other.fd = invalid; }
+
+	Socket& operator=(Socket&& other) noexcept {
+		if (this != &other) {
+			close();
+			fd = other.fd;
+			other.fd = invalid;
+		}
+		return *this;
+	}
+
+	Socket(const Socket&) = delete;
+	Socket& operator=(const Socket&) = delete;
+
+	// Listen on all interfaces
+	static Socket listen(int port);
+	static Socket connect(const std::string& host, int port);
+	Socket accept() const;
+
+	bool valid() const { return fd != invalid; }
+	socket_t native() const { return fd; }
+	void close();
+	// Give up on a receive after timeoutMs without data, so a peer that stops
+	// in the middle of a message cannot block the caller for good
+	void setReceiveTimeout(int timeoutMs) const;
+
+	// Send or receive exactly size bytes, false if the connection broke
+	bool sendAll(const void* data, size_t size) const;
+	bool recvAll(void* data, size_t size) const;
+
+	// Wait until one of sockets has data (or a pending connection) and
+	// return its index, -1 on timeout
+	static int waitReadable(const std::vector<const Socket*>& sockets, int timeoutMs);
+
+private:
+#ifdef _WIN32
+	static constexpr socket_t invalid = INVALID_SOCKET;
+#else
+	static constexpr socket_t invalid = -1;
+#endif
+	socket_t fd = invalid;
+};
+
+// Messages are a fixed header followed by size bytes of payload. Both ends
+// use their native byte order; the magic number rejects a peer that differs.
+enum class MessageType : uint32_t { Hello = 1, Job = 2, Result = 3, Done = 4 };
+
+struct MessageHeader {
+	uint32_t magic;
+	MessageType type;
+	uint32_t size;
+};
+
+constexpr uint32_t messageMagic = 0x31575452; // "RTW1"
+
+bool sendMessage(const Socket& socket, MessageType type, const void* payload, uint32_t size);
+// Fails without reading the payload if the header announces more than maxSize bytes
+bool receiveMessage(const Socket& socket, MessageType& type, std::vector<char>& payload, uint32_t maxSize);
@@ -27,8 +27,21 @@ public:
 	virtual Vector3f evalDiffuseColor(const Vector2f&) const =0;
 	virtual Bounds3 getBounds() =0;
 	virtual float getArea() =0;
-	virtual void Sample(Intersection& pos, float& pdf) =0;
+	virtual void Sample(Intersection& pos, float& pdf, Sampler& sampler) =0;
 	virtual bool hasEmit() =0;
+
+	// Any-hit query: whether the object blocks ray somewhere in (0, tMax)
+	virtual bool occludes(const Ray& ray, float tMax) {
+		Intersection hit = getIntersection(ray);
+		return hit.happened && hit.distance < tMax;
+	}
+
+	// Triangles return their first vertex and edges so BVHAccel can pack them
+	// into SIMD leaf blocks, other objects are intersected one by one
+	virtual bool getTriangle(Vector3f& v0, Vector3f& e1, Vector3f& e2) const { return false; }
+
+	// Intersection record for a hit at distance t reported by a block kernel
+	virtual Intersection intersectionAt(const Ray& ray, float t) { return getIntersection(ray); }
 };
 
 #endif //RAYTRACING_OBJECT_H
@@ -3,6 +3,11 @@
 //
 #include "Scene.hpp"
 #include "TaskQueue.hpp"
+#include "Camera.hpp"
+#include "Film.hpp"
+#include "Image.hpp"
+#include <csignal>
+#include <string>
 
 #pragma once
 struct hit_payload {
@@ -12,14 +17,85 @@ struct hit_payload {
 	Object* hit_obj;
 };
 
+enum class Integrator { Recursive, Wavefront };
+
+struct RenderOptions {
+	int spp = 16;
+	Integrator integrator = Integrator::Recursive;
+	// edge length of the square tiles handed to the worker threads
+	int tileSize = 32;
+	// Adaptive sampling: spp becomes the average budget per pixel. A first
+	// pass gives every pixel a few samples, the following passes hand the
+	// rest of the budget to the pixels whose relative error is still above
+	// errorThreshold, proportionally to that error.
+	bool adaptive = false;
+	float errorThreshold = 0.02f;
+	int adaptivePasses = 8;
+	// no pixel takes more than maxSppFactor * spp samples
+	int maxSppFactor = 16;
+	// samples per pixel in each pass of a non-adaptive render
+	int passSpp = 4;
+	// Where to write checkpoints, empty for none. A checkpoint is written
+	// after the first pass that ends checkpointInterval seconds after the
+	// previous one, and when the render finishes or is interrupted.
+	std::string checkpointPath;
+	int checkpointInterval = 60;
+	// edge length of the tiles a distributed coordinator hands to its workers
+	int jobTileSize = 128;
+	// Save writes one 8-bit image per operator, scaled by exposure first,
+	// and the raw float framebuffer to hdrPath if it is set
+	std::vector<ToneOperator> toneOperators = {ToneOperator::Clamp};
+	float exposure = 1;
+	std::string hdrPath;
+};
+
 class Renderer {
 public:
-	Renderer(int screen_width, int screen_height);
-	void Render(const Scene& scene);
+	Renderer(int screen_width, int screen_height, const RenderOptions& options = {});
+	// Returns false if the render stopped early because stopRequested was set
+	bool Render(const Scene& scene);
 	void Save(const Scene& scene);
+	// Replace the framebuffer with a PFM image written by an earlier render
+	bool LoadHDR(const std::string& filename);
+	// Write the number of samples each pixel received as a false-colour PPM
+	void SaveSampleHeatmap(const Scene& scene, const char* filename);
+	// Write the traversal work per sample of each pixel (box and primitive
+	// tests, see Stats.hpp) as a false-colour PPM. Needs an RT_STATS build.
+	void SaveCostHeatmap(const Scene& scene, const char* filename);
+	// Continue the render stored in a checkpoint. Its sampling options
+	// replace the ones the renderer was created with.
+	bool LoadCheckpoint(const std::string& filename);
+	const RenderOptions& getOptions() const { return options; }
+
+	// Distributed rendering (Distributed.cpp). The coordinator hands out
+	// tiles to worker processes connecting on port and merges the pixel
+	// statistics they send back; it does not render itself. Workers load
+	// the same scene, render the tiles they are given with their local
+	// thread pool until the coordinator is done.
+	bool RenderCoordinator(const Scene& scene, int port);
+	bool RenderWorker(const Scene& scene, const std::string& host, int port);
+
+	// Set from a signal handler; the render stops after the current pass
+	static volatile std::sig_atomic_t stopRequested;
 
 private:
-	void rayCastWork(TaskQueue& queue, const Scene& scene, int spp);
+	// Trace passSamples[idx] more samples for every pixel idx of region
+	void renderPass(const Scene& scene, const TileTask& region, bool showProgress = true);
+	// Fill passSamples for the given pass, returns the number of samples planned
+	long long planPass(int pass, long long budget);
+	// Samples for the next adaptive pass, returns their total
+	long long planAdaptivePass(long long budget, int passesLeft);
+	bool saveCheckpoint(const std::string& filename) const;
+	void rayCastWork(const TileTask& tile, const Scene& scene);
 
+	RenderOptions options;
 	std::vector<Vector3f> framebuffer;
+	std::vector<PixelStats> pixels;
+	std::vector<int> passSamples;
+	// box and primitive tests spent on each pixel, only counted with RT_STATS
+	std::vector<uint64_t> pixelCost;
+	int width, height;
+	// where the render continues, advanced after every pass and checkpointed
+	int nextPass = 0;
+	long long samplesUsed = 0;
 };
@@ -0,0 +1,55 @@
+#pragma once
+#include <cstdint>
+#include <algorithm>
+
+// Cheap per-thread random number source for the path tracer.
+//
+// The generator is PCG32 (XSH-RR output, 64-bit LCG state). A Sampler is
+// reseeded from (pixel, sample index) before every camera sample, so the
+// random sequence a path sees does not depend on which thread rendered it
+// or in which order: the same scene and spp always give the same image.
+class Sampler {
+public:
+	Sampler() : state(0x853c49e6748fea9bULL), inc(0xda3e39cb94b95bdbULL) {
+	}
+
+	Sampler(uint64_t pixel, uint64_t sampleIndex) {
+		startPixelSample(pixel, sampleIndex);
+	}
+
+	void startPixelSample(uint64_t pixel, uint64_t sampleIndex) {
+		uint64_t stream = mix(sampleIndex ^ 0x9e3779b97f4a7c15ULL);
+		seed(mix(pixel ^ stream), stream);
+	}
+
+	uint32_t nextUInt() {
+		uint64_t old = state;
+		state = old * 6364136223846793005ULL + inc;
+		uint32_t xorshifted = (uint32_t)(((old >> 18u) ^ old) >> 27u);
+		uint32_t rot = (uint32_t)(old >> 59u);
+		return (xorshifted >> rot) | (xorshifted << ((~rot + 1u) & 31));
+	}
+
+	// uniform float in [0, 1)
+	float get1D() {
+		return std::min(nextUInt() * 0x1p-32f, 0x1.fffffep-1f);
+	}
+
+	uint64_t state, inc;
+
+private:
+	void seed(uint64_t initState, uint64_t initSeq) {
+		state = 0;
+		inc = (initSeq << 1u) | 1u;
+		nextUInt();
+		state += initState;
+		nextUInt();
+	}
+
+	// SplitMix64 finalizer, spreads neighbouring pixel/sample indices apart
+	static uint64_t mix(uint64_t v) {
+		v = (v ^ (v >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		v = (v ^ (v >> 27)) * 0x94d049bb133111ebULL;
+		return v ^ (v >> 31);
+	}
+};
@@ -10,6 +10,7 @@
 #include "Light.hpp"
 #include "AreaLight.hpp"
 #include "BVH.hpp"
+#include "Distribution.hpp"
 #include "Ray.hpp"
 
 
@@ -22,6 +23,13 @@ public:
 	Vector3f backgroundColor = Vector3f(0.235294, 0.67451, 0.843137);
 	int maxDepth = 1;
 	float RussianRoulette = 0.8;
+	// Paths end after this many bounces even if Russian roulette lets them
+	// go on; at 0.8 survival only about 1e-6 of the paths get that far
+	int maxPathDepth = 64;
+	BVHAccel::SplitMethod splitMethod = BVHAccel::SplitMethod::SAH;
+	int maxPrimsInNode = 8;
+	// 2 keeps the binary BVH, 4 or 8 collapses it into a wide one
+	int bvhWidth = 2;
 
 	Scene(int w, int h) : width(w), height(h) {
 	}
@@ -32,10 +40,18 @@ public:
 	const std::vector<Object*>& get_objects() const { return objects; }
 	const std::vector<std::unique_ptr<Light>>& get_lights() const { return lights; }
 	Intersection intersect(const Ray& ray) const;
+	// true if anything blocks ray before tMax
+	bool intersectP(const Ray& ray, float tMax) const;
+	// shadow rays stop this fraction of the distance short of the light point
+	static constexpr float shadowEpsilon = 1e-4f;
 	BVHAccel* bvh;
 	void buildBVH();
-	Vector3f castRay(const Ray& ray_in, int depth) const;
-	void sampleLight(Intersection& pos, float& pdf) const;
+	// Radiance arriving along ray_in, with depth bounces already taken
+	Vector3f castRay(const Ray& ray_in, int depth, Sampler& sampler) const;
+	void sampleLight(Intersection& pos, float& pdf, Sampler& sampler) const;
+	// Solid angle pdf of sampleLight choosing the emitter point hit by a ray
+	// from a surface at the given distance, used for MIS weights
+	float lightPdf(const Intersection& lightHit, float distance, const Vector3f& dir) const;
 	bool trace(const Ray& ray, const std::vector<Object*>& objects, float& tNear, uint32_t& index, Object** hitObject);
 	std::tuple<Vector3f, Vector3f> HandleAreaLight(const AreaLight& light, const Vector3f& hitPoint, const Vector3f& N,
 	                                               const Vector3f& shadowPointOrig,
@@ -44,6 +60,10 @@ public:
 
 	// creating the scene (adding objects and lights)
 	std::vector<Object*> objects;
+	// emissive objects and the distribution sampleLight picks them from, built in buildBVH
+	std::vector<Object*> emitters;
+	AliasTable lightTable;
+	float emitAreaSum = 0;
 	std::vector<std::unique_ptr<Light>> lights;
 
 	// Compute reflection direction
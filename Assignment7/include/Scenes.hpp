@@ -0,0 +1,34 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "Scene.hpp"
+
+// Objects and materials of the built-in scenes. A Scene only keeps raw
+// pointers, so they are owned here for as long as the scene is in use.
+struct SceneAssets {
+	std::vector<std::unique_ptr<Material>> materials;
+	std::vector<std::unique_ptr<Object>> objects;
+};
+
+// The Cornell box with a microfacet sphere, as rendered by Assignment7
+void addCornellBox(Scene& scene, SceneAssets& assets);
+// The Stanford bunny on its own
+void addBunny(Scene& scene, SceneAssets& assets);
+// nTriangles random triangles in a cube of side 100, the same for a given seed
+void addTriangleSoup(Scene& scene, SceneAssets& assets, int nTriangles, uint32_t seed);
+// nTriangles long thin triangles in the same cube, axis aligned like the
+// walls and floors of architectural models, the same for a given seed
+void addSliverSoup(Scene& scene, SceneAssets& assets, int nTriangles, uint32_t seed);
+// count instances of one bunny mesh, randomly placed, turned and scaled to
+// about 5 units in a cube of side 100, the same for a given seed
+void addBunnyInstances(Scene& scene, SceneAssets& assets, int count, uint32_t seed);
+
+// Triangle count and BVH build time summed over the unique meshes of
+// assets, and the number of instances placing them
+struct MeshSummary {
+	long long triangles = 0;
+	long long instances = 0;
+	double buildMs = 0;
+};
+MeshSummary summarizeMeshes(const SceneAssets& assets);
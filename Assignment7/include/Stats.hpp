@@ -0,0 +1,113 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <ostream>
+
+// Ray tracing counters. Every thread counts into its own slot, so the hot
+// paths never write to shared memory, and collectStats() sums the slots.
+// Counting is only compiled in when RT_STATS is defined; otherwise the
+// RT_STAT_ macros expand to nothing.
+struct RayStats {
+	// paths longer than this all land in the last bin
+	static constexpr int pathLengthBins = 16;
+
+	// closest-hit queries through Scene::intersect, camera rays and bounces
+	uint64_t rays = 0;
+	// any-hit queries through Scene::intersectP
+	uint64_t shadowRays = 0;
+	// BVH nodes entered, binary or wide, summed over every BVH a query descends into
+	uint64_t nodesVisited = 0;
+	// ray-box tests, one per child box a wide node tests
+	uint64_t boxTests = 0;
+	// triangles tested by the SIMD kernels plus objects tested in object leaves
+	uint64_t primitiveTests = 0;
+	// pathLengths[i] paths ended after i + 1 closest-hit queries
+	uint64_t pathLengths[pathLengthBins] = {};
+
+	RayStats& operator+=(const RayStats& other) {
+		rays += other.rays;
+		shadowRays += other.shadowRays;
+		nodesVisited += other.nodesVisited;
+		boxTests += other.boxTests;
+		primitiveTests += other.primitiveTests;
+		for (int i = 0; i < pathLengthBins; ++i)
+			pathLengths[i] += other.pathLengths[i];
+		return *this;
+	}
+
+	// every path starts with one camera ray
+	uint64_t paths() const {
+		uint64_t n = 0;
+		for (uint64_t count : pathLengths)
+			n += count;
+		return n;
+	}
+
+	// work of the traversals, the unit of the cost heatmap
+	uint64_t cost() const { return boxTests + primitiveTests; }
+};
+
+namespace stats_detail {
+inline std::mutex mutex;
+// a deque never moves its elements, so the threads can keep pointers to their slot
+inline std::deque<RayStats> slots;
+}
+
+// Counters of the calling thread
+inline RayStats& threadStats() {
+	thread_local RayStats* slot = [] {
+		std::lock_guard<std::mutex> lock(stats_detail::mutex);
+		return &stats_detail::slots.emplace_back();
+	}();
+	return *slot;
+}
+
+// Sum over all threads. Only exact while no thread is counting.
+inline RayStats collectStats() {
+	std::lock_guard<std::mutex> lock(stats_detail::mutex);
+	RayStats total;
+	for (const RayStats& slot : stats_detail::slots)
+		total += slot;
+	return total;
+}
+
+inline void resetStats() {
+	std::lock_guard<std::mutex> lock(stats_detail::mutex);
+	for (RayStats& slot : stats_detail::slots)
+		slot = RayStats();
+}
+
+inline void printStats(const RayStats& stats, std::ostream& out) {
+	uint64_t paths = stats.paths();
+	uint64_t queries = stats.rays + stats.shadowRays;
+	double perQuery = queries > 0 ? 1.0 / queries : 0;
+	out << "Ray statistics\n"
+		<< "  camera rays:     " << paths << "\n"
+		<< "  bounce rays:     " << (stats.rays > paths ? stats.rays - paths : 0) << "\n"
+		<< "  shadow rays:     " << stats.shadowRays << "\n"
+		<< "  nodes per ray:   " << stats.nodesVisited * perQuery << "\n"
+		<< "  boxes per ray:   " << stats.boxTests * perQuery << "\n"
+		<< "  prims per ray:   " << stats.primitiveTests * perQuery << "\n";
+	if (paths == 0)
+		return;
+	out << "  path lengths:   ";
+	for (int i = 0; i < RayStats::pathLengthBins; ++i) {
+		if (stats.pathLengths[i] > 0) {
+			out << " " << i + 1 << (i + 1 == RayStats::pathLengthBins ? "+" : "") << ":"
+				<< 100.0 * stats.pathLengths[i] / paths << "%";
+		}
+	}
+	out << "\n";
+}
+
+#ifdef RT_STATS
+#define RT_STAT_ADD(counter, n) (threadStats().counter += (n))
+// a path ended after the given number of closest-hit queries
+#define RT_STAT_PATH(length) \
+	(++threadStats().pathLengths[std::min((length), RayStats::pathLengthBins) - 1])
+#else
+#define RT_STAT_ADD(counter, n) ((void)(n))
+#define RT_STAT_PATH(length) ((void)(length))
+#endif
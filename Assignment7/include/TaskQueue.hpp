@@ -1,27 +1,44 @@
 #pragma once
-#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <vector>
 
-struct PixelTask {
-	int x;
-	int y;
+// Rectangle of pixels [x0, x1) x [y0, y1) rendered as one task
+struct TileTask {
+	int x0, y0;
+	int x1, y1;
 };
 
-class TaskQueue {
-public:
-	TaskQueue(int w, int h)
-		: width(w), height(h), index(0) {
-	}
-
-	bool fetch(PixelTask& task) {
-		int i = index.fetch_add(1, std::memory_order_relaxed);
-		if (i >= width * height) return false;
+// Interleave the bits of x and y, tiles sorted by this code follow a Z-order curve
+inline uint32_t mortonEncode(uint32_t x, uint32_t y) {
+	auto spread = [](uint32_t v) {
+		v &= 0x0000ffff;
+		v = (v | (v << 8)) & 0x00ff00ff;
+		v = (v | (v << 4)) & 0x0f0f0f0f;
+		v = (v | (v << 2)) & 0x33333333;
+		v = (v | (v << 1)) & 0x55555555;
+		return v;
+	};
+	return spread(x) | (spread(y) << 1);
+}
 
-		task.x = i % width;
-		task.y = i / width;
-		return true;
+// Cut a w x h image into tileSize x tileSize tiles in Morton order, so that a
+// contiguous run of tiles covers a compact region of the image.
+inline std::vector<TileTask> makeTiles(int w, int h, int tileSize) {
+	int nx = (w + tileSize - 1) / tileSize;
+	int ny = (h + tileSize - 1) / tileSize;
+	std::vector<TileTask> tiles;
+	tiles.reserve(nx * ny);
+	for (int ty = 0; ty < ny; ++ty) {
+		for (int tx = 0; tx < nx; ++tx) {
+			tiles.push_back({
+				tx * tileSize, ty * tileSize,
+				std::min((tx + 1) * tileSize, w), std::min((ty + 1) * tileSize, h)
+			});
+		}
 	}
-
-private:
-	int width, height;
-	std::atomic<int> index;
-};
+	std::sort(tiles.begin(), tiles.end(), [tileSize](const TileTask& a, const TileTask& b) {
+		return mortonEncode(a.x0 / tileSize, a.y0 / tileSize) < mortonEncode(b.x0 / tileSize, b.y0 / tileSize);
+	});
+	return tiles;
+}
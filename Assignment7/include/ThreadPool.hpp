@@ -0,0 +1,184 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool. Every worker owns a deque: it pushes and pops
+// its own work at the back and, when that runs dry, steals from the front
+// of the other workers' deques. Threads that wait on a TaskGroup run
+// pending tasks instead of blocking, so tasks may fork and join recursively.
+class ThreadPool {
+public:
+	explicit ThreadPool(int nThreads) : queues(std::max(1, nThreads)) {
+		for (auto& q : queues)
+			q = std::make_unique<WorkQueue>();
+		for (int i = 0; i < (int)queues.size(); ++i)
+			threads.emplace_back([this, i]() { workerLoop(i); });
+	}
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			stop = true;
+		}
+		wake.notify_all();
+		for (auto& t : threads)
+			t.join();
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	int size() const { return (int)queues.size(); }
+
+	// Tasks submitted from a worker go to its own deque, others are spread round-robin
+	void submit(std::function<void()> task) {
+		int q = workerIndex >= 0 && workerOwner == this
+			        ? workerIndex
+			        : (int)(nextQueue.fetch_add(1, std::memory_order_relaxed) % queues.size());
+		submit(q, std::move(task));
+	}
+
+	void submit(int queue, std::function<void()> task) {
+		{
+			std::lock_guard<std::mutex> lock(queues[queue]->mutex);
+			queues[queue]->tasks.push_back(std::move(task));
+		}
+		pending.fetch_add(1);
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+		}
+		wake.notify_one();
+	}
+
+	// Run one queued task on the calling thread, returns false if there was none
+	bool runPendingTask() {
+		std::function<void()> task;
+		int self = workerOwner == this ? workerIndex : 0;
+		if (!popTask(self, task))
+			return false;
+		task();
+		return true;
+	}
+
+	// Pool shared by the BVH builders and the renderer. Set defaultThreadCount
+	// before the first call to change its size.
+	static ThreadPool& global() {
+		static ThreadPool pool(defaultThreadCount);
+		return pool;
+	}
+
+	inline static int defaultThreadCount = std::max(1u, std::thread::hardware_concurrency());
+
+private:
+	struct WorkQueue {
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	bool popTask(int self, std::function<void()>& task) {
+		if (pending.load() == 0)
+			return false;
+		int n = (int)queues.size();
+		for (int k = 0; k < n; ++k) {
+			WorkQueue& q = *queues[(self + k) % n];
+			std::lock_guard<std::mutex> lock(q.mutex);
+			if (q.tasks.empty())
+				continue;
+			// LIFO on the own deque keeps recently split work cache-warm, FIFO when stealing takes the oldest (largest) task
+			if (k == 0) {
+				task = std::move(q.tasks.back());
+				q.tasks.pop_back();
+			}
+			else {
+				task = std::move(q.tasks.front());
+				q.tasks.pop_front();
+			}
+			pending.fetch_sub(1);
+			return true;
+		}
+		return false;
+	}
+
+	void workerLoop(int index) {
+		workerIndex = index;
+		workerOwner = this;
+		std::function<void()> task;
+		while (true) {
+			if (popTask(index, task)) {
+				task();
+				task = nullptr;
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(sleepMutex);
+			wake.wait(lock, [this]() { return stop || pending.load() > 0; });
+			if (stop && pending.load() == 0)
+				return;
+		}
+	}
+
+	std::vector<std::unique_ptr<WorkQueue>> queues;
+	std::vector<std::thread> threads;
+	std::atomic<int> pending{0};
+	std::atomic<unsigned> nextQueue{0};
+	std::mutex sleepMutex;
+	std::condition_variable wake;
+	bool stop = false;
+
+	inline static thread_local int workerIndex = -1;
+	inline static thread_local ThreadPool* workerOwner = nullptr;
+};
+
+// Fork/join helper on top of ThreadPool. wait() helps running queued tasks
+// until every task started through run() has finished.
+class TaskGroup {
+public:
+	explicit TaskGroup(ThreadPool& pool = ThreadPool::global()) : pool(pool) {
+	}
+
+	~TaskGroup() { wait(); }
+
+	template <typename F>
+	void run(F&& f) {
+		outstanding.fetch_add(1);
+		pool.submit([this, f = std::forward<F>(f)]() mutable {
+			f();
+			outstanding.fetch_sub(1);
+		});
+	}
+
+	void wait() {
+		while (outstanding.load() > 0) {
+			if (!pool.runPendingTask())
+				std::this_thread::yield();
+		}
+	}
+
+private:
+	ThreadPool& pool;
+	std::atomic<int> outstanding{0};
+};
+
+// Split [0, count) into chunks of at least grainSize and run body(begin, end)
+// on each of them in parallel.
+template <typename F>
+void parallelFor(int count, int grainSize, F&& body, ThreadPool& pool = ThreadPool::global()) {
+	int nChunks = std::min(std::max(1, count / std::max(1, grainSize)), pool.size() * 4);
+	if (nChunks <= 1) {
+		body(0, count);
+		return;
+	}
+	TaskGroup group(pool);
+	for (int c = 0; c < nChunks; ++c) {
+		int begin = (int)((long long)count * c / nChunks);
+		int end = (int)((long long)count * (c + 1) / nChunks);
+		group.run([&body, begin, end]() { body(begin, end); });
+	}
+	group.wait();
+}
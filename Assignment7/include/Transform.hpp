@@ -0,0 +1,124 @@
+#pragma once
+#include <array>
+#include <cmath>
+#include "Bounds3.hpp"
+#include "Vector.hpp"
+
+// Affine transform, kept as the top three rows of its 4x4 matrix together
+// with those of the inverse. Transforms are only built from translations,
+// scales and rotations, whose inverses are known, and composed from there,
+// so no matrix is ever inverted numerically.
+class Transform {
+public:
+	Transform() : m(identity()), inv(identity()) {}
+
+	static Transform translate(const Vector3f& t) {
+		Transform xf;
+		for (int i = 0; i < 3; ++i) {
+			xf.m[i][3] = t[i];
+			xf.inv[i][3] = -t[i];
+		}
+		return xf;
+	}
+
+	static Transform scale(const Vector3f& s) {
+		Transform xf;
+		for (int i = 0; i < 3; ++i) {
+			xf.m[i][i] = s[i];
+			xf.inv[i][i] = 1 / s[i];
+		}
+		return xf;
+	}
+
+	// Counter-clockwise rotation about axis when looking down the axis
+	static Transform rotate(float degrees, const Vector3f& axis) {
+		Vector3f a = normalize(axis);
+		float theta = degrees * (float)M_PI / 180;
+		float s = std::sin(theta), c = std::cos(theta);
+		Transform xf;
+		xf.m[0] = {a.x * a.x + (1 - a.x * a.x) * c, a.x * a.y * (1 - c) - a.z * s, a.x * a.z * (1 - c) + a.y * s, 0};
+		xf.m[1] = {a.x * a.y * (1 - c) + a.z * s, a.y * a.y + (1 - a.y * a.y) * c, a.y * a.z * (1 - c) - a.x * s, 0};
+		xf.m[2] = {a.x * a.z * (1 - c) - a.y * s, a.y * a.z * (1 - c) + a.x * s, a.z * a.z + (1 - a.z * a.z) * c, 0};
+		// a rotation is inverted by its transpose
+		for (int i = 0; i < 3; ++i)
+			for (int j = 0; j < 3; ++j)
+				xf.inv[i][j] = xf.m[j][i];
+		return xf;
+	}
+
+	// Apply other first, then this
+	Transform operator*(const Transform& other) const {
+		Transform xf;
+		xf.m = multiply(m, other.m);
+		xf.inv = multiply(other.inv, inv);
+		return xf;
+	}
+
+	Transform inverse() const {
+		Transform xf;
+		xf.m = inv;
+		xf.inv = m;
+		return xf;
+	}
+
+	Vector3f point(const Vector3f& p) const {
+		return Vector3f(m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+		                m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+		                m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+	}
+
+	Vector3f vector(const Vector3f& v) const {
+		return Vector3f(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+		                m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+		                m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+	}
+
+	// Normals go through the inverse transpose. Not normalized.
+	Vector3f normal(const Vector3f& n) const {
+		return Vector3f(inv[0][0] * n.x + inv[1][0] * n.y + inv[2][0] * n.z,
+		                inv[0][1] * n.x + inv[1][1] * n.y + inv[2][1] * n.z,
+		                inv[0][2] * n.x + inv[1][2] * n.y + inv[2][2] * n.z);
+	}
+
+	// Box around the eight transformed corners of b
+	Bounds3 bounds(const Bounds3& b) const {
+		Bounds3 result;
+		for (int corner = 0; corner < 8; ++corner) {
+			Vector3f p(corner & 1 ? b.pMax.x : b.pMin.x, corner & 2 ? b.pMax.y : b.pMin.y,
+			           corner & 4 ? b.pMax.z : b.pMin.z);
+			result = Union(result, point(p));
+		}
+		return result;
+	}
+
+	float determinant() const {
+		return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+			- m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+			+ m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+	}
+
+private:
+	using Matrix = std::array<std::array<float, 4>, 3>;
+
+	static Matrix identity() {
+		Matrix id = {};
+		for (int i = 0; i < 3; ++i)
+			id[i][i] = 1;
+		return id;
+	}
+
+	// a * b with the implicit bottom row (0, 0, 0, 1)
+	static Matrix multiply(const Matrix& a, const Matrix& b) {
+		Matrix r = {};
+		for (int i = 0; i < 3; ++i) {
+			for (int j = 0; j < 4; ++j) {
+				r[i][j] = a[i][0] * b[0][j] + a[i][1] * b[1][j] + a[i][2] * b[2][j];
+				if (j == 3)
+					r[i][j] += a[i][3];
+			}
+		}
+		return r;
+	}
+
+	Matrix m, inv;
+};
@@ -8,8 +8,9 @@
 #include "Triangle.hpp"
 #include <cassert>
 #include <array>
+#include <unordered_map>
 
-bool rayTriangleIntersect(const Vector3f& v0, const Vector3f& v1,
+inline bool rayTriangleIntersect(const Vector3f& v0, const Vector3f& v1,
                           const Vector3f& v2, const Vector3f& orig,
                           const Vector3f& dir, float& tnear, float& u, float& v) {
 	Vector3f edge1 = v1 - v0;
@@ -71,8 +72,8 @@ public:
 	Vector3f evalDiffuseColor(const Vector2f&) const override;
 	Bounds3 getBounds() override;
 
-	void Sample(Intersection& pos, float& pdf) {
-		float x = std::sqrt(get_random_float()), y = get_random_float();
+	void Sample(Intersection& pos, float& pdf, Sampler& sampler) {
+		float x = std::sqrt(sampler.get1D()), y = sampler.get1D();
 		pos.coords = v0 * (1.0f - x) + v1 * (x * (1.0f - y)) + v2 * (x * y);
 		pos.normal = this->normal;
 		pdf = 1.0f / area;
@@ -85,70 +86,89 @@ public:
 	bool hasEmit() {
 		return m->hasEmission();
 	}
+
+	bool getTriangle(Vector3f& a, Vector3f& edge1, Vector3f& edge2) const override {
+		a = v0, edge1 = e1, edge2 = e2;
+		return true;
+	}
+
+	Intersection intersectionAt(const Ray& ray, float t) override {
+		Intersection inter;
+		inter.happened = true;
+		inter.coords = ray(t);
+		inter.normal = normal;
+		inter.distance = t;
+		inter.obj = this;
+		inter.m = m;
+		return inter;
+	}
 };
 
+// Triangle mesh loaded from an OBJ file. The triangles are not separate
+// Objects: the mesh keeps shared positions and indices, and its BVH holds the
+// intersection data of all triangles in one structure-of-arrays buffer.
 class MeshTriangle : public Object {
 public:
-	MeshTriangle(const std::string& filename, Material* mt = new Material()) {
+	MeshTriangle(const std::string& filename, Material* mt = new Material(),
+	             BVHAccel::SplitMethod splitMethod = BVHAccel::SplitMethod::SAH, int maxPrimsInNode = kBlockWidth,
+	             int bvhWidth = 2) {
 		objl::Loader loader;
 		loader.LoadFile(filename);
-		area = 0;
 		m = mt;
 		assert(loader.LoadedMeshes.size() == 1);
-		auto mesh = loader.LoadedMeshes[0];
-
-		Vector3f min_vert = Vector3f{
-			std::numeric_limits<float>::infinity(),
-			std::numeric_limits<float>::infinity(),
-			std::numeric_limits<float>::infinity()
-		};
-		Vector3f max_vert = Vector3f{
-			-std::numeric_limits<float>::infinity(),
-			-std::numeric_limits<float>::infinity(),
-			-std::numeric_limits<float>::infinity()
+		auto& loaded = loader.LoadedMeshes[0];
+
+		// OBJ_Loader emits three vertices per face, merge equal positions into the shared buffer
+		struct PositionHash {
+			size_t operator()(const std::array<float, 3>& p) const {
+				size_t h = 0;
+				for (float c : p)
+					h = h * 0x9e3779b97f4a7c15ull + std::hash<float>()(c);
+				return h;
+			}
 		};
-		for (int i = 0; i < mesh.Vertices.size(); i += 3) {
-			std::array<Vector3f, 3> face_vertices;
-
+		std::unordered_map<std::array<float, 3>, uint32_t, PositionHash> positionIndex;
+		mesh.indices.reserve(loaded.Vertices.size() / 3 * 3);
+		for (size_t i = 0; i + 2 < loaded.Vertices.size(); i += 3) {
 			for (int j = 0; j < 3; j++) {
-				auto vert = Vector3f(mesh.Vertices[i + j].Position.X,
-				                     mesh.Vertices[i + j].Position.Y,
-				                     mesh.Vertices[i + j].Position.Z);
-				face_vertices[j] = vert;
-
-				min_vert = Vector3f(std::min(min_vert.x, vert.x),
-				                    std::min(min_vert.y, vert.y),
-				                    std::min(min_vert.z, vert.z));
-				max_vert = Vector3f(std::max(max_vert.x, vert.x),
-				                    std::max(max_vert.y, vert.y),
-				                    std::max(max_vert.z, vert.z));
+				const objl::Vector3& p = loaded.Vertices[i + j].Position;
+				auto [it, inserted] = positionIndex.try_emplace({p.X, p.Y, p.Z}, (uint32_t)mesh.positions.size());
+				if (inserted)
+					mesh.positions.emplace_back(p.X, p.Y, p.Z);
+				mesh.indices.push_back(it->second);
 			}
-
-			triangles.emplace_back(face_vertices[0], face_vertices[1],
-			                       face_vertices[2], mt);
 		}
+		build(splitMethod, maxPrimsInNode, bvhWidth);
+	}
 
-		bounding_box = Bounds3(min_vert, max_vert);
+	// Mesh built in memory rather than loaded from an OBJ file
+	MeshTriangle(TriangleMesh triangleMesh, Material* mt,
+	             BVHAccel::SplitMethod splitMethod = BVHAccel::SplitMethod::SAH, int maxPrimsInNode = kBlockWidth,
+	             int bvhWidth = 2)
+		: mesh(std::move(triangleMesh)), m(mt) {
+		build(splitMethod, maxPrimsInNode, bvhWidth);
+	}
 
-		std::vector<Object*> ptrs;
-		for (auto& tri : triangles) {
-			ptrs.push_back(&tri);
-			area += tri.area;
-		}
-		bvh = new BVHAccel(ptrs);
+	void build(BVHAccel::SplitMethod splitMethod, int maxPrimsInNode, int bvhWidth) {
+		Bounds3 bounds;
+		for (const Vector3f& p : mesh.positions)
+			bounds = Union(bounds, p);
+		bounding_box = bounds;
+
+		area = 0;
+		for (int tri = 0; tri < mesh.triangleCount(); ++tri)
+			area += mesh.triangleArea(tri);
+		bvh = new BVHAccel(mesh, maxPrimsInNode, splitMethod, bvhWidth);
 	}
 
 	bool intersect(const Ray& ray) { return true; }
 
 	bool intersect(const Ray& ray, float& tnear, uint32_t& index) const {
 		bool intersect = false;
-		for (uint32_t k = 0; k < numTriangles; ++k) {
-			const Vector3f& v0 = vertices[vertexIndex[k * 3]];
-			const Vector3f& v1 = vertices[vertexIndex[k * 3 + 1]];
-			const Vector3f& v2 = vertices[vertexIndex[k * 3 + 2]];
+		for (int k = 0; k < mesh.triangleCount(); ++k) {
 			float t, u, v;
-			if (rayTriangleIntersect(v0, v1, v2, ray.origin, ray.direction, t,
-			                         u, v) &&
+			if (rayTriangleIntersect(mesh.vertex(k, 0), mesh.vertex(k, 1), mesh.vertex(k, 2), ray.origin,
+			                         ray.direction, t, u, v) &&
 				t < tnear) {
 				tnear = t;
 				index = k;
@@ -164,16 +184,9 @@ public:
 	void getSurfaceProperties(const Vector3f& P, const Vector3f& I,
 	                          const uint32_t& index, const Vector2f& uv,
 	                          Vector3f& N, Vector2f& st) const {
-		const Vector3f& v0 = vertices[vertexIndex[index * 3]];
-		const Vector3f& v1 = vertices[vertexIndex[index * 3 + 1]];
-		const Vector3f& v2 = vertices[vertexIndex[index * 3 + 2]];
-		Vector3f e0 = normalize(v1 - v0);
-		Vector3f e1 = normalize(v2 - v1);
-		N = normalize(crossProduct(e0, e1));
-		const Vector2f& st0 = stCoordinates[vertexIndex[index * 3]];
-		const Vector2f& st1 = stCoordinates[vertexIndex[index * 3 + 1]];
-		const Vector2f& st2 = stCoordinates[vertexIndex[index * 3 + 2]];
-		st = st0 * (1 - uv.x - uv.y) + st1 * uv.x + st2 * uv.y;
+		N = mesh.triangleNormal(index);
+		// no texture coordinates are loaded, use the barycentrics
+		st = uv;
 	}
 
 	Vector3f evalDiffuseColor(const Vector2f& st) const {
@@ -189,13 +202,21 @@ public:
 
 		if (bvh) {
 			intersec = bvh->Intersect(ray);
+			if (intersec.happened) {
+				intersec.obj = this;
+				intersec.m = m;
+			}
 		}
 
 		return intersec;
 	}
 
-	void Sample(Intersection& pos, float& pdf) {
-		bvh->Sample(pos, pdf);
+	bool occludes(const Ray& ray, float tMax) override {
+		return bvh && bvh->IntersectP(ray, tMax);
+	}
+
+	void Sample(Intersection& pos, float& pdf, Sampler& sampler) {
+		bvh->Sample(pos, pdf, sampler);
 		pos.emit = m->getEmission();
 	}
 
@@ -208,12 +229,7 @@ public:
 	}
 
 	Bounds3 bounding_box;
-	std::unique_ptr<Vector3f[]> vertices;
-	uint32_t numTriangles;
-	std::unique_ptr<uint32_t[]> vertexIndex;
-	std::unique_ptr<Vector2f[]> stCoordinates;
-
-	std::vector<Triangle> triangles;
+	TriangleMesh mesh;
 
 	BVHAccel* bvh;
 	float area;
@@ -0,0 +1,110 @@
+#pragma once
+#include <vector>
+#include "Scene.hpp"
+#include "Camera.hpp"
+#include "TaskQueue.hpp"
+#include "Film.hpp"
+
+// Path segments waiting to be traced, stored as structure of arrays so each
+// stage streams through only the fields it needs.
+struct RayQueue {
+	std::vector<float> ox, oy, oz;
+	std::vector<float> dx, dy, dz;
+	// path throughput (product of f * cos / pdf along the path so far)
+	std::vector<float> tr, tg, tb;
+	// index of the camera sample in the tile's radiance buffer
+	std::vector<int> pixel;
+	std::vector<int> depth;
+	// pdf of the BSDF sample that produced the segment, for MIS on emitter hits
+	std::vector<float> pdf;
+	std::vector<Sampler> sampler;
+
+	int size() const { return (int)pixel.size(); }
+
+	Ray ray(int i) const { return Ray(Vector3f(ox[i], oy[i], oz[i]), Vector3f(dx[i], dy[i], dz[i])); }
+
+	void push(const Vector3f& o, const Vector3f& d, const Vector3f& throughput, int pix, int dep, float bsdfPdf,
+	          const Sampler& s) {
+		ox.push_back(o.x), oy.push_back(o.y), oz.push_back(o.z);
+		dx.push_back(d.x), dy.push_back(d.y), dz.push_back(d.z);
+		tr.push_back(throughput.x), tg.push_back(throughput.y), tb.push_back(throughput.z);
+		pixel.push_back(pix);
+		depth.push_back(dep);
+		pdf.push_back(bsdfPdf);
+		sampler.push_back(s);
+	}
+
+	void clear() {
+		ox.clear(), oy.clear(), oz.clear();
+		dx.clear(), dy.clear(), dz.clear();
+		tr.clear(), tg.clear(), tb.clear();
+		pixel.clear();
+		depth.clear();
+		pdf.clear();
+		sampler.clear();
+	}
+};
+
+// Next-event estimation rays towards sampled light points
+struct ShadowQueue {
+	std::vector<float> ox, oy, oz;
+	std::vector<float> dx, dy, dz;
+	// distance at which the ray stops short of the light point
+	std::vector<float> tMax;
+	// light contribution added to the pixel if the ray is not blocked
+	std::vector<float> wr, wg, wb;
+	std::vector<int> pixel;
+
+	int size() const { return (int)pixel.size(); }
+
+	Ray ray(int i) const { return Ray(Vector3f(ox[i], oy[i], oz[i]), Vector3f(dx[i], dy[i], dz[i])); }
+
+	void push(const Vector3f& o, const Vector3f& d, float maxDistance, const Vector3f& weight, int pix) {
+		ox.push_back(o.x), oy.push_back(o.y), oz.push_back(o.z);
+		dx.push_back(d.x), dy.push_back(d.y), dz.push_back(d.z);
+		tMax.push_back(maxDistance);
+		wr.push_back(weight.x), wg.push_back(weight.y), wb.push_back(weight.z);
+		pixel.push_back(pix);
+	}
+
+	void clear() {
+		ox.clear(), oy.clear(), oz.clear();
+		dx.clear(), dy.clear(), dz.clear();
+		tMax.clear();
+		wr.clear(), wg.clear(), wb.clear();
+		pixel.clear();
+	}
+};
+
+// Breadth-first path tracer. All camera samples of a tile are generated up
+// front, then every bounce runs as separate passes over the whole batch:
+// extend (closest hit), shade (emission, light sampling, Russian roulette
+// and BSDF sampling), trace the queued shadow rays (any hit), and continue with the
+// compacted queue of surviving paths. Computes the same estimator as
+// Scene::castRay.
+class WavefrontIntegrator {
+public:
+	// Trace sampleCounts[idx] more samples for every pixel idx of tile and fold
+	// them into pixels[idx] in sample order. With RT_STATS the traversal cost
+	// of the samples is added to pixelCost[idx]. Returns the number of rays
+	// traced, closest-hit and shadow, counted per wavefront.
+	long long renderTile(const Scene& scene, const Camera& camera, const TileTask& tile,
+	                     const std::vector<int>& sampleCounts, std::vector<PixelStats>& pixels,
+	                     std::vector<uint64_t>& pixelCost);
+
+private:
+	void generate(const Camera& camera, const TileTask& tile, const std::vector<int>& sampleCounts,
+	              const std::vector<PixelStats>& pixels, int imageWidth);
+	void extend(const Scene& scene);
+	void shade(const Scene& scene);
+	void traceShadowRays(const Scene& scene);
+
+	RayQueue current, next;
+	ShadowQueue shadow;
+	std::vector<Intersection> hits;
+	// one entry per camera sample and the image pixel it belongs to
+	std::vector<Vector3f> radiance;
+	std::vector<int> samplePixel;
+	// traversal cost per camera sample, only filled with RT_STATS
+	std::vector<uint64_t> sampleCost;
+};
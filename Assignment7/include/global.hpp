@@ -1,12 +1,14 @@
 #pragma once
 #include <iostream>
 #include <cmath>
-#include <random>
+#include <limits>
+#include <thread>
+#include "Sampler.hpp"
 
 #undef M_PI
 #define M_PI 3.141592653589793f
 
-extern const float  EPSILON;
+inline const float EPSILON = 0.00001;
 const float kInfinity = std::numeric_limits<float>::max();
 
 inline float clamp(const float &lo, const float &hi, const float &v)
@@ -28,13 +30,19 @@ inline  bool solveQuadratic(const float &a, const float &b, const float &c, floa
     return true;
 }
 
-inline float get_random_float()
+// Multiple importance sampling weight of a strategy with pdf fPdf against one with gPdf
+inline float powerHeuristic(float fPdf, float gPdf)
 {
-    std::random_device dev;
-    std::mt19937 rng(dev());
-    std::uniform_real_distribution<float> dist(0.f, 1.f); // distribution in range [1, 6]
+    float f = fPdf * fPdf, g = gPdf * gPdf;
+    return f + g > 0 ? f / (f + g) : 0;
+}
 
-    return dist(rng);
+// Fallback for code that is not handed a Sampler; the path tracer itself draws
+// from the per-sample Sampler passed down from Renderer so renders are reproducible.
+inline float get_random_float()
+{
+    thread_local Sampler sampler(std::hash<std::thread::id>{}(std::this_thread::get_id()), 0);
+    return sampler.get1D();
 }
 
 inline void UpdateProgress(float progress)
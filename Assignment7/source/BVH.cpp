@@ -1,142 +1,972 @@
 #include <algorithm>
+#include <chrono>
 #include <cassert>
+#include <mutex>
 #include "BVH.hpp"
+#include "ThreadPool.hpp"
+#include "Stats.hpp"
 
-BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode, SplitMethod splitMethod)
-	: maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod),
-	  primitives(std::move(p)) {
-	time_t start, stop;
-	time(&start);
+// Split budget and clipping shared by all tasks of one SBVH build
+struct SpatialBuildContext {
+	BVHAccel::ClipFunction clip;
+	double rootArea = 0;
+	// references that may still be duplicated
+	std::atomic<long long> budget{0};
+};
+
+static bool isEmpty(const Bounds3& b) {
+	return b.pMin.x > b.pMax.x || b.pMin.y > b.pMax.y || b.pMin.z > b.pMax.z;
+}
+
+// Intersection of two boxes, empty if they do not overlap
+static Bounds3 overlap(const Bounds3& a, const Bounds3& b) {
+	Bounds3 r;
+	r.pMin = Vector3f::Max(a.pMin, b.pMin);
+	r.pMax = Vector3f::Min(a.pMax, b.pMax);
+	return isEmpty(r) ? Bounds3() : r;
+}
+
+// Bounds of the part of triangle (v0, v1, v2) inside box, empty if there is
+// none. The polygon is clipped against the six planes of box in turn, each
+// of which adds at most one vertex.
+static Bounds3 clipTriangle(const Vector3f& v0, const Vector3f& v1, const Vector3f& v2, const Bounds3& box) {
+	Vector3f polygon[9] = {v0, v1, v2};
+	Vector3f clipped[9];
+	int n = 3;
+	for (int axis = 0; axis < 3; ++axis) {
+		for (int side = 0; side < 2; ++side) {
+			float plane = side == 0 ? box.pMin[axis] : box.pMax[axis];
+			auto inside = [&](const Vector3f& p) { return side == 0 ? p[axis] >= plane : p[axis] <= plane; };
+			int m = 0;
+			for (int i = 0; i < n; ++i) {
+				const Vector3f& a = polygon[i];
+				const Vector3f& b = polygon[(i + 1) % n];
+				bool aInside = inside(a);
+				if (aInside)
+					clipped[m++] = a;
+				if (aInside != inside(b)) {
+					Vector3f p = a + (b - a) * ((plane - a[axis]) / (b[axis] - a[axis]));
+					p[axis] = plane;
+					clipped[m++] = p;
+				}
+			}
+			n = m;
+			if (n == 0)
+				return Bounds3();
+			std::copy(clipped, clipped + n, polygon);
+		}
+	}
+	Bounds3 bounds;
+	for (int i = 0; i < n; ++i)
+		bounds = Union(bounds, polygon[i]);
+	// rounding can leave the polygon a little outside the box
+	return overlap(bounds, box);
+}
+
+BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode, SplitMethod splitMethod, int width)
+	: maxPrimsInNode(std::max(1, std::min(255, maxPrimsInNode))), splitMethod(splitMethod),
+	  width(std::max(2, std::min(kBlockWidth, width))), primitives(std::move(p)) {
+	auto start = std::chrono::steady_clock::now();
 	if (primitives.empty())
 		return;
 
-	root = recursiveBuild(primitives);
+	Vector3f v0, e1, e2;
+	blockLeaves = std::all_of(primitives.begin(), primitives.end(),
+	                          [&](Object* prim) { return prim->getTriangle(v0, e1, e2); });
+
+	// Cache bounds and centroids once, the builder only ever touches this array
+	size_t nPrimitives = primitives.size();
+	std::vector<BVHPrimitiveInfo> primitiveInfo(nPrimitives);
+	parallelFor((int)nPrimitives, parallelBuildThreshold, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i)
+			primitiveInfo[i] = {(size_t)i, primitives[i]->getBounds()};
+	});
+	build(primitiveInfo, [&](size_t prim, const Bounds3& box) {
+		Vector3f v0, e1, e2;
+		if (primitives[prim]->getTriangle(v0, e1, e2))
+			return clipTriangle(v0, v0 + e1, v0 + e2, box);
+		// box already lies within the primitive's bounds
+		return box;
+	});
+
+	// Leaves reference ranges of primitiveInfo, put the primitives in that order
+	std::vector<Object*> orderedPrims(primitiveInfo.size());
+	for (size_t i = 0; i < primitiveInfo.size(); ++i)
+		orderedPrims[i] = primitives[primitiveInfo[i].primitiveNumber];
+	primitives.swap(orderedPrims);
+
+	if (blockLeaves) {
+		triangles.resize((int)primitives.size());
+		for (size_t i = 0; i < primitives.size(); ++i) {
+			primitives[i]->getTriangle(v0, e1, e2);
+			triangles.set((int)i, v0, e1, e2);
+		}
+	}
+
+	// A primitive referenced from several leaves is only sampled through the first
+	std::vector<float> areas(primitives.size());
+	std::vector<char> sampled(nPrimitives);
+	for (size_t i = 0; i < primitives.size(); ++i) {
+		size_t prim = primitiveInfo[i].primitiveNumber;
+		if (!sampled[prim]) {
+			sampled[prim] = 1;
+			areas[i] = primitives[i]->getArea();
+		}
+	}
+	areaTable = AliasTable(areas);
+
+	printStats(start);
+}
+
+BVHAccel::BVHAccel(const TriangleMesh& mesh, int maxPrimsInNode, SplitMethod splitMethod, int width)
+	: maxPrimsInNode(std::max(1, std::min(255, maxPrimsInNode))), splitMethod(splitMethod),
+	  width(std::max(2, std::min(kBlockWidth, width))) {
+	auto start = std::chrono::steady_clock::now();
+	int nTriangles = mesh.triangleCount();
+	if (nTriangles == 0)
+		return;
+
+	blockLeaves = true;
+	std::vector<BVHPrimitiveInfo> primitiveInfo(nTriangles);
+	parallelFor(nTriangles, parallelBuildThreshold, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i)
+			primitiveInfo[i] = {(size_t)i, mesh.triangleBounds(i)};
+	});
+	build(primitiveInfo, [&](size_t tri, const Bounds3& box) {
+		return clipTriangle(mesh.vertex((int)tri, 0), mesh.vertex((int)tri, 1), mesh.vertex((int)tri, 2), box);
+	});
 
-	time(&stop);
-	double diff = difftime(stop, start);
-	int hrs = (int)diff / 3600;
-	int mins = ((int)diff / 60) - (hrs * 60);
-	int secs = (int)diff - (hrs * 3600) - (mins * 60);
+	// Only the intersection data is kept, in leaf order
+	int nRefs = (int)primitiveInfo.size();
+	triangles.resize(nRefs);
+	std::vector<float> areas(nRefs);
+	parallelFor(nRefs, parallelBuildThreshold, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			int tri = (int)primitiveInfo[i].primitiveNumber;
+			const Vector3f& v0 = mesh.vertex(tri, 0);
+			triangles.set(i, v0, mesh.vertex(tri, 1) - v0, mesh.vertex(tri, 2) - v0);
+			areas[i] = mesh.triangleArea(tri);
+		}
+	});
+	if (nRefs > nTriangles) {
+		// A triangle referenced from several leaves is only sampled through the first
+		std::vector<char> sampled(nTriangles);
+		for (int i = 0; i < nRefs; ++i) {
+			size_t tri = primitiveInfo[i].primitiveNumber;
+			if (sampled[tri])
+				areas[i] = 0;
+			sampled[tri] = 1;
+		}
+	}
+	areaTable = AliasTable(areas);
+
+	printStats(start);
+}
+
+// Move the references of the SBVH leaves below node to refs, depth first
+// like flattenBVHTree, and point the leaves at their range of it
+static void gatherLeaves(BVHBuildNode* node, std::vector<BVHPrimitiveInfo>& refs) {
+	if (node->nPrimitives > 0) {
+		node->firstPrimOffset = (int)refs.size();
+		refs.insert(refs.end(), node->refs.begin(), node->refs.end());
+		node->refs = {};
+		return;
+	}
+	gatherLeaves(node->left, refs);
+	gatherLeaves(node->right, refs);
+}
+
+// Build the tree over primitiveInfo, which ends up in leaf order, and flatten it
+void BVHAccel::build(std::vector<BVHPrimitiveInfo>& primitiveInfo, const ClipFunction& clip) {
+	stats.primitives = primitiveInfo.size();
+	BVHBuildNode* root;
+	if (splitMethod == SplitMethod::SBVH) {
+		SpatialBuildContext context;
+		context.clip = clip;
+		context.budget = (long long)(spatialSplitBudget * primitiveInfo.size());
+		root = spatialBuild(context, primitiveInfo, 0);
+		primitiveInfo.clear();
+		gatherLeaves(root, primitiveInfo);
+	}
+	else {
+		root = recursiveBuild(primitiveInfo, 0, (int)primitiveInfo.size(), 0);
+	}
+	stats.references = primitiveInfo.size();
+
+	// Flatten the pointer tree into a depth-first node array, then drop the build tree
+	nodes.resize(totalNodes);
+	int offset = 0;
+	flattenBVHTree(root, &offset, 0);
+	// the traversal stacks hold maxDepth entries per level
+	assert(stats.maxDepth < maxDepth);
+	deleteBuildTree(root);
+	if (width > 2 && nodes[0].nPrimitives == 0)
+		collapse(0);
+}
 
+void BVHAccel::printStats(std::chrono::steady_clock::time_point start) {
+	stats.buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	if (!printBuildStats)
+		return;
+
+	const char* method = splitMethod == SplitMethod::SBVH ? "SBVH" : splitMethod == SplitMethod::SAH ? "SAH" : "Naive";
+	printf("\rBVH Generation complete: \nTime Taken: %.2f ms\n", stats.buildMs);
 	printf(
-		"\rBVH Generation complete: \nTime Taken: %i hrs, %i mins, %i secs\n\n",
-		hrs, mins, secs);
+		"%s split, %zu primitives, %d interior nodes, %d leaves (%.2f prims/leaf, max %d), depth %d, SAH cost %.2f\n",
+		method, stats.primitives, stats.interiorNodes, stats.leafNodes,
+		stats.references / (double)stats.leafNodes, stats.maxLeafPrims, stats.maxDepth, stats.sahCost);
+	if (stats.references > stats.primitives)
+		printf("Spatial splits: %zu references (+%.1f%%)\n", stats.references,
+		       100.0 * (stats.references - stats.primitives) / stats.primitives);
+	printf("\n");
+	if (!wideNodes.empty())
+		printf("Collapsed to BVH%d: %zu nodes\n\n", width, wideNodes.size());
+}
+
+BVHAccel::~BVHAccel() = default;
+
+Bounds3 BVHAccel::WorldBound() const {
+	return nodes.empty() ? Bounds3() : nodes[0].bounds;
+}
+
+// Fold the counts of one traversal into the statistics of the calling thread
+static void countTraversal(int visited, int boxes) {
+	RT_STAT_ADD(nodesVisited, visited);
+	RT_STAT_ADD(boxTests, boxes);
 }
 
-BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects) {
+// Bounds of the primitives and of their centroids over [start, end)
+static void computeBounds(const std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end,
+                          Bounds3& bounds, Bounds3& centroidBounds) {
+	if (end - start < BVHAccel::parallelBinThreshold) {
+		for (int i = start; i < end; ++i) {
+			bounds = Union(bounds, primitiveInfo[i].bounds);
+			centroidBounds = Union(centroidBounds, primitiveInfo[i].centroid);
+		}
+		return;
+	}
+	std::mutex mutex;
+	parallelFor(end - start, BVHAccel::parallelBinThreshold / 4, [&](int begin, int stop) {
+		Bounds3 b, cb;
+		for (int i = start + begin; i < start + stop; ++i) {
+			b = Union(b, primitiveInfo[i].bounds);
+			cb = Union(cb, primitiveInfo[i].centroid);
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		bounds = Union(bounds, b);
+		centroidBounds = Union(centroidBounds, cb);
+	});
+}
+
+BVHBuildNode* BVHAccel::recursiveBuild(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end, int depth) {
 	BVHBuildNode* node = new BVHBuildNode();
+	totalNodes++;
 
 	// Compute bounds of all primitives in BVH node
-	Bounds3 bounds;
-	for (int i = 0; i < objects.size(); ++i)
-		bounds = Union(bounds, objects[i]->getBounds());
-	if (objects.size() == 1) {
+	Bounds3 bounds, centroidBounds;
+	computeBounds(primitiveInfo, start, end, bounds, centroidBounds);
+	node->bounds = bounds;
+
+	int nPrimitives = end - start;
+	if (nPrimitives == 1) {
 		// Create leaf _BVHBuildNode_
-		node->bounds = objects[0]->getBounds();
-		node->object = objects[0];
-		node->left = nullptr;
-		node->right = nullptr;
-		node->area = objects[0]->getArea();
+		node->firstPrimOffset = start;
+		node->nPrimitives = nPrimitives;
 		return node;
 	}
-	else if (objects.size() == 2) {
-		node->left = recursiveBuild(std::vector{objects[0]});
-		node->right = recursiveBuild(std::vector{objects[1]});
 
-		node->bounds = Union(node->left->bounds, node->right->bounds);
-		node->area = node->left->area + node->right->area;
+	int dim = centroidBounds.maxExtent();
+
+	int mid;
+	if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) {
+		// All centroids coincide, no plane separates them
+		if (nPrimitives <= maxPrimsInNode) {
+			node->firstPrimOffset = start;
+			node->nPrimitives = nPrimitives;
+			return node;
+		}
+		mid = (start + end) / 2;
+	}
+	else if (splitMethod == SplitMethod::SAH && depth < maxSAHDepth) {
+		mid = splitSAH(primitiveInfo, start, end, dim, bounds, centroidBounds);
+	}
+	else {
+		mid = nPrimitives <= maxPrimsInNode ? -1 : splitNaive(primitiveInfo, start, end, dim);
+	}
+
+	if (mid < 0) {
+		// Splitting is not worth it, create leaf _BVHBuildNode_
+		node->firstPrimOffset = start;
+		node->nPrimitives = nPrimitives;
 		return node;
 	}
+
+	node->splitAxis = dim;
+	if (nPrimitives > parallelBuildThreshold) {
+		// The two halves are disjoint ranges of primitiveInfo, build them concurrently
+		TaskGroup group;
+		group.run([&]() { node->left = recursiveBuild(primitiveInfo, start, mid, depth + 1); });
+		node->right = recursiveBuild(primitiveInfo, mid, end, depth + 1);
+		group.wait();
+	}
 	else {
-		Bounds3 centroidBounds;
-		for (int i = 0; i < objects.size(); ++i)
-			centroidBounds =
-				Union(centroidBounds, objects[i]->getBounds().Centroid());
-		int dim = centroidBounds.maxExtent();
-		switch (dim) {
-		case 0:
-			std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-				return f1->getBounds().Centroid().x <
-					f2->getBounds().Centroid().x;
-			});
-			break;
-		case 1:
-			std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-				return f1->getBounds().Centroid().y <
-					f2->getBounds().Centroid().y;
-			});
-			break;
-		case 2:
-			std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-				return f1->getBounds().Centroid().z <
-					f2->getBounds().Centroid().z;
-			});
-			break;
+		node->left = recursiveBuild(primitiveInfo, start, mid, depth + 1);
+		node->right = recursiveBuild(primitiveInfo, mid, end, depth + 1);
+	}
+	return node;
+}
+
+// Split at the median centroid along dim
+int BVHAccel::splitNaive(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end, int dim) {
+	int mid = (start + end) / 2;
+	std::nth_element(&primitiveInfo[start], &primitiveInfo[mid], &primitiveInfo[end - 1] + 1,
+	                 [dim](const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b) {
+		                 return a.centroid[dim] < b.centroid[dim];
+	                 });
+	return mid;
+}
+
+// Binned surface area heuristic. Returns the partition point, or -1 if a leaf
+// is cheaper than the best split and small enough to be one.
+int BVHAccel::splitSAH(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end, int dim,
+                       const Bounds3& bounds, const Bounds3& centroidBounds) {
+	int nPrimitives = end - start;
+	ObjectSplit split = findObjectSplit(primitiveInfo, start, end, dim, bounds, centroidBounds);
+	float leafCost = intersectionCost(nPrimitives);
+	if (nPrimitives <= maxPrimsInNode && split.cost >= leafCost)
+		return -1;
+	return partitionObjectSplit(primitiveInfo, start, end, dim, centroidBounds, split.bucket);
+}
+
+static int objectBucket(const Bounds3& centroidBounds, int dim, const BVHPrimitiveInfo& info) {
+	int b = (int)(BVHAccel::nBuckets * centroidBounds.Offset(info.centroid)[dim]);
+	return std::min(b, BVHAccel::nBuckets - 1);
+}
+
+BVHAccel::ObjectSplit BVHAccel::findObjectSplit(const std::vector<BVHPrimitiveInfo>& primitiveInfo, int start,
+                                                int end, int dim, const Bounds3& bounds,
+                                                const Bounds3& centroidBounds) const {
+	int nPrimitives = end - start;
+	struct BucketInfo {
+		int count = 0;
+		Bounds3 bounds;
+	};
+	BucketInfo buckets[nBuckets];
+
+	auto binRange = [&](int begin, int stop, BucketInfo* bins) {
+		for (int i = begin; i < stop; ++i) {
+			int b = objectBucket(centroidBounds, dim, primitiveInfo[i]);
+			bins[b].count++;
+			bins[b].bounds = Union(bins[b].bounds, primitiveInfo[i].bounds);
 		}
+	};
+	if (nPrimitives < parallelBinThreshold) {
+		binRange(start, end, buckets);
+	}
+	else {
+		std::mutex mutex;
+		parallelFor(nPrimitives, parallelBinThreshold / 4, [&](int begin, int stop) {
+			BucketInfo bins[nBuckets];
+			binRange(start + begin, start + stop, bins);
+			std::lock_guard<std::mutex> lock(mutex);
+			for (int b = 0; b < nBuckets; ++b) {
+				buckets[b].count += bins[b].count;
+				buckets[b].bounds = Union(buckets[b].bounds, bins[b].bounds);
+			}
+		});
+	}
 
-		auto beginning = objects.begin();
-		auto middling = objects.begin() + (objects.size() / 2);
-		auto ending = objects.end();
+	// Sweep from both sides so every split plane is evaluated in O(nBuckets)
+	float cost[nBuckets - 1];
+	Bounds3 b0;
+	int count0 = 0;
+	for (int i = 0; i < nBuckets - 1; ++i) {
+		b0 = Union(b0, buckets[i].bounds);
+		count0 += buckets[i].count;
+		cost[i] = count0 == 0 ? 0 : intersectionCost(count0) * b0.SurfaceArea();
+	}
+	Bounds3 b1;
+	int count1 = 0;
+	for (int i = nBuckets - 1; i > 0; --i) {
+		b1 = Union(b1, buckets[i].bounds);
+		count1 += buckets[i].count;
+		if (count1 > 0)
+			cost[i - 1] += intersectionCost(count1) * b1.SurfaceArea();
+	}
 
-		auto leftshapes = std::vector<Object*>(beginning, middling);
-		auto rightshapes = std::vector<Object*>(middling, ending);
+	ObjectSplit split;
+	float minCost = cost[0];
+	for (int i = 1; i < nBuckets - 1; ++i) {
+		if (cost[i] < minCost) {
+			minCost = cost[i];
+			split.bucket = i;
+		}
+	}
+	split.cost = traversalCost + minCost / bounds.SurfaceArea();
+	for (int i = 0; i < nBuckets; ++i) {
+		if (i <= split.bucket)
+			split.left = Union(split.left, buckets[i].bounds);
+		else
+			split.right = Union(split.right, buckets[i].bounds);
+	}
+	return split;
+}
 
-		assert(objects.size() == (leftshapes.size() + rightshapes.size()));
+// Partition [start, end) after the given bucket of findObjectSplit, falling
+// back to the median if that leaves one side empty
+int BVHAccel::partitionObjectSplit(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end, int dim,
+                                   const Bounds3& centroidBounds, int bucket) {
+	BVHPrimitiveInfo* pmid = std::partition(&primitiveInfo[start], &primitiveInfo[end - 1] + 1,
+	                                        [&](const BVHPrimitiveInfo& pi) {
+		                                        return objectBucket(centroidBounds, dim, pi) <= bucket;
+	                                        });
+	int mid = (int)(pmid - &primitiveInfo[0]);
+	if (mid == start || mid == end)
+		return splitNaive(primitiveInfo, start, end, dim);
+	return mid;
+}
 
-		node->left = recursiveBuild(leftshapes);
-		node->right = recursiveBuild(rightshapes);
+// Split BVH (Stich et al. 2009). Every node considers the binned SAH object
+// split and, where the two sides of that overlap, a spatial split that cuts
+// the node in two and clips the references straddling the plane to each
+// side. Nodes own their references, which are only put into one array once
+// the tree is done.
+BVHBuildNode* BVHAccel::spatialBuild(SpatialBuildContext& context, std::vector<BVHPrimitiveInfo>& refs, int depth) {
+	BVHBuildNode* node = new BVHBuildNode();
+	totalNodes++;
 
-		node->bounds = Union(node->left->bounds, node->right->bounds);
-		node->area = node->left->area + node->right->area;
+	int nRefs = (int)refs.size();
+	Bounds3 bounds, centroidBounds;
+	computeBounds(refs, 0, nRefs, bounds, centroidBounds);
+	node->bounds = bounds;
+	if (depth == 0)
+		context.rootArea = bounds.SurfaceArea();
+	auto makeLeaf = [&]() {
+		node->nPrimitives = nRefs;
+		node->refs = std::move(refs);
+		return node;
+	};
+	if (nRefs == 1)
+		return makeLeaf();
+
+	int dim = centroidBounds.maxExtent();
+	bool centroidsCoincide = centroidBounds.pMax[dim] == centroidBounds.pMin[dim];
+	// past maxSAHDepth only median splits, which keep the depth bounded
+	bool median = depth >= maxSAHDepth;
+	ObjectSplit object;
+	if (!centroidsCoincide && !median)
+		object = findObjectSplit(refs, 0, nRefs, dim, bounds, centroidBounds);
+
+	SpatialSplit spatial;
+	if (!median && context.budget.load(std::memory_order_relaxed) > 0) {
+		// No object split separates coinciding centroids, so count the whole node as overlap
+		Bounds3 both = overlap(object.left, object.right);
+		double overlapArea = centroidsCoincide ? bounds.SurfaceArea() : isEmpty(both) ? 0 : both.SurfaceArea();
+		if (overlapArea > spatialSplitAlpha * context.rootArea)
+			spatial = findSpatialSplit(context, refs, bounds);
 	}
 
+	float leafCost = intersectionCost(nRefs);
+	if (nRefs <= maxPrimsInNode && (median || std::min(object.cost, spatial.cost) >= leafCost))
+		return makeLeaf();
+
+	std::vector<BVHPrimitiveInfo> left, right;
+	if (spatial.cost < object.cost && splitSpatial(context, refs, bounds, spatial, left, right)) {
+		node->splitAxis = spatial.axis;
+	}
+	else {
+		int mid = centroidsCoincide ? nRefs / 2
+			: median ? splitNaive(refs, 0, nRefs, dim)
+			: partitionObjectSplit(refs, 0, nRefs, dim, centroidBounds, object.bucket);
+		left.assign(refs.begin(), refs.begin() + mid);
+		right.assign(refs.begin() + mid, refs.end());
+		node->splitAxis = dim;
+	}
+	// the children own their references from here on
+	refs = {};
+
+	if (nRefs > parallelBuildThreshold) {
+		TaskGroup group;
+		group.run([&]() { node->left = spatialBuild(context, left, depth + 1); });
+		node->right = spatialBuild(context, right, depth + 1);
+		group.wait();
+	}
+	else {
+		node->left = spatialBuild(context, left, depth + 1);
+		node->right = spatialBuild(context, right, depth + 1);
+	}
 	return node;
 }
 
+// Cheapest plane between nBuckets equal slabs of bounds along any axis. A
+// reference enters the bin its bounds start in and exits the one they end
+// in; the bins in between get the bounds of the part clipped to them.
+BVHAccel::SpatialSplit BVHAccel::findSpatialSplit(const SpatialBuildContext& context,
+                                                  const std::vector<BVHPrimitiveInfo>& refs,
+                                                  const Bounds3& bounds) const {
+	struct SpatialBin {
+		Bounds3 bounds;
+		int entries = 0;
+		int exits = 0;
+	};
+	SpatialBin bins[3][nBuckets];
+
+	Vector3f extent = bounds.Diagonal();
+	auto planeAt = [&](int axis, int i) { return bounds.pMin[axis] + extent[axis] * i / nBuckets; };
+	auto binOf = [&](int axis, float x) {
+		int b = (int)(nBuckets * (x - bounds.pMin[axis]) / extent[axis]);
+		return std::max(0, std::min(b, nBuckets - 1));
+	};
+	auto binRange = [&](int begin, int stop, SpatialBin (*axisBins)[nBuckets]) {
+		for (int i = begin; i < stop; ++i) {
+			const BVHPrimitiveInfo& ref = refs[i];
+			for (int axis = 0; axis < 3; ++axis) {
+				if (extent[axis] <= 0)
+					continue;
+				SpatialBin* bin = axisBins[axis];
+				int first = binOf(axis, ref.bounds.pMin[axis]);
+				int last = binOf(axis, ref.bounds.pMax[axis]);
+				bin[first].entries++;
+				bin[last].exits++;
+				if (first == last) {
+					bin[first].bounds = Union(bin[first].bounds, ref.bounds);
+					continue;
+				}
+				for (int b = first; b <= last; ++b) {
+					Bounds3 slab = ref.bounds;
+					slab.pMin[axis] = std::max(slab.pMin[axis], planeAt(axis, b));
+					slab.pMax[axis] = std::min(slab.pMax[axis], planeAt(axis, b + 1));
+					if (isEmpty(slab))
+						continue;
+					Bounds3 part = context.clip(ref.primitiveNumber, slab);
+					if (!isEmpty(part))
+						bin[b].bounds = Union(bin[b].bounds, part);
+				}
+			}
+		}
+	};
+	int nRefs = (int)refs.size();
+	if (nRefs < parallelBinThreshold) {
+		binRange(0, nRefs, bins);
+	}
+	else {
+		std::mutex mutex;
+		parallelFor(nRefs, parallelBinThreshold / 4, [&](int begin, int stop) {
+			SpatialBin local[3][nBuckets];
+			binRange(begin, stop, local);
+			std::lock_guard<std::mutex> lock(mutex);
+			for (int axis = 0; axis < 3; ++axis) {
+				for (int b = 0; b < nBuckets; ++b) {
+					bins[axis][b].bounds = Union(bins[axis][b].bounds, local[axis][b].bounds);
+					bins[axis][b].entries += local[axis][b].entries;
+					bins[axis][b].exits += local[axis][b].exits;
+				}
+			}
+		});
+	}
+
+	SpatialSplit split;
+	for (int axis = 0; axis < 3; ++axis) {
+		if (extent[axis] <= 0)
+			continue;
+		// cost of the right side of the plane before bin i
+		float rightCost[nBuckets];
+		Bounds3 b1;
+		int count1 = 0;
+		for (int i = nBuckets - 1; i > 0; --i) {
+			b1 = Union(b1, bins[axis][i].bounds);
+			count1 += bins[axis][i].exits;
+			rightCost[i] = count1 == 0 ? -1 : intersectionCost(count1) * b1.SurfaceArea();
+		}
+		Bounds3 b0;
+		int count0 = 0;
+		for (int i = 1; i < nBuckets; ++i) {
+			b0 = Union(b0, bins[axis][i - 1].bounds);
+			count0 += bins[axis][i - 1].entries;
+			if (count0 == 0 || rightCost[i] < 0)
+				continue;
+			float cost = traversalCost + (intersectionCost(count0) * b0.SurfaceArea() + rightCost[i]) /
+				bounds.SurfaceArea();
+			if (cost < split.cost) {
+				split.cost = cost;
+				split.axis = axis;
+				split.position = planeAt(axis, i);
+			}
+		}
+	}
+	return split;
+}
+
+// Distribute refs over the two sides of the plane, clipping the ones that
+// straddle it to both. Fails without the budget for the duplicates or if
+// clipping left one side empty.
+bool BVHAccel::splitSpatial(SpatialBuildContext& context, const std::vector<BVHPrimitiveInfo>& refs,
+                            const Bounds3& bounds, const SpatialSplit& split, std::vector<BVHPrimitiveInfo>& left,
+                            std::vector<BVHPrimitiveInfo>& right) {
+	int axis = split.axis;
+	float position = split.position;
+	long long duplicates = 0;
+	for (const BVHPrimitiveInfo& ref : refs) {
+		if (ref.bounds.pMin[axis] < position && ref.bounds.pMax[axis] > position)
+			duplicates++;
+	}
+	if (context.budget.fetch_sub(duplicates) < duplicates) {
+		context.budget.fetch_add(duplicates);
+		return false;
+	}
+
+	Bounds3 leftBox = bounds, rightBox = bounds;
+	leftBox.pMax[axis] = position;
+	rightBox.pMin[axis] = position;
+	for (const BVHPrimitiveInfo& ref : refs) {
+		if (ref.bounds.pMax[axis] <= position) {
+			left.push_back(ref);
+		}
+		else if (ref.bounds.pMin[axis] >= position) {
+			right.push_back(ref);
+		}
+		else {
+			Bounds3 l = context.clip(ref.primitiveNumber, overlap(ref.bounds, leftBox));
+			Bounds3 r = context.clip(ref.primitiveNumber, overlap(ref.bounds, rightBox));
+			if (!isEmpty(l))
+				left.emplace_back(ref.primitiveNumber, l);
+			if (!isEmpty(r))
+				right.emplace_back(ref.primitiveNumber, r);
+		}
+	}
+	if (left.empty() || right.empty()) {
+		context.budget.fetch_add(duplicates);
+		left.clear();
+		right.clear();
+		return false;
+	}
+	return true;
+}
+
+int BVHAccel::flattenBVHTree(BVHBuildNode* node, int* offset, int depth) {
+	LinearBVHNode* linearNode = &nodes[*offset];
+	linearNode->bounds = node->bounds;
+	int myOffset = (*offset)++;
+
+	double relativeArea = node->bounds.SurfaceArea() / nodes[0].bounds.SurfaceArea();
+	stats.maxDepth = std::max(stats.maxDepth, depth);
+	if (node->nPrimitives > 0) {
+		linearNode->primitivesOffset = node->firstPrimOffset;
+		linearNode->nPrimitives = (uint16_t)node->nPrimitives;
+		stats.leafNodes++;
+		stats.maxLeafPrims = std::max(stats.maxLeafPrims, node->nPrimitives);
+		stats.sahCost += relativeArea * intersectionCost(node->nPrimitives);
+	}
+	else {
+		// Create interior flattened BVH node
+		linearNode->axis = (uint8_t)node->splitAxis;
+		linearNode->nPrimitives = 0;
+		stats.interiorNodes++;
+		stats.sahCost += relativeArea * traversalCost;
+		flattenBVHTree(node->left, offset, depth + 1);
+		linearNode->secondChildOffset = flattenBVHTree(node->right, offset, depth + 1);
+	}
+	return myOffset;
+}
+
+float BVHAccel::intersectionCost(int nPrimitives) const {
+	if (!blockLeaves)
+		return (float)nPrimitives;
+	return blockCost * ((nPrimitives + kBlockWidth - 1) / kBlockWidth);
+}
+
+void BVHAccel::deleteBuildTree(BVHBuildNode* node) {
+	if (node == nullptr)
+		return;
+	deleteBuildTree(node->left);
+	deleteBuildTree(node->right);
+	delete node;
+}
+
 Intersection BVHAccel::Intersect(const Ray& ray) const {
 	Intersection isect;
-	if (!root)
+	if (nodes.empty())
 		return isect;
-	isect = BVHAccel::getIntersection(root, ray);
+	if (!wideNodes.empty())
+		return intersectWide(ray);
+
+	const KernelTable& simd = kernels();
+	const Vector3f& invDir = ray.direction_inv;
+	const std::array<int, 3> dirIsNeg{int(ray.direction.x > 0), int(ray.direction.y > 0), int(ray.direction.z > 0)};
+
+	// Follow ray through BVH nodes to find primitive intersections
+	float tClosest = std::numeric_limits<float>::max();
+	int closestPrim = -1;
+	int toVisitOffset = 0, currentNodeIndex = 0;
+	int nodesToVisit[maxDepth];
+	int visited = 0, boxes = 0;
+	while (true) {
+		const LinearBVHNode* node = &nodes[currentNodeIndex];
+		float tEnter;
+		++boxes;
+		// skip the node if it is missed or starts behind the closest hit found so far
+		if (node->bounds.IntersectP(ray, invDir, dirIsNeg, tEnter) && tEnter <= tClosest) {
+			++visited;
+			if (node->nPrimitives > 0) {
+				intersectLeaf(currentNodeIndex, ray, simd, tClosest, closestPrim, isect);
+				if (toVisitOffset == 0) break;
+				currentNodeIndex = nodesToVisit[--toVisitOffset];
+			}
+			else {
+				// Put far BVH node on _nodesToVisit_ stack, advance to near node
+				if (dirIsNeg[node->axis]) {
+					nodesToVisit[toVisitOffset++] = node->secondChildOffset;
+					currentNodeIndex = currentNodeIndex + 1;
+				}
+				else {
+					nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+					currentNodeIndex = node->secondChildOffset;
+				}
+			}
+		}
+		else {
+			if (toVisitOffset == 0) break;
+			currentNodeIndex = nodesToVisit[--toVisitOffset];
+		}
+	}
+	countTraversal(visited, boxes);
+	if (closestPrim >= 0)
+		isect = hitRecord(ray, closestPrim, tClosest);
 	return isect;
 }
 
-Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const {
-	// TODO Traverse the BVH to find intersection
+// Closest hit among the primitives of the leaf nodes[nodeIndex]. Kernel hits
+// only update tClosest and closestPrim, the caller builds the intersection.
+void BVHAccel::intersectLeaf(int nodeIndex, const Ray& ray, const KernelTable& simd, float& tClosest,
+                             int& closestPrim, Intersection& isect) const {
+	const LinearBVHNode& node = nodes[nodeIndex];
+	if (triangles.size() > 0) {
+		for (int i = 0; i < node.nPrimitives; i += kBlockWidth) {
+			int first = node.primitivesOffset + i;
+			int count = std::min(kBlockWidth, node.nPrimitives - i);
+			RT_STAT_ADD(primitiveTests, count);
+			int hit = simd.intersectTriangles(triangles, first, count, ray.origin, ray.direction, tClosest);
+			if (hit >= 0)
+				closestPrim = first + hit;
+		}
+		return;
+	}
+	RT_STAT_ADD(primitiveTests, node.nPrimitives);
+	for (int i = 0; i < node.nPrimitives; ++i) {
+		Intersection hit = primitives[node.primitivesOffset + i]->getIntersection(ray);
+		if (hit.happened && hit.distance < isect.distance) {
+			isect = hit;
+			tClosest = (float)hit.distance;
+		}
+	}
+}
+
+// Collapse the binary subtree below the interior node nodeIndex into wide
+// nodes, returns the index of the new wide node
+int BVHAccel::collapse(int nodeIndex) {
+	// Start from the two children and keep opening the interior child with the
+	// largest surface area until the node is full or only leaves are left
+	int open[kBlockWidth] = {nodeIndex + 1, nodes[nodeIndex].secondChildOffset};
+	int n = 2;
+	while (n < width) {
+		int best = -1;
+		double bestArea = -1;
+		for (int i = 0; i < n; ++i) {
+			const LinearBVHNode& child = nodes[open[i]];
+			if (child.nPrimitives == 0 && child.bounds.SurfaceArea() > bestArea) {
+				best = i;
+				bestArea = child.bounds.SurfaceArea();
+			}
+		}
+		if (best < 0)
+			break;
+		int opened = open[best];
+		open[best] = opened + 1;
+		open[n++] = nodes[opened].secondChildOffset;
+	}
+
+	int wideIndex = (int)wideNodes.size();
+	wideNodes.emplace_back();
+	wideNodes[wideIndex].nChildren = n;
+	for (int i = 0; i < n; ++i) {
+		const LinearBVHNode& child = nodes[open[i]];
+		wideNodes[wideIndex].childBounds.set(i, child.bounds.pMin, child.bounds.pMax);
+		// collapse() grows wideNodes, so index it again after the call
+		int childIndex = child.nPrimitives > 0 ? ~open[i] : collapse(open[i]);
+		wideNodes[wideIndex].children[i] = childIndex;
+	}
+	return wideIndex;
+}
+
+Intersection BVHAccel::intersectWide(const Ray& ray) const {
 	Intersection isect;
+	const KernelTable& simd = kernels();
+	const Vector3f& invDir = ray.direction_inv;
+
+	float tClosest = std::numeric_limits<float>::max();
+	int closestPrim = -1;
+	struct StackEntry {
+		int child;
+		float tEnter;
+	};
+	StackEntry stack[maxDepth * kBlockWidth];
+	int top = 0;
+	stack[top++] = {0, std::numeric_limits<float>::lowest()};
+	int visited = 0, boxes = 0;
+	while (top > 0) {
+		StackEntry entry = stack[--top];
+		// a closer hit may have been found since the entry was pushed
+		if (entry.tEnter > tClosest)
+			continue;
+		++visited;
+		if (entry.child < 0) {
+			intersectLeaf(~entry.child, ray, simd, tClosest, closestPrim, isect);
+			continue;
+		}
+
+		const WideBVHNode& node = wideNodes[entry.child];
+		float tEnter[kBlockWidth];
+		int mask = simd.intersectBoxes(node.childBounds, node.nChildren, ray.origin, invDir, tClosest, tEnter);
+		boxes += node.nChildren;
+		// Push the children that were hit far to near so the nearest one is visited first
+		int base = top;
+		for (int i = 0; mask != 0; ++i, mask >>= 1) {
+			if (!(mask & 1))
+				continue;
+			int j = top++;
+			while (j > base && stack[j - 1].tEnter < tEnter[i]) {
+				stack[j] = stack[j - 1];
+				--j;
+			}
+			stack[j] = {node.children[i], tEnter[i]};
+		}
+	}
+	countTraversal(visited, boxes);
+	if (closestPrim >= 0)
+		isect = hitRecord(ray, closestPrim, tClosest);
+	return isect;
+}
+
+bool BVHAccel::IntersectP(const Ray& ray, float tMax) const {
+	if (nodes.empty())
+		return false;
+	if (!wideNodes.empty())
+		return intersectPWide(ray, tMax);
+
+	const KernelTable& simd = kernels();
+	const Vector3f& invDir = ray.direction_inv;
 	const std::array<int, 3> dirIsNeg{int(ray.direction.x > 0), int(ray.direction.y > 0), int(ray.direction.z > 0)};
-	if (node->bounds.IntersectP(ray, ray.direction_inv, dirIsNeg)) {
-		if (node->left == nullptr && node->right == nullptr) {
-			isect = node->object->getIntersection(ray);
-			return isect;
+
+	int toVisitOffset = 0, currentNodeIndex = 0;
+	int nodesToVisit[maxDepth];
+	int visited = 0, boxes = 0;
+	while (true) {
+		const LinearBVHNode* node = &nodes[currentNodeIndex];
+		float tEnter;
+		++boxes;
+		if (node->bounds.IntersectP(ray, invDir, dirIsNeg, tEnter) && tEnter <= tMax) {
+			++visited;
+			if (node->nPrimitives > 0) {
+				if (occludedLeaf(currentNodeIndex, ray, simd, tMax)) {
+					countTraversal(visited, boxes);
+					return true;
+				}
+				if (toVisitOffset == 0) break;
+				currentNodeIndex = nodesToVisit[--toVisitOffset];
+			}
+			else {
+				// Any hit will do, but near children still tend to find an occluder sooner
+				if (dirIsNeg[node->axis]) {
+					nodesToVisit[toVisitOffset++] = node->secondChildOffset;
+					currentNodeIndex = currentNodeIndex + 1;
+				}
+				else {
+					nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+					currentNodeIndex = node->secondChildOffset;
+				}
+			}
 		}
 		else {
-			Intersection left_isect;
-			Intersection right_isect;
-			if (node->left != nullptr) {
-				left_isect = BVHAccel::getIntersection(node->left, ray);
-			}
-			if (node->right != nullptr) {
-				right_isect = BVHAccel::getIntersection(node->right, ray);
+			if (toVisitOffset == 0) break;
+			currentNodeIndex = nodesToVisit[--toVisitOffset];
+		}
+	}
+	countTraversal(visited, boxes);
+	return false;
+}
+
+bool BVHAccel::intersectPWide(const Ray& ray, float tMax) const {
+	const KernelTable& simd = kernels();
+	int stack[maxDepth * kBlockWidth];
+	int top = 0;
+	stack[top++] = 0;
+	int visited = 0, boxes = 0;
+	while (top > 0) {
+		int child = stack[--top];
+		++visited;
+		if (child < 0) {
+			if (occludedLeaf(~child, ray, simd, tMax)) {
+				countTraversal(visited, boxes);
+				return true;
 			}
-			isect = left_isect.distance < right_isect.distance ? left_isect : right_isect;
+			continue;
+		}
+		const WideBVHNode& node = wideNodes[child];
+		float tEnter[kBlockWidth];
+		int mask = simd.intersectBoxes(node.childBounds, node.nChildren, ray.origin, ray.direction_inv, tMax, tEnter);
+		boxes += node.nChildren;
+		for (int i = 0; mask != 0; ++i, mask >>= 1) {
+			if (mask & 1)
+				stack[top++] = node.children[i];
 		}
 	}
-	return isect;
+	countTraversal(visited, boxes);
+	return false;
 }
 
-void BVHAccel::getSample(BVHBuildNode* node, float p, Intersection& pos, float& pdf) {
-	if (node->left == nullptr || node->right == nullptr) {
-		node->object->Sample(pos, pdf);
-		pdf *= node->area;
-		return;
+bool BVHAccel::occludedLeaf(int nodeIndex, const Ray& ray, const KernelTable& simd, float tMax) const {
+	const LinearBVHNode& node = nodes[nodeIndex];
+	if (triangles.size() > 0) {
+		for (int i = 0; i < node.nPrimitives; i += kBlockWidth) {
+			float tHit = tMax;
+			int count = std::min(kBlockWidth, node.nPrimitives - i);
+			RT_STAT_ADD(primitiveTests, count);
+			if (simd.intersectTriangles(triangles, node.primitivesOffset + i, count, ray.origin, ray.direction, tHit) >= 0)
+				return true;
+		}
+		return false;
+	}
+	for (int i = 0; i < node.nPrimitives; ++i) {
+		RT_STAT_ADD(primitiveTests, 1);
+		if (primitives[node.primitivesOffset + i]->occludes(ray, tMax))
+			return true;
 	}
-	if (p < node->left->area) getSample(node->left, p, pos, pdf);
-	else getSample(node->right, p - node->left->area, pos, pdf);
+	return false;
 }
 
-void BVHAccel::Sample(Intersection& pos, float& pdf) {
-	float p = std::sqrt(get_random_float()) * root->area;
-	getSample(root, p, pos, pdf);
-	pdf /= root->area;
+Intersection BVHAccel::hitRecord(const Ray& ray, int prim, float t) const {
+	if (!primitives.empty())
+		return primitives[prim]->intersectionAt(ray, t);
+	Intersection isect;
+	isect.happened = true;
+	isect.coords = ray(t);
+	isect.normal = normalize(crossProduct(triangles.edge1(prim), triangles.edge2(prim)));
+	isect.distance = t;
+	return isect;
+}
+
+void BVHAccel::Sample(Intersection& pos, float& pdf, Sampler& sampler) {
+	int i = areaTable.sample(sampler.get1D());
+	if (primitives.empty()) {
+		// uniform point on the triangle, same mapping as Triangle::Sample
+		Vector3f e1 = triangles.edge1(i), e2 = triangles.edge2(i);
+		Vector3f n = crossProduct(e1, e2);
+		float x = std::sqrt(sampler.get1D()), y = sampler.get1D();
+		pos.coords = triangles.vertex0(i) + e1 * (x * (1.0f - y)) + e2 * (x * y);
+		pos.normal = normalize(n);
+		pdf = areaTable.pmf(i) / (0.5f * n.norm());
+		return;
+	}
+	primitives[i]->Sample(pos, pdf, sampler);
+	pdf *= areaTable.pmf(i);
 }
@@ -0,0 +1,213 @@
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <thread>
+#include "Network.hpp"
+#include "Renderer.hpp"
+
+namespace {
+struct HelloMessage {
+	int32_t width, height;
+};
+
+// Render spp samples for every pixel of the tile
+struct JobMessage {
+	int32_t id;
+	int32_t x0, y0, x1, y1;
+	int32_t spp;
+};
+
+// A Result message is the job id followed by the PixelStats of the tile in
+// row-major order
+int tilePixels(const TileTask& tile) { return (tile.x1 - tile.x0) * (tile.y1 - tile.y0); }
+
+struct WorkerConnection {
+	Socket socket;
+	// jobs sent to the worker and not answered yet
+	std::vector<int> jobs;
+};
+
+// Jobs in flight per worker, so a worker never waits for its next tile
+constexpr int jobsPerWorker = 2;
+// A message that has started to arrive must be complete within this time,
+// or the coordinator drops the connection instead of waiting on it
+constexpr int receiveTimeoutMs = 10000;
+}
+
+bool Renderer::RenderCoordinator(const Scene& scene, int port) {
+	Socket server = Socket::listen(port);
+	if (!server.valid()) {
+		std::cerr << "cannot listen on port " << port << "\n";
+		return false;
+	}
+	std::cout << "Coordinator listening on port " << port << ", SPP: " << options.spp << "\n";
+
+	std::vector<TileTask> tiles = makeTiles(scene.width, scene.height, options.jobTileSize);
+	int nTiles = (int)tiles.size();
+	std::deque<int> pending;
+	for (int i = 0; i < nTiles; ++i)
+		pending.push_back(i);
+	// The largest message a worker may send is the result of the largest tile
+	uint32_t maxPayload = sizeof(HelloMessage);
+	for (const TileTask& tile : tiles)
+		maxPayload = std::max(maxPayload, (uint32_t)(sizeof(int32_t) + tilePixels(tile) * sizeof(PixelStats)));
+	// connections that have not sent their Hello yet
+	std::vector<Socket> joining;
+	std::vector<WorkerConnection> workers;
+	int finished = 0;
+
+	// A worker that breaks off gives its unfinished tiles back to the queue
+	auto dropWorker = [&](int w) {
+		for (int job : workers[w].jobs)
+			pending.push_front(job);
+		workers.erase(workers.begin() + w);
+		std::cout << "\nWorker left, " << workers.size() << " connected\n";
+	};
+	auto assignJobs = [&](int w) {
+		while ((int)workers[w].jobs.size() < jobsPerWorker && !pending.empty()) {
+			int id = pending.front();
+			const TileTask& tile = tiles[id];
+			JobMessage job = {id, tile.x0, tile.y0, tile.x1, tile.y1, options.spp};
+			if (!sendMessage(workers[w].socket, MessageType::Job, &job, sizeof(job)))
+				return false;
+			pending.pop_front();
+			workers[w].jobs.push_back(id);
+		}
+		return true;
+	};
+
+	std::vector<char> payload;
+	while (finished < nTiles && !stopRequested) {
+		// Wait on the new connections as well, so one that never says Hello
+		// does not hold up the others
+		std::vector<const Socket*> sockets = {&server};
+		for (const Socket& s : joining)
+			sockets.push_back(&s);
+		for (const WorkerConnection& w : workers)
+			sockets.push_back(&w.socket);
+		int ready = Socket::waitReadable(sockets, 200);
+		if (ready < 0)
+			continue;
+
+		MessageType type;
+		if (ready == 0) {
+			Socket socket = server.accept();
+			if (socket.valid()) {
+				socket.setReceiveTimeout(receiveTimeoutMs);
+				joining.push_back(std::move(socket));
+			}
+			continue;
+		}
+		if (ready <= (int)joining.size()) {
+			Socket socket = std::move(joining[ready - 1]);
+			joining.erase(joining.begin() + (ready - 1));
+			if (!receiveMessage(socket, type, payload, maxPayload) || type != MessageType::Hello
+				|| payload.size() != sizeof(HelloMessage))
+				continue;
+			HelloMessage hello;
+			std::memcpy(&hello, payload.data(), sizeof(hello));
+			if (hello.width != scene.width || hello.height != scene.height) {
+				std::cerr << "\nrejecting a worker rendering " << hello.width << "x" << hello.height << "\n";
+				sendMessage(socket, MessageType::Done, nullptr, 0);
+				continue;
+			}
+			workers.push_back({std::move(socket), {}});
+			std::cout << "\nWorker joined, " << workers.size() << " connected\n";
+			if (!assignJobs((int)workers.size() - 1))
+				dropWorker((int)workers.size() - 1);
+			continue;
+		}
+
+		int w = ready - 1 - (int)joining.size();
+		if (!receiveMessage(workers[w].socket, type, payload, maxPayload) || type != MessageType::Result
+			|| payload.size() < sizeof(int32_t)) {
+			dropWorker(w);
+			continue;
+		}
+		int32_t id;
+		std::memcpy(&id, payload.data(), sizeof(id));
+		auto job = std::find(workers[w].jobs.begin(), workers[w].jobs.end(), id);
+		if (job == workers[w].jobs.end()
+			|| payload.size() != sizeof(id) + tilePixels(tiles[id]) * sizeof(PixelStats)) {
+			dropWorker(w);
+			continue;
+		}
+		const TileTask& tile = tiles[id];
+		const char* stats = payload.data() + sizeof(id);
+		int rowBytes = (tile.x1 - tile.x0) * sizeof(PixelStats);
+		for (int y = tile.y0; y < tile.y1; ++y, stats += rowBytes)
+			std::memcpy(&pixels[y * scene.width + tile.x0], stats, rowBytes);
+		workers[w].jobs.erase(job);
+		++finished;
+		UpdateProgress(finished / (float)nTiles);
+		if (!assignJobs(w))
+			dropWorker(w);
+	}
+	UpdateProgress(finished / (float)nTiles);
+	std::cout << "\n";
+
+	for (const WorkerConnection& w : workers)
+		sendMessage(w.socket, MessageType::Done, nullptr, 0);
+	for (int i = 0; i < scene.width * scene.height; ++i)
+		framebuffer[i] = pixels[i].average();
+	return finished == nTiles;
+}
+
+bool Renderer::RenderWorker(const Scene& scene, const std::string& host, int port) {
+	// the coordinator may still be starting up
+	Socket socket;
+	for (int attempt = 0; attempt < 50 && !socket.valid(); ++attempt) {
+		socket = Socket::connect(host, port);
+		if (!socket.valid())
+			std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	}
+	HelloMessage hello = {scene.width, scene.height};
+	if (!socket.valid() || !sendMessage(socket, MessageType::Hello, &hello, sizeof(hello))) {
+		std::cerr << "cannot connect to coordinator " << host << ":" << port << "\n";
+		return false;
+	}
+	std::cout << "Connected to coordinator " << host << ":" << port << "\n";
+
+	passSamples.assign(pixels.size(), 0);
+	std::vector<char> payload, result;
+	int rendered = 0;
+	while (!stopRequested) {
+		MessageType type;
+		if (!receiveMessage(socket, type, payload, sizeof(JobMessage))) {
+			std::cerr << "lost the connection to the coordinator\n";
+			return false;
+		}
+		if (type == MessageType::Done)
+			break;
+		if (type != MessageType::Job || payload.size() != sizeof(JobMessage))
+			return false;
+
+		JobMessage job;
+		std::memcpy(&job, payload.data(), sizeof(job));
+		TileTask tile = {job.x0, job.y0, job.x1, job.y1};
+		for (int y = tile.y0; y < tile.y1; ++y) {
+			for (int x = tile.x0; x < tile.x1; ++x) {
+				pixels[y * scene.width + x] = PixelStats();
+				passSamples[y * scene.width + x] = job.spp;
+			}
+		}
+		renderPass(scene, tile, false);
+
+		result.resize(sizeof(job.id) + tilePixels(tile) * sizeof(PixelStats));
+		std::memcpy(result.data(), &job.id, sizeof(job.id));
+		char* stats = result.data() + sizeof(job.id);
+		int rowBytes = (tile.x1 - tile.x0) * sizeof(PixelStats);
+		for (int y = tile.y0; y < tile.y1; ++y, stats += rowBytes) {
+			std::memcpy(stats, &pixels[y * scene.width + tile.x0], rowBytes);
+			std::fill(passSamples.begin() + y * scene.width + tile.x0,
+			          passSamples.begin() + y * scene.width + tile.x1, 0);
+		}
+		if (!sendMessage(socket, MessageType::Result, result.data(), (uint32_t)result.size())) {
+			std::cerr << "lost the connection to the coordinator\n";
+			return false;
+		}
+		++rendered;
+	}
+	std::cout << "Rendered " << rendered << " tiles\n";
+	return !stopRequested;
+}
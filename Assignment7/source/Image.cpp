@@ -0,0 +1,171 @@
+#include "Image.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+
+namespace {
+bool littleEndian() {
+	uint16_t one = 1;
+	uint8_t first;
+	std::memcpy(&first, &one, 1);
+	return first == 1;
+}
+
+// Write the whole file with one call, no per-pixel I/O
+bool writeFile(const std::string& filename, const std::vector<char>& data) {
+	FILE* fp = fopen(filename.c_str(), "wb");
+	if (!fp)
+		return false;
+	bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size();
+	return fclose(fp) == 0 && ok;
+}
+
+std::vector<char> header(const char* format, int width, int height, const char* last) {
+	char text[64];
+	int n = snprintf(text, sizeof(text), "%s\n%d %d\n%s\n", format, width, height, last);
+	return std::vector<char>(text, text + n);
+}
+
+// Display encoding of the original Save. The smallest gap between two codes
+// is (1/255)^(1/0.6) ~ 1e-4, wider than a LUT bucket.
+uint8_t encode(float v) { return (uint8_t)(255 * std::pow(v, 0.6f)); }
+}
+
+bool writePFM(const std::string& filename, int width, int height, const std::vector<Vector3f>& pixels) {
+	static_assert(sizeof(Vector3f) == 3 * sizeof(float), "Vector3f rows are copied as raw floats");
+	// a negative scale marks little-endian data
+	std::vector<char> data = header("PF", width, height, littleEndian() ? "-1.0" : "1.0");
+	size_t headerSize = data.size();
+	size_t rowBytes = width * sizeof(Vector3f);
+	data.resize(headerSize + height * rowBytes);
+	for (int y = 0; y < height; ++y)
+		std::memcpy(&data[headerSize + (height - 1 - y) * rowBytes], &pixels[y * width], rowBytes);
+	return writeFile(filename, data);
+}
+
+bool readPFM(const std::string& filename, int& width, int& height, std::vector<Vector3f>& pixels) {
+	FILE* fp = fopen(filename.c_str(), "rb");
+	if (!fp)
+		return false;
+	char format[3] = {};
+	float scale;
+	bool ok = fscanf(fp, "%2s %d %d %f", format, &width, &height, &scale) == 4
+		&& std::strcmp(format, "PF") == 0 && width > 0 && height > 0 && fgetc(fp) != EOF
+		&& (scale < 0) == littleEndian();
+	if (ok) {
+		pixels.resize((size_t)width * height);
+		for (int y = height - 1; y >= 0 && ok; --y)
+			ok = fread(&pixels[y * width], sizeof(Vector3f), width, fp) == (size_t)width;
+	}
+	fclose(fp);
+	return ok;
+}
+
+bool writePPM(const std::string& filename, int width, int height, const std::vector<uint8_t>& rgb) {
+	std::vector<char> data = header("P6", width, height, "255");
+	data.insert(data.end(), rgb.begin(), rgb.end());
+	return writeFile(filename, data);
+}
+
+const char* toneOperatorName(ToneOperator op) {
+	switch (op) {
+	case ToneOperator::Clamp: return "clamp";
+	case ToneOperator::Reinhard: return "reinhard";
+	case ToneOperator::ACES: return "aces";
+	}
+	return "";
+}
+
+bool parseToneOperator(const std::string& name, ToneOperator& op) {
+	for (ToneOperator o : {ToneOperator::Clamp, ToneOperator::Reinhard, ToneOperator::ACES}) {
+		if (name == toneOperatorName(o)) {
+			op = o;
+			return true;
+		}
+	}
+	return false;
+}
+
+ToneMapper::ToneMapper(ToneOperator op, float exposure) : op(op), exposure(exposure) {
+	// Binary search over the bit patterns of the floats in [0, 1], which
+	// are ordered like the floats themselves, for the first one that
+	// encodes to k. Matches encode() exactly, including its rounding.
+	uint32_t oneBits;
+	float one = 1;
+	std::memcpy(&oneBits, &one, sizeof(one));
+	thresholds[0] = 0;
+	for (int k = 1; k < 256; ++k) {
+		uint32_t lo = 0, hi = oneBits;
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+			float v;
+			std::memcpy(&v, &mid, sizeof(v));
+			if (encode(v) >= k)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+		std::memcpy(&thresholds[k], &lo, sizeof(float));
+	}
+	thresholds[256] = std::numeric_limits<float>::infinity();
+
+	lut.resize(lutSize + 1);
+	int code = 0;
+	for (int i = 0; i <= lutSize; ++i) {
+		float v = i / (float)lutSize;
+		while (v >= thresholds[code + 1])
+			++code;
+		lut[i] = (uint8_t)code;
+	}
+}
+
+void ToneMapper::apply(const std::vector<Vector3f>& pixels, std::vector<uint8_t>& rgb) const {
+	// work through the image in chunks that stay in cache between the stages
+	constexpr int chunk = 4096;
+	float v[chunk];
+	const float* in = &pixels[0].x;
+	int n = (int)pixels.size() * 3;
+	rgb.resize(n);
+	for (int first = 0; first < n; first += chunk) {
+		int count = std::min(chunk, n - first);
+		std::memcpy(v, in + first, count * sizeof(float));
+		toneMap(v, count);
+		quantize(v, rgb.data() + first, count);
+	}
+}
+
+// Straight loops over the channel values so the compiler can vectorize them
+void ToneMapper::toneMap(float* v, int n) const {
+	switch (op) {
+	case ToneOperator::Clamp:
+		for (int i = 0; i < n; ++i)
+			v[i] = std::min(std::max(v[i] * exposure, 0.0f), 1.0f);
+		break;
+	case ToneOperator::Reinhard:
+		for (int i = 0; i < n; ++i) {
+			float x = std::max(v[i] * exposure, 0.0f);
+			v[i] = x / (1 + x);
+		}
+		break;
+	case ToneOperator::ACES:
+		// Narkowicz's fit of the ACES filmic curve
+		for (int i = 0; i < n; ++i) {
+			float x = std::max(v[i] * exposure, 0.0f);
+			v[i] = std::min(x * (2.51f * x + 0.03f) / (x * (2.43f * x + 0.59f) + 0.14f), 1.0f);
+		}
+		break;
+	}
+}
+
+void ToneMapper::quantize(const float* v, uint8_t* out, int n) const {
+	for (int i = 0; i < n; ++i) {
+		// same argument order as clamp(), so NaN ends up as 1 like before
+		float x = std::max(0.0f, std::min(1.0f, v[i]));
+		int k = lut[(int)(x * lutSize)];
+		k -= x < thresholds[k];
+		k += x >= thresholds[k + 1];
+		out[i] = (uint8_t)k;
+	}
+}
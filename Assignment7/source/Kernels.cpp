@@ -0,0 +1,294 @@
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include "Kernels.hpp"
+#include "global.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define RT_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+// MSVC accepts AVX2 intrinsics anywhere, the dispatcher makes sure they only run on capable CPUs
+#define RT_TARGET_AVX2
+#else
+#define RT_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+void TriangleSoA::resize(int n) {
+	count = n;
+	// zero edges give det == 0, which every kernel rejects
+	for (auto* a : {&v0x, &v0y, &v0z, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z})
+		a->assign(n + kBlockWidth, 0.0f);
+}
+
+void TriangleSoA::set(int i, const Vector3f& v0, const Vector3f& e1, const Vector3f& e2) {
+	v0x[i] = v0.x, v0y[i] = v0.y, v0z[i] = v0.z;
+	e1x[i] = e1.x, e1y[i] = e1.y, e1z[i] = e1.z;
+	e2x[i] = e2.x, e2y[i] = e2.y, e2z[i] = e2.z;
+}
+
+BoxBlock::BoxBlock() {
+	// empty boxes, callers mask unused lanes out anyway
+	std::fill_n(&minX[0], 3 * kBlockWidth, std::numeric_limits<float>::max());
+	std::fill_n(&maxX[0], 3 * kBlockWidth, std::numeric_limits<float>::lowest());
+}
+
+void BoxBlock::set(int lane, const Vector3f& pMin, const Vector3f& pMax) {
+	minX[lane] = pMin.x, minY[lane] = pMin.y, minZ[lane] = pMin.z;
+	maxX[lane] = pMax.x, maxY[lane] = pMax.y, maxZ[lane] = pMax.z;
+}
+
+// Scalar kernels, also the reference the SIMD versions must agree with
+
+static int intersectTrianglesScalar(const TriangleSoA& b, int first, int count, const Vector3f& o,
+                                    const Vector3f& d, float& tHit) {
+	int hit = -1;
+	for (int i = first; i < first + count; ++i) {
+		float px = d.y * b.e2z[i] - d.z * b.e2y[i];
+		float py = d.z * b.e2x[i] - d.x * b.e2z[i];
+		float pz = d.x * b.e2y[i] - d.y * b.e2x[i];
+		float det = b.e1x[i] * px + b.e1y[i] * py + b.e1z[i] * pz;
+		// back faces and rays parallel to the triangle miss, as in Triangle::getIntersection
+		if (!(det >= EPSILON))
+			continue;
+		float invDet = 1.0f / det;
+		float tx = o.x - b.v0x[i], ty = o.y - b.v0y[i], tz = o.z - b.v0z[i];
+		float u = (tx * px + ty * py + tz * pz) * invDet;
+		float qx = ty * b.e1z[i] - tz * b.e1y[i];
+		float qy = tz * b.e1x[i] - tx * b.e1z[i];
+		float qz = tx * b.e1y[i] - ty * b.e1x[i];
+		float v = (d.x * qx + d.y * qy + d.z * qz) * invDet;
+		float t = (b.e2x[i] * qx + b.e2y[i] * qy + b.e2z[i] * qz) * invDet;
+		if (u >= 0 && v >= 0 && u + v <= 1 && t > 0 && t < tHit) {
+			tHit = t;
+			hit = i - first;
+		}
+	}
+	return hit;
+}
+
+static int intersectBoxesScalar(const BoxBlock& b, int count, const Vector3f& o, const Vector3f& invDir, float tMax,
+                                float* tEnter) {
+	int mask = 0;
+	for (int i = 0; i < count; ++i) {
+		float tx0 = (b.minX[i] - o.x) * invDir.x, tx1 = (b.maxX[i] - o.x) * invDir.x;
+		float ty0 = (b.minY[i] - o.y) * invDir.y, ty1 = (b.maxY[i] - o.y) * invDir.y;
+		float tz0 = (b.minZ[i] - o.z) * invDir.z, tz1 = (b.maxZ[i] - o.z) * invDir.z;
+		float tNear = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::min(tz0, tz1));
+		float tFar = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::max(tz0, tz1));
+		tEnter[i] = tNear;
+		if (tNear <= tFar && tFar >= 0 && tNear <= tMax)
+			mask |= 1 << i;
+	}
+	return mask;
+}
+
+#ifdef RT_X86
+
+// SSE: two passes of 4 lanes over a block
+
+static int intersectTrianglesSSE(const TriangleSoA& b, int first, int count, const Vector3f& o, const Vector3f& d,
+                                 float& tHit) {
+	const __m128 dx = _mm_set1_ps(d.x), dy = _mm_set1_ps(d.y), dz = _mm_set1_ps(d.z);
+	const __m128 ox = _mm_set1_ps(o.x), oy = _mm_set1_ps(o.y), oz = _mm_set1_ps(o.z);
+	const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), eps = _mm_set1_ps(EPSILON);
+	int hit = -1;
+	for (int base = 0; base < count; base += 4) {
+		int i0 = first + base;
+		__m128 e1x = _mm_loadu_ps(&b.e1x[i0]), e1y = _mm_loadu_ps(&b.e1y[i0]), e1z = _mm_loadu_ps(&b.e1z[i0]);
+		__m128 e2x = _mm_loadu_ps(&b.e2x[i0]), e2y = _mm_loadu_ps(&b.e2y[i0]), e2z = _mm_loadu_ps(&b.e2z[i0]);
+		__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+		__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+		__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+		__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+		__m128 valid = _mm_cmpge_ps(det, eps);
+		if (_mm_movemask_ps(valid) == 0)
+			continue;
+		__m128 invDet = _mm_div_ps(one, det);
+		__m128 tx = _mm_sub_ps(ox, _mm_loadu_ps(&b.v0x[i0]));
+		__m128 ty = _mm_sub_ps(oy, _mm_loadu_ps(&b.v0y[i0]));
+		__m128 tz = _mm_sub_ps(oz, _mm_loadu_ps(&b.v0z[i0]));
+		__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)),
+		                      invDet);
+		__m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+		__m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+		__m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+		__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)),
+		                      invDet);
+		__m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)),
+		                      invDet);
+		valid = _mm_and_ps(valid, _mm_cmpge_ps(u, zero));
+		valid = _mm_and_ps(valid, _mm_cmpge_ps(v, zero));
+		valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u, v), one));
+		valid = _mm_and_ps(valid, _mm_cmpgt_ps(t, zero));
+		valid = _mm_and_ps(valid, _mm_cmplt_ps(t, _mm_set1_ps(tHit)));
+		// lanes past count belong to the next leaf
+		int mask = _mm_movemask_ps(valid) & ((1 << (count - base)) - 1);
+		if (mask == 0)
+			continue;
+		alignas(16) float ts[4];
+		_mm_store_ps(ts, t);
+		for (int i = 0; i < 4; ++i) {
+			if ((mask >> i & 1) && ts[i] < tHit) {
+				tHit = ts[i];
+				hit = base + i;
+			}
+		}
+	}
+	return hit;
+}
+
+static int intersectBoxesSSE(const BoxBlock& b, int count, const Vector3f& o, const Vector3f& invDir, float tMax,
+                             float* tEnter) {
+	const __m128 ox = _mm_set1_ps(o.x), oy = _mm_set1_ps(o.y), oz = _mm_set1_ps(o.z);
+	const __m128 ix = _mm_set1_ps(invDir.x), iy = _mm_set1_ps(invDir.y), iz = _mm_set1_ps(invDir.z);
+	const __m128 zero = _mm_setzero_ps(), tm = _mm_set1_ps(tMax);
+	int mask = 0;
+	for (int base = 0; base < count; base += 4) {
+		__m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(b.minX + base), ox), ix);
+		__m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(b.maxX + base), ox), ix);
+		__m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(b.minY + base), oy), iy);
+		__m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(b.maxY + base), oy), iy);
+		__m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(b.minZ + base), oz), iz);
+		__m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(b.maxZ + base), oz), iz);
+		__m128 tNear = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)), _mm_min_ps(tz0, tz1));
+		__m128 tFar = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)), _mm_max_ps(tz0, tz1));
+		__m128 hit = _mm_and_ps(_mm_cmple_ps(tNear, tFar),
+		                        _mm_and_ps(_mm_cmpge_ps(tFar, zero), _mm_cmple_ps(tNear, tm)));
+		_mm_storeu_ps(tEnter + base, tNear);
+		mask |= _mm_movemask_ps(hit) << base;
+	}
+	return mask & ((1 << count) - 1);
+}
+
+// AVX2: a whole block per instruction
+
+RT_TARGET_AVX2 static int intersectTrianglesAVX2(const TriangleSoA& b, int first, int count, const Vector3f& o,
+                                                 const Vector3f& d, float& tHit) {
+	const __m256 dx = _mm256_set1_ps(d.x), dy = _mm256_set1_ps(d.y), dz = _mm256_set1_ps(d.z);
+	__m256 e1x = _mm256_loadu_ps(&b.e1x[first]), e1y = _mm256_loadu_ps(&b.e1y[first]);
+	__m256 e1z = _mm256_loadu_ps(&b.e1z[first]);
+	__m256 e2x = _mm256_loadu_ps(&b.e2x[first]), e2y = _mm256_loadu_ps(&b.e2y[first]);
+	__m256 e2z = _mm256_loadu_ps(&b.e2z[first]);
+	__m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+	__m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+	__m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+	__m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)),
+	                           _mm256_mul_ps(e1z, pz));
+	__m256 valid = _mm256_cmp_ps(det, _mm256_set1_ps(EPSILON), _CMP_GE_OQ);
+	if (_mm256_movemask_ps(valid) == 0)
+		return -1;
+	const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+	__m256 invDet = _mm256_div_ps(one, det);
+	__m256 tx = _mm256_sub_ps(_mm256_set1_ps(o.x), _mm256_loadu_ps(&b.v0x[first]));
+	__m256 ty = _mm256_sub_ps(_mm256_set1_ps(o.y), _mm256_loadu_ps(&b.v0y[first]));
+	__m256 tz = _mm256_sub_ps(_mm256_set1_ps(o.z), _mm256_loadu_ps(&b.v0z[first]));
+	__m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)),
+	                                       _mm256_mul_ps(tz, pz)), invDet);
+	__m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+	__m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+	__m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+	__m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)),
+	                                       _mm256_mul_ps(dz, qz)), invDet);
+	__m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)),
+	                                       _mm256_mul_ps(e2z, qz)), invDet);
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, zero, _CMP_GT_OQ));
+	valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, _mm256_set1_ps(tHit), _CMP_LT_OQ));
+	// lanes past count belong to the next leaf
+	int mask = _mm256_movemask_ps(valid) & ((1 << count) - 1);
+	if (mask == 0)
+		return -1;
+	alignas(32) float ts[8];
+	_mm256_store_ps(ts, t);
+	int hit = -1;
+	for (int i = 0; i < 8; ++i) {
+		if ((mask >> i & 1) && ts[i] < tHit) {
+			tHit = ts[i];
+			hit = i;
+		}
+	}
+	return hit;
+}
+
+RT_TARGET_AVX2 static int intersectBoxesAVX2(const BoxBlock& b, int count, const Vector3f& o,
+                                             const Vector3f& invDir, float tMax, float* tEnter) {
+	const __m256 ox = _mm256_set1_ps(o.x), oy = _mm256_set1_ps(o.y), oz = _mm256_set1_ps(o.z);
+	const __m256 ix = _mm256_set1_ps(invDir.x), iy = _mm256_set1_ps(invDir.y), iz = _mm256_set1_ps(invDir.z);
+	__m256 tx0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(b.minX), ox), ix);
+	__m256 tx1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(b.maxX), ox), ix);
+	__m256 ty0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(b.minY), oy), iy);
+	__m256 ty1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(b.maxY), oy), iy);
+	__m256 tz0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(b.minZ), oz), iz);
+	__m256 tz1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(b.maxZ), oz), iz);
+	__m256 tNear = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx0, tx1), _mm256_min_ps(ty0, ty1)),
+	                             _mm256_min_ps(tz0, tz1));
+	__m256 tFar = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx0, tx1), _mm256_max_ps(ty0, ty1)),
+	                            _mm256_max_ps(tz0, tz1));
+	__m256 hit = _mm256_and_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ),
+	                           _mm256_and_ps(_mm256_cmp_ps(tFar, _mm256_setzero_ps(), _CMP_GE_OQ),
+	                                         _mm256_cmp_ps(tNear, _mm256_set1_ps(tMax), _CMP_LE_OQ)));
+	_mm256_storeu_ps(tEnter, tNear);
+	return _mm256_movemask_ps(hit) & ((1 << count) - 1);
+}
+
+#endif
+
+static const KernelTable scalarKernels{intersectTrianglesScalar, intersectBoxesScalar, SimdLevel::Scalar, "scalar"};
+#ifdef RT_X86
+static const KernelTable sseKernels{intersectTrianglesSSE, intersectBoxesSSE, SimdLevel::SSE, "sse"};
+static const KernelTable avx2Kernels{intersectTrianglesAVX2, intersectBoxesAVX2, SimdLevel::AVX2, "avx2"};
+#endif
+
+SimdLevel detectSimdLevel() {
+#ifdef RT_X86
+	// SSE2 is part of x86-64, AVX2 also needs the OS to save the ymm registers
+#if defined(_MSC_VER) && !defined(__clang__)
+	int info[4];
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	__cpuidex(info, 7, 0);
+	bool avx2 = (info[1] & (1 << 5)) != 0;
+	if (osxsave && avx && avx2 && (_xgetbv(0) & 6) == 6)
+		return SimdLevel::AVX2;
+#else
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return SimdLevel::AVX2;
+#endif
+	return SimdLevel::SSE;
+#else
+	return SimdLevel::Scalar;
+#endif
+}
+
+static const KernelTable* tableFor(SimdLevel level) {
+	level = std::min(level, detectSimdLevel());
+#ifdef RT_X86
+	if (level == SimdLevel::AVX2)
+		return &avx2Kernels;
+	if (level == SimdLevel::SSE)
+		return &sseKernels;
+#endif
+	return &scalarKernels;
+}
+
+static std::atomic<const KernelTable*> activeKernels{nullptr};
+
+const KernelTable& kernels() {
+	const KernelTable* table = activeKernels.load(std::memory_order_relaxed);
+	if (table == nullptr) {
+		table = tableFor(SimdLevel::AVX2);
+		activeKernels.store(table, std::memory_order_relaxed);
+	}
+	return *table;
+}
+
+void setSimdLevel(SimdLevel level) {
+	activeKernels.store(tableFor(level), std::memory_order_relaxed);
+}
@@ -0,0 +1,163 @@
+#include "Network.hpp"
+
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+#include <algorithm>
+#include <cstring>
+
+namespace {
+#ifdef _WIN32
+// Winsock has to be started before the first socket call
+struct WinsockInit {
+	WinsockInit() {
+		WSADATA data;
+		WSAStartup(MAKEWORD(2, 2), &data);
+	}
+	~WinsockInit() { WSACleanup(); }
+} winsockInit;
+#endif
+
+// Tiles go out as soon as they are written, don't wait to fill a segment
+void setNoDelay(socket_t fd) {
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
+}
+}
+
+void Socket::close() {
+	if (fd == invalid)
+		return;
+#ifdef _WIN32
+	closesocket(fd);
+#else
+	::close(fd);
+#endif
+	fd = invalid;
+}
+
+void Socket::setReceiveTimeout(int timeoutMs) const {
+#ifdef _WIN32
+	DWORD timeout = timeoutMs;
+#else
+	timeval timeout;
+	timeout.tv_sec = timeoutMs / 1000;
+	timeout.tv_usec = (timeoutMs % 1000) * 1000;
+#endif
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+}
+
+Socket Socket::listen(int port) {
+	Socket s(::socket(AF_INET, SOCK_STREAM, 0));
+	if (!s.valid())
+		return s;
+	int one = 1;
+	setsockopt(s.fd, SOL_SOCKET, SO_REUSEADDR, (const char*)&one, sizeof(one));
+
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons((uint16_t)port);
+	if (::bind(s.fd, (const sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(s.fd, 16) != 0)
+		s.close();
+	return s;
+}
+
+Socket Socket::connect(const std::string& host, int port) {
+	addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo* result = nullptr;
+	if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result) != 0)
+		return Socket();
+
+	Socket s;
+	for (addrinfo* a = result; a && !s.valid(); a = a->ai_next) {
+		s = Socket(::socket(a->ai_family, a->ai_socktype, a->ai_protocol));
+		if (s.valid() && ::connect(s.fd, a->ai_addr, (int)a->ai_addrlen) != 0)
+			s.close();
+	}
+	freeaddrinfo(result);
+	if (s.valid())
+		setNoDelay(s.fd);
+	return s;
+}
+
+Socket Socket::accept() const {
+	Socket s(::accept(fd, nullptr, nullptr));
+	if (s.valid())
+		setNoDelay(s.fd);
+	return s;
+}
+
+bool Socket::sendAll(const void* data, size_t size) const {
+	const char* p = (const char*)data;
+	while (size > 0) {
+		int chunk = (int)std::min<size_t>(size, 1 << 20);
+#ifdef MSG_NOSIGNAL
+		// a worker that went away must not kill the coordinator with SIGPIPE
+		int sent = (int)::send(fd, p, chunk, MSG_NOSIGNAL);
+#else
+		int sent = (int)::send(fd, p, chunk, 0);
+#endif
+		if (sent <= 0)
+			return false;
+		p += sent;
+		size -= sent;
+	}
+	return true;
+}
+
+bool Socket::recvAll(void* data, size_t size) const {
+	char* p = (char*)data;
+	while (size > 0) {
+		int chunk = (int)std::min<size_t>(size, 1 << 20);
+		int received = (int)::recv(fd, p, chunk, 0);
+		if (received <= 0)
+			return false;
+		p += received;
+		size -= received;
+	}
+	return true;
+}
+
+int Socket::waitReadable(const std::vector<const Socket*>& sockets, int timeoutMs) {
+	fd_set readable;
+	FD_ZERO(&readable);
+	socket_t maxFd = 0;
+	for (const Socket* s : sockets) {
+		FD_SET(s->fd, &readable);
+		maxFd = std::max(maxFd, s->fd);
+	}
+	timeval timeout;
+	timeout.tv_sec = timeoutMs / 1000;
+	timeout.tv_usec = (timeoutMs % 1000) * 1000;
+	if (::select((int)maxFd + 1, &readable, nullptr, nullptr, &timeout) <= 0)
+		return -1;
+	for (int i = 0; i < (int)sockets.size(); ++i) {
+		if (FD_ISSET(sockets[i]->fd, &readable))
+			return i;
+	}
+	return -1;
+}
+
+bool sendMessage(const Socket& socket, MessageType type, const void* payload, uint32_t size) {
+	MessageHeader header = {messageMagic, type, size};
+	return socket.sendAll(&header, sizeof(header)) && (size == 0 || socket.sendAll(payload, size));
+}
+
+bool receiveMessage(const Socket& socket, MessageType& type, std::vector<char>& payload, uint32_t maxSize) {
+	MessageHeader header;
+	if (!socket.recvAll(&header, sizeof(header)) || header.magic != messageMagic || header.size > maxSize)
+		return false;
+	type = header.type;
+	payload.resize(header.size);
+	return header.size == 0 || socket.recvAll(payload.data(), header.size);
+}
@@ -2,24 +2,35 @@
 // Created by goksu on 2/25/20.
 //
 
+#include <atomic>
+#include <chrono>
 #include <thread>
 #include <fstream>
+#include <cstring>
+#include <filesystem>
 #include "Scene.hpp"
 #include "Renderer.hpp"
+#include "ThreadPool.hpp"
+#include "Wavefront.hpp"
+#include "Image.hpp"
+#include "Stats.hpp"
 
 inline float deg2rad(const float& deg) { return deg * M_PI / 180.0; }
 
-const float EPSILON = 0.00001;
+volatile std::sig_atomic_t Renderer::stopRequested = 0;
 
-Renderer::Renderer(int screen_width, int screen_height) {
+Renderer::Renderer(int screen_width, int screen_height, const RenderOptions& options)
+	: options(options), width(screen_width), height(screen_height) {
 	framebuffer = std::vector<Vector3f>(screen_width * screen_height);
+	pixels = std::vector<PixelStats>(screen_width * screen_height);
+	pixelCost = std::vector<uint64_t>(screen_width * screen_height);
 }
 
 
 // The main render function. This where we iterate over all pixels in the image,
 // generate primary rays and cast these rays into the scene. The content of the
 // framebuffer is saved to a file.
-void Renderer::Render(const Scene& scene) {
+bool Renderer::Render(const Scene& scene) {
 	float scale = tan(deg2rad(scene.fov * 0.5));
 	float imageAspectRatio = scene.width / (float)scene.height;
 	Vector3f eye_pos(278, 273, -800);
@@ -27,23 +38,59 @@ void Renderer::Render(const Scene& scene) {
 
 	// change the spp value to change sample ammount
 
-	int spp = 16;
-	int thread_n(4);
+	int spp = options.spp;
+	ThreadPool& pool = ThreadPool::global();
 
-	std::cout << "SPP: " << spp << "\n";
-	std::cout << "thread n: " << thread_n << "\n";
+	std::cout << "SPP: " << spp << (options.adaptive ? " (adaptive average)" : "") << "\n";
+	std::cout << "thread n: " << pool.size() << "\n";
 
-	TaskQueue queue(scene.width, scene.height);
-	std::vector<std::jthread> workers;
-	workers.reserve(thread_n);
+	// Samples are accumulated in passes. The sampler is seeded from (pixel,
+	// sample index) and indices continue from the pixel's sample count, so
+	// splitting the render into passes, or stopping and resuming it, gives
+	// the same image as rendering it in one go.
+	int nPixels = scene.width * scene.height;
+	long long budget = (long long)spp * nPixels;
+	int passCount = options.adaptive ? options.adaptivePasses : (spp + options.passSpp - 1) / options.passSpp;
+	auto lastCheckpoint = std::chrono::steady_clock::now();
+	bool interrupted = false;
+	resetStats();
+	while (nextPass < passCount) {
+		long long planned = planPass(nextPass, budget - samplesUsed);
+		if (planned == 0)
+			break;
+		std::cout << "Pass " << nextPass + 1 << "/" << passCount << "\n";
+		renderPass(scene, {0, 0, scene.width, scene.height});
+		samplesUsed += planned;
+		++nextPass;
 
-	for (int i(0); i < thread_n; i++) {
-		workers.emplace_back(
-			[this, &queue, &scene, spp]() {
-				rayCastWork(queue, scene, spp);
-			}
-		);
+		interrupted = stopRequested != 0;
+		if (interrupted)
+			break;
+		auto now = std::chrono::steady_clock::now();
+		if (!options.checkpointPath.empty()
+			&& now - lastCheckpoint >= std::chrono::seconds(options.checkpointInterval)) {
+			saveCheckpoint(options.checkpointPath);
+			// refresh the preview image alongside
+			for (int i = 0; i < nPixels; ++i)
+				framebuffer[i] = pixels[i].average();
+			Save(scene);
+			lastCheckpoint = now;
+		}
+	}
+	if (!options.checkpointPath.empty())
+		saveCheckpoint(options.checkpointPath);
+
+	if (options.adaptive && !interrupted) {
+		std::cout << "Adaptive sampling: " << samplesUsed << " samples, "
+			<< samplesUsed / (double)nPixels << " per pixel on average\n";
 	}
+#ifdef RT_STATS
+	printStats(collectStats(), std::cout);
+#endif
+
+	for (int i = 0; i < nPixels; ++i)
+		framebuffer[i] = pixels[i].average();
+	return !interrupted;
 
 	//for (uint32_t j = 0; j < scene.height; ++j) {
 	//	for (uint32_t i = 0; i < scene.width; ++i) {
@@ -63,42 +110,268 @@ void Renderer::Render(const Scene& scene) {
 	//UpdateProgress(1.f);
 }
 
-void Renderer::Save(const Scene& scene) {
-	// save framebuffer to file
-	FILE* fp = fopen("binary.ppm", "wb");
-	(void)fprintf(fp, "P6\n%d %d\n255\n", scene.width, scene.height);
-	for (auto i = 0; i < scene.height * scene.width; ++i) {
-		static unsigned char color[3];
-		color[0] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].x), 0.6f));
-		color[1] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].y), 0.6f));
-		color[2] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].z), 0.6f));
-		fwrite(color, 1, 3, fp);
+long long Renderer::planPass(int pass, long long budget) {
+	int nPixels = (int)pixels.size();
+	if (budget <= 0) {
+		passSamples.assign(nPixels, 0);
+		return 0;
+	}
+	if (!options.adaptive) {
+		int n = std::min(options.passSpp, options.spp - pass * options.passSpp);
+		passSamples.assign(nPixels, std::max(n, 0));
+		return (long long)passSamples[0] * nPixels;
+	}
+	if (pass == 0) {
+		// enough samples everywhere for a first variance estimate
+		passSamples.assign(nPixels, std::max(4, options.spp / 4));
+		return (long long)passSamples[0] * nPixels;
+	}
+	return planAdaptivePass(budget, options.adaptivePasses - pass);
+}
+
+void Renderer::renderPass(const Scene& scene, const TileTask& region, bool showProgress) {
+	ThreadPool& pool = ThreadPool::global();
+
+	// Every worker starts on its own contiguous run of the Morton-ordered
+	// tiles; idle workers steal the remaining tiles of the others
+	std::vector<TileTask> tiles = makeTiles(region.x1 - region.x0, region.y1 - region.y0, options.tileSize);
+	for (TileTask& tile : tiles) {
+		tile.x0 += region.x0, tile.x1 += region.x0;
+		tile.y0 += region.y0, tile.y1 += region.y0;
+	}
+	std::atomic<int> finished(0);
+	int nTiles = (int)tiles.size();
+	for (int i(0); i < nTiles; i++) {
+		int worker = (int)((long long)i * pool.size() / nTiles);
+		pool.submit(worker, [this, &tiles, &scene, &finished, i]() {
+			rayCastWork(tiles[i], scene);
+			finished.fetch_add(1, std::memory_order_release);
+		});
+	}
+
+	while (finished.load(std::memory_order_acquire) < nTiles) {
+		if (showProgress)
+			UpdateProgress(finished.load(std::memory_order_relaxed) / (float)nTiles);
+		std::this_thread::sleep_for(std::chrono::milliseconds(showProgress ? 100 : 1));
+	}
+	if (showProgress) {
+		UpdateProgress(1.f);
+		std::cout << "\n";
+	}
+}
+
+long long Renderer::planAdaptivePass(long long budget, int passesLeft) {
+	int nPixels = (int)pixels.size();
+	int maxSpp = options.spp * options.maxSppFactor;
+	passSamples.assign(nPixels, 0);
+	double errorSum = 0;
+	for (int i = 0; i < nPixels; ++i) {
+		float error = pixels[i].relativeError();
+		if (error > options.errorThreshold && pixels[i].count < maxSpp)
+			errorSum += error;
+	}
+	if (errorSum == 0)
+		return 0;
+
+	// Spread this pass's share of the remaining budget over the unconverged
+	// pixels, noisier pixels getting more. Fractional shares are carried to
+	// the next pixel so the pass spends exactly its share.
+	double passBudget = budget / (double)passesLeft;
+	double carry = 0;
+	long long planned = 0;
+	for (int i = 0; i < nPixels; ++i) {
+		float error = pixels[i].relativeError();
+		int n = 0;
+		if (error > options.errorThreshold && pixels[i].count < maxSpp) {
+			carry += passBudget * error / errorSum;
+			n = std::min((int)carry, maxSpp - pixels[i].count);
+			carry -= n;
+		}
+		passSamples[i] = n;
+		planned += n;
+	}
+	return planned;
+}
+
+namespace {
+// Everything needed to continue a render: the sampling options, the pass to
+// continue with and the raw per-pixel statistics that follow the header.
+// Sample counts double as the sampler state since samples are seeded from
+// (pixel, sample index).
+struct CheckpointHeader {
+	char magic[8];
+	int32_t width, height;
+	int32_t spp, adaptive, adaptivePasses, maxSppFactor, passSpp;
+	float errorThreshold;
+	int32_t nextPass;
+	int64_t samplesUsed;
+};
+
+const char checkpointMagic[8] = "RTCKPT1";
+}
+
+bool Renderer::saveCheckpoint(const std::string& filename) const {
+	CheckpointHeader header = {};
+	std::memcpy(header.magic, checkpointMagic, sizeof(header.magic));
+	header.width = width, header.height = height;
+	header.spp = options.spp;
+	header.adaptive = options.adaptive;
+	header.adaptivePasses = options.adaptivePasses;
+	header.maxSppFactor = options.maxSppFactor;
+	header.passSpp = options.passSpp;
+	header.errorThreshold = options.errorThreshold;
+	header.nextPass = nextPass;
+	header.samplesUsed = samplesUsed;
+
+	// Write next to the old checkpoint and swap it in, so a job killed while
+	// writing still leaves the previous checkpoint intact
+	std::string tmp = filename + ".tmp";
+	FILE* fp = fopen(tmp.c_str(), "wb");
+	if (!fp) {
+		std::cerr << "cannot write checkpoint " << tmp << "\n";
+		return false;
+	}
+	bool ok = fwrite(&header, sizeof(header), 1, fp) == 1
+		&& fwrite(pixels.data(), sizeof(PixelStats), pixels.size(), fp) == pixels.size();
+	ok = fclose(fp) == 0 && ok;
+	std::error_code ec;
+	if (ok)
+		std::filesystem::rename(tmp, filename, ec);
+	if (!ok || ec) {
+		std::cerr << "cannot write checkpoint " << filename << "\n";
+		return false;
+	}
+	return true;
+}
+
+bool Renderer::LoadCheckpoint(const std::string& filename) {
+	FILE* fp = fopen(filename.c_str(), "rb");
+	if (!fp) {
+		std::cerr << "cannot open checkpoint " << filename << "\n";
+		return false;
 	}
+	CheckpointHeader header;
+	std::vector<PixelStats> loaded(pixels.size());
+	bool ok = fread(&header, sizeof(header), 1, fp) == 1
+		&& std::memcmp(header.magic, checkpointMagic, sizeof(header.magic)) == 0
+		&& header.width == width && header.height == height
+		&& fread(loaded.data(), sizeof(PixelStats), loaded.size(), fp) == loaded.size();
 	fclose(fp);
+	if (!ok) {
+		std::cerr << "checkpoint " << filename << " is not a " << width << "x" << height << " render\n";
+		return false;
+	}
+
+	options.spp = header.spp;
+	options.adaptive = header.adaptive != 0;
+	options.adaptivePasses = header.adaptivePasses;
+	options.maxSppFactor = header.maxSppFactor;
+	options.passSpp = header.passSpp;
+	options.errorThreshold = header.errorThreshold;
+	nextPass = header.nextPass;
+	samplesUsed = header.samplesUsed;
+	pixels = std::move(loaded);
+	std::cout << "Resuming " << filename << " at pass " << nextPass + 1 << ", "
+		<< samplesUsed << " samples done\n";
+	return true;
+}
+
+// Blue (t = 0) through green to red (t = 1)
+static void heatmapColour(float t, uint8_t* rgb) {
+	rgb[0] = (uint8_t)(255 * clamp(0, 1, 2 * t - 1));
+	rgb[1] = (uint8_t)(255 * (1 - std::abs(2 * t - 1)));
+	rgb[2] = (uint8_t)(255 * clamp(0, 1, 1 - 2 * t));
 }
 
+void Renderer::SaveSampleHeatmap(const Scene& scene, const char* filename) {
+	int maxCount = 1;
+	for (const PixelStats& p : pixels)
+		maxCount = std::max(maxCount, p.count);
 
-void Renderer::rayCastWork(TaskQueue& queue, const Scene& scene, int spp) {
-	float scale = tan(deg2rad(scene.fov * 0.5f));
-	float aspect = scene.width / (float)scene.height;
-	Vector3f eye_pos(278, 273, -800);
+	std::vector<uint8_t> rgb(3 * pixels.size());
+	for (int i = 0; i < (int)pixels.size(); ++i)
+		heatmapColour(pixels[i].count / (float)maxCount, &rgb[3 * i]);
+	writePPM(filename, scene.width, scene.height, rgb);
+	std::cout << "Sample heatmap written to " << filename << " (red = " << maxCount << " spp)\n";
+}
 
-	PixelTask task;
-	int idx;
-	while (queue.fetch(task)) {
-		idx = task.y * scene.width + task.x;
+void Renderer::SaveCostHeatmap(const Scene& scene, const char* filename) {
+#ifdef RT_STATS
+	// cost per sample, so adaptive sampling does not show up as cost
+	std::vector<double> cost(pixels.size());
+	double maxCost = 1;
+	for (int i = 0; i < (int)pixels.size(); ++i) {
+		cost[i] = pixels[i].count > 0 ? pixelCost[i] / (double)pixels[i].count : 0;
+		maxCost = std::max(maxCost, cost[i]);
+	}
 
-		float x = (2 * (task.x + 0.5) / (float)scene.width - 1) * aspect * scale;
-		float y = (1 - 2 * (task.y + 0.5) / (float)scene.height) * scale;
+	std::vector<uint8_t> rgb(3 * pixels.size());
+	for (int i = 0; i < (int)pixels.size(); ++i)
+		heatmapColour((float)(cost[i] / maxCost), &rgb[3 * i]);
+	writePPM(filename, scene.width, scene.height, rgb);
+	std::cout << "Cost heatmap written to " << filename << " (red = " << maxCost << " tests per sample)\n";
+#else
+	std::cerr << "cannot write " << filename << ": built without RT_STATS\n";
+#endif
+}
 
-		Vector3f dir = normalize(Vector3f(-x, y, 1));
-		Ray ray(eye_pos, dir);
+void Renderer::Save(const Scene& scene) {
+	// The first operator goes to binary.ppm, every further one to
+	// binary_<operator>.ppm, all from the same framebuffer
+	std::vector<uint8_t> rgb;
+	for (int i = 0; i < (int)options.toneOperators.size(); ++i) {
+		ToneOperator op = options.toneOperators[i];
+		ToneMapper(op, options.exposure).apply(framebuffer, rgb);
+		std::string filename = i == 0 ? "binary.ppm" : std::string("binary_") + toneOperatorName(op) + ".ppm";
+		if (!writePPM(filename, scene.width, scene.height, rgb))
+			std::cerr << "cannot write " << filename << "\n";
+	}
+	if (!options.hdrPath.empty() && !writePFM(options.hdrPath, scene.width, scene.height, framebuffer))
+		std::cerr << "cannot write " << options.hdrPath << "\n";
+}
 
-		Vector3f color(0);
-		for (int s = 0; s < spp; ++s) {
-			color += scene.castRay(ray, 0);
-		}
+bool Renderer::LoadHDR(const std::string& filename) {
+	int w, h;
+	std::vector<Vector3f> image;
+	if (!readPFM(filename, w, h, image) || w != width || h != height) {
+		std::cerr << "cannot read a " << width << "x" << height << " PFM image from " << filename << "\n";
+		return false;
+	}
+	framebuffer = std::move(image);
+	return true;
+}
+
+void Renderer::rayCastWork(const TileTask& tile, const Scene& scene) {
+	if (options.integrator == Integrator::Wavefront) {
+		thread_local WavefrontIntegrator wavefront;
+		wavefront.renderTile(scene, Camera(scene), tile, passSamples, pixels, pixelCost);
+		return;
+	}
 
-		framebuffer[idx] = color / static_cast<float>(spp);
+	Camera camera(scene);
+	Sampler sampler;
+	for (int py = tile.y0; py < tile.y1; ++py) {
+		for (int px = tile.x0; px < tile.x1; ++px) {
+			int idx = py * scene.width + px;
+			int n = passSamples[idx];
+			if (n == 0)
+				continue;
+			Ray ray = camera.generateRay(px, py);
+
+			// Sample indices continue where the previous pass stopped, so a
+			// pixel sees the same sequence however its samples are split up
+			PixelStats& stats = pixels[idx];
+			int first = stats.count;
+#ifdef RT_STATS
+			uint64_t costBefore = threadStats().cost();
+#endif
+			for (int s = first; s < first + n; ++s) {
+				sampler.startPixelSample(idx, s);
+				stats.add(scene.castRay(ray, 0, sampler));
+			}
+#ifdef RT_STATS
+			pixelCost[idx] += threadStats().cost() - costBefore;
+#endif
+		}
 	}
 }
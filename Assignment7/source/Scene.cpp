@@ -3,35 +3,55 @@
 //
 
 #include "Scene.hpp"
+#include "Stats.hpp"
 
 
 void Scene::buildBVH() {
-	printf(" - Generating BVH...\n\n");
-	this->bvh = new BVHAccel(objects, 1, BVHAccel::SplitMethod::NAIVE);
+	if (BVHAccel::printBuildStats)
+		printf(" - Generating BVH...\n\n");
+	this->bvh = new BVHAccel(objects, maxPrimsInNode, splitMethod, bvhWidth);
+
+	// Lights are picked proportional to their area, so the pdf of a light
+	// point is 1 / total emissive area
+	emitters.clear();
+	emitAreaSum = 0;
+	std::vector<float> areas;
+	for (Object* object : objects) {
+		if (object->hasEmit()) {
+			emitters.push_back(object);
+			areas.push_back(object->getArea());
+			emitAreaSum += object->getArea();
+		}
+	}
+	lightTable = AliasTable(areas);
 }
 
 Intersection Scene::intersect(const Ray& ray) const {
+	RT_STAT_ADD(rays, 1);
 	return this->bvh->Intersect(ray);
 }
 
-void Scene::sampleLight(Intersection& pos, float& pdf) const {
-	float emit_area_sum = 0;
-	for (uint32_t k = 0; k < objects.size(); ++k) {
-		if (objects[k]->hasEmit()) {
-			emit_area_sum += objects[k]->getArea();
-		}
-	}
-	float p = get_random_float() * emit_area_sum;
-	emit_area_sum = 0;
-	for (uint32_t k = 0; k < objects.size(); ++k) {
-		if (objects[k]->hasEmit()) {
-			emit_area_sum += objects[k]->getArea();
-			if (p <= emit_area_sum) {
-				objects[k]->Sample(pos, pdf);
-				break;
-			}
-		}
+bool Scene::intersectP(const Ray& ray, float tMax) const {
+	RT_STAT_ADD(shadowRays, 1);
+	return this->bvh->IntersectP(ray, tMax);
+}
+
+void Scene::sampleLight(Intersection& pos, float& pdf, Sampler& sampler) const {
+	if (lightTable.empty()) {
+		pdf = 0;
+		return;
 	}
+	int k = lightTable.sample(sampler.get1D());
+	emitters[k]->Sample(pos, pdf, sampler);
+	pdf *= lightTable.pmf(k);
+}
+
+float Scene::lightPdf(const Intersection& lightHit, float distance, const Vector3f& dir) const {
+	float cosLight = dotProduct(-dir, lightHit.normal);
+	if (emitAreaSum <= 0 || cosLight <= 0)
+		return 0;
+	// every emitter point is equally likely, 1 / area converted to solid angle
+	return distance * distance / (cosLight * emitAreaSum);
 }
 
 bool Scene::trace(
@@ -52,66 +72,71 @@ bool Scene::trace(
 	return (*hitObject != nullptr);
 }
 
-// Implementation of Path Tracing
-Vector3f Scene::castRay(const Ray& ray_in, int depth) const {
-	Vector3f L_dir = Vector3f();
-	Vector3f L_indir = Vector3f();
-
-	Intersection ray_in_isect = intersect(ray_in);
-
-	if (!ray_in_isect.happened) {
-		return {};
-	}
-
-	if (ray_in_isect.m->hasEmission()) {
-		if (depth == 0) {
-			return ray_in_isect.m->getEmission();
+// Implementation of Path Tracing. The path is followed in a loop: the hit of
+// each bounce's continuation ray is the next path vertex, so every segment is
+// intersected once, and throughput carries the product of f * cos / pdf
+// (and the Russian roulette weights) of the bounces so far.
+Vector3f Scene::castRay(const Ray& ray_in, int depth, Sampler& sampler) const {
+	Vector3f L(0);
+	Vector3f throughput(1);
+	Ray ray = ray_in;
+	// pdf of the BSDF sample that produced ray, for the MIS weight on emitter hits
+	float bsdf_pdf = 0;
+	// closest-hit queries of the path, for the path length statistics
+	int segments = 1;
+
+	for (Intersection isect = intersect(ray); isect.happened; ++depth) {
+		Material* m = isect.m;
+		Vector3f wi = ray.direction;
+
+		// Emitters end the path. Seen directly they count fully, after a bounce
+		// they are the BSDF half of the MIS pair with light sampling.
+		if (m->hasEmission()) {
+			float weight = depth == 0 ? 1.0f : powerHeuristic(bsdf_pdf, lightPdf(isect, isect.distance, wi));
+			L += throughput * m->getEmission() * weight;
+			break;
 		}
-	}
-
-	Intersection light_sample_point;
-	float light_sample_point_pdf;
-	sampleLight(light_sample_point, light_sample_point_pdf);
-
-	Vector3f ray_out_ori = ray_in_isect.coords;
-	Vector3f ray_out_dir = (light_sample_point.coords - ray_in_isect.coords).normalized();
-	Ray ray_ori_to_light = Ray(ray_out_ori, ray_out_dir);
-
-	Intersection ray_ori_to_light_isect = intersect(ray_ori_to_light);
-
-	Vector3f ori_to_isect_line = (ray_ori_to_light_isect.coords - ray_ori_to_light.origin);
-	float ori_to_isect_distance_square = dotProduct(ori_to_isect_line, ori_to_isect_line);
-
-	if (ray_ori_to_light_isect.happened && ray_ori_to_light_isect.m->hasEmission()) {
-		//if (ray_in_isect.m->getType() == MICROFACET) {
-		//	std::cout << "now!" << '\n';
-		//}
-		L_dir =
-			ray_ori_to_light_isect.m->getEmission()
-			* ray_in_isect.m->eval(ray_in.direction, ray_ori_to_light.direction, ray_in_isect.normal)
-			* dotProduct(-ray_ori_to_light.direction, ray_ori_to_light_isect.normal)
-			* dotProduct(ray_ori_to_light.direction, ray_in_isect.normal)
-			/ ori_to_isect_distance_square
-			/ light_sample_point_pdf;
-	}
 
-
-	float fire = get_random_float();
-	if (fire < RussianRoulette) {
-		Vector3f ray_out_ori = ray_in_isect.coords;
-		Vector3f ray_out_dir = ray_in_isect.m->sample(ray_in.direction, ray_in_isect.normal);
-		Ray ray_out = Ray(ray_out_ori, ray_out_dir.normalized());
-
-		Intersection ray_out_isect = intersect(ray_out);
-		if (ray_out_isect.happened && !ray_out_isect.m->hasEmission()) {
-			L_indir =
-				castRay(ray_out, depth + 1)
-				* dotProduct(ray_out.direction, ray_in_isect.normal)
-				* ray_in_isect.m->eval(ray_in.direction, ray_out.direction, ray_in_isect.normal)
-				/ ray_in_isect.m->pdf(ray_in.direction, ray_out.direction, ray_in_isect.normal)
-				/ RussianRoulette;
+		Intersection light_sample_point;
+		float light_sample_point_pdf;
+		sampleLight(light_sample_point, light_sample_point_pdf, sampler);
+
+		Vector3f ray_to_light = light_sample_point.coords - isect.coords;
+		float light_distance_square = dotProduct(ray_to_light, ray_to_light);
+		float light_distance = std::sqrt(light_distance_square);
+		Ray ray_ori_to_light = Ray(isect.coords, ray_to_light / light_distance);
+		float light_cos = dotProduct(-ray_ori_to_light.direction, light_sample_point.normal);
+
+		// The light point counts if it faces us and nothing lies in between
+		if (light_sample_point_pdf > 0 && light_cos > 0
+			&& !intersectP(ray_ori_to_light, light_distance * (1 - shadowEpsilon))) {
+			// The same light could also be found by BSDF sampling, weight both by the power heuristic
+			float light_pdf = light_sample_point_pdf * light_distance_square / light_cos;
+			float light_bsdf_pdf = m->pdf(wi, ray_ori_to_light.direction, isect.normal);
+			L += throughput
+				* light_sample_point.emit
+				* m->eval(wi, ray_ori_to_light.direction, isect.normal)
+				* dotProduct(ray_ori_to_light.direction, isect.normal)
+				/ light_pdf
+				* powerHeuristic(light_pdf, light_bsdf_pdf);
 		}
+
+		if (sampler.get1D() >= RussianRoulette || depth + 1 >= maxPathDepth)
+			break;
+		Vector3f ray_out_dir = m->sample(wi, isect.normal, sampler).normalized();
+		bsdf_pdf = m->pdf(wi, ray_out_dir, isect.normal);
+		if (bsdf_pdf <= 0)
+			break;
+		throughput = throughput
+			* m->eval(wi, ray_out_dir, isect.normal)
+			* dotProduct(ray_out_dir, isect.normal)
+			/ bsdf_pdf
+			/ RussianRoulette;
+		ray = Ray(isect.coords, ray_out_dir);
+		isect = intersect(ray);
+		++segments;
 	}
 
-	return L_dir + L_indir;
+	RT_STAT_PATH(segments);
+	return L;
 }
@@ -0,0 +1,149 @@
+#include "Scenes.hpp"
+#include <algorithm>
+#include <random>
+#include "Instance.hpp"
+#include "Sphere.hpp"
+#include "Triangle.hpp"
+
+namespace {
+Material* newMaterial(SceneAssets& assets, MaterialType type, const Vector3f& emission) {
+	assets.materials.push_back(std::make_unique<Material>(type, emission));
+	return assets.materials.back().get();
+}
+
+void add(Scene& scene, SceneAssets& assets, std::unique_ptr<Object> object) {
+	scene.Add(object.get());
+	assets.objects.push_back(std::move(object));
+}
+}
+
+void addCornellBox(Scene& scene, SceneAssets& assets) {
+	Material* red = newMaterial(assets, DIFFUSE, Vector3f(0.0f));
+	red->Kd = Vector3f(0.63f, 0.065f, 0.05f);
+	Material* green = newMaterial(assets, DIFFUSE, Vector3f(0.0f));
+	green->Kd = Vector3f(0.14f, 0.45f, 0.091f);
+	Material* white = newMaterial(assets, DIFFUSE, Vector3f(0.0f));
+	white->Kd = Vector3f(0.725f, 0.71f, 0.68f);
+	Material* light = newMaterial(
+		assets, DIFFUSE,
+		(8.0f * Vector3f(0.747f + 0.058f, 0.747f + 0.258f, 0.747f) + 15.6f *
+			Vector3f(0.740f + 0.287f, 0.740f + 0.160f, 0.740f) + 18.4f * Vector3f(
+				0.737f + 0.642f, 0.737f + 0.159f, 0.737f)));
+	light->Kd = Vector3f(0.65f);
+
+	Material* Microfacet = newMaterial(assets, MICROFACET, Vector3f(0.0f));
+	Microfacet->Kd = Vector3f(0.5, 0.5, 0.5);
+	Microfacet->Ks = Vector3f(0.5, 0.5, 0.5);
+	Microfacet->ior = 2;
+
+	auto addMesh = [&](const char* name, Material* mt) {
+		add(scene, assets, std::make_unique<MeshTriangle>(
+			    std::string(ASSIGNMENT7_SOURCE_DIR) + "/models/cornellbox/" + name + ".obj", mt,
+			    scene.splitMethod, scene.maxPrimsInNode, scene.bvhWidth));
+	};
+	addMesh("floor", white);
+	addMesh("shortbox", white);
+	addMesh("tallbox", white);
+	addMesh("left", red);
+	addMesh("right", green);
+	addMesh("light", light);
+	add(scene, assets, std::make_unique<Sphere>(Vector3f(140, 250, 200), 50, Microfacet));
+}
+
+void addBunny(Scene& scene, SceneAssets& assets) {
+	Material* white = newMaterial(assets, DIFFUSE, Vector3f(0.0f));
+	white->Kd = Vector3f(0.725f, 0.71f, 0.68f);
+	add(scene, assets, std::make_unique<MeshTriangle>(std::string(ASSIGNMENT7_SOURCE_DIR) + "/models/bunny/bunny.obj",
+	                                                  white, scene.splitMethod, scene.maxPrimsInNode,
+	                                                  scene.bvhWidth));
+}
+
+void addTriangleSoup(Scene& scene, SceneAssets& assets, int nTriangles, uint32_t seed) {
+	Material* white = newMaterial(assets, DIFFUSE, Vector3f(0.0f));
+	white->Kd = Vector3f(0.725f, 0.71f, 0.68f);
+
+	// Small triangles of random orientation, edges up to 2 units long
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<float> position(0, 100), offset(-1, 1);
+	TriangleMesh mesh;
+	mesh.positions.reserve(3 * (size_t)nTriangles);
+	mesh.indices.reserve(3 * (size_t)nTriangles);
+	for (int i = 0; i < nTriangles; ++i) {
+		Vector3f center(position(rng), position(rng), position(rng));
+		for (int k = 0; k < 3; ++k) {
+			mesh.indices.push_back((uint32_t)mesh.positions.size());
+			mesh.positions.push_back(center + Vector3f(offset(rng), offset(rng), offset(rng)));
+		}
+	}
+	add(scene, assets, std::make_unique<MeshTriangle>(std::move(mesh), white, scene.splitMethod,
+	                                                  scene.maxPrimsInNode, scene.bvhWidth));
+}
+
+void addSliverSoup(Scene& scene, SceneAssets& assets, int nTriangles, uint32_t seed) {
+	Material* white = newMaterial(assets, DIFFUSE, Vector3f(0.0f));
+	white->Kd = Vector3f(0.725f, 0.71f, 0.68f);
+
+	// Triangles up to 50 units long and at most 1 wide, lying in a random axis plane
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<float> position(0, 100), length(5, 50), width(0.1f, 1);
+	std::uniform_int_distribution<int> axis(0, 2);
+	TriangleMesh mesh;
+	mesh.positions.reserve(3 * (size_t)nTriangles);
+	mesh.indices.reserve(3 * (size_t)nTriangles);
+	for (int i = 0; i < nTriangles; ++i) {
+		Vector3f corner(position(rng), position(rng), position(rng));
+		int along = axis(rng);
+		int across = (along + 1 + axis(rng) % 2) % 3;
+		Vector3f u(0.0f), v(0.0f);
+		u[along] = length(rng);
+		v[across] = width(rng);
+		for (const Vector3f& p : {corner, corner + u, corner + v}) {
+			mesh.indices.push_back((uint32_t)mesh.positions.size());
+			mesh.positions.push_back(p);
+		}
+	}
+	add(scene, assets, std::make_unique<MeshTriangle>(std::move(mesh), white, scene.splitMethod,
+	                                                  scene.maxPrimsInNode, scene.bvhWidth));
+}
+
+void addBunnyInstances(Scene& scene, SceneAssets& assets, int count, uint32_t seed) {
+	Material* white = newMaterial(assets, DIFFUSE, Vector3f(0.0f));
+	white->Kd = Vector3f(0.725f, 0.71f, 0.68f);
+	// the prototype is owned with the other objects but only its instances enter the scene
+	assets.objects.push_back(std::make_unique<MeshTriangle>(
+		std::string(ASSIGNMENT7_SOURCE_DIR) + "/models/bunny/bunny.obj", white, scene.splitMethod,
+		scene.maxPrimsInNode, scene.bvhWidth));
+	Object* bunny = assets.objects.back().get();
+
+	Bounds3 bounds = bunny->getBounds();
+	Vector3f extent = bounds.Diagonal();
+	Transform centered = Transform::scale(Vector3f(5 / std::max({extent.x, extent.y, extent.z})))
+		* Transform::translate(-bounds.Centroid());
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<float> position(0, 100), angle(0, 360), axis(-1, 1), size(0.5f, 1.5f);
+	for (int i = 0; i < count; ++i) {
+		Vector3f center(position(rng), position(rng), position(rng));
+		Vector3f rotationAxis(axis(rng), axis(rng), axis(rng));
+		if (dotProduct(rotationAxis, rotationAxis) < 1e-4f)
+			rotationAxis = Vector3f(0, 1, 0);
+		float degrees = angle(rng);
+		float scale = size(rng);
+		add(scene, assets, std::make_unique<Instance>(
+			    bunny, Transform::translate(center) * Transform::rotate(degrees, rotationAxis)
+			    * Transform::scale(Vector3f(scale)) * centered));
+	}
+}
+
+MeshSummary summarizeMeshes(const SceneAssets& assets) {
+	MeshSummary summary;
+	for (const auto& object : assets.objects) {
+		if (auto* mesh = dynamic_cast<const MeshTriangle*>(object.get())) {
+			summary.triangles += mesh->mesh.triangleCount();
+			summary.buildMs += mesh->bvh->stats.buildMs;
+		}
+		else if (dynamic_cast<const Instance*>(object.get())) {
+			++summary.instances;
+		}
+	}
+	return summary;
+}
@@ -0,0 +1,141 @@
+#include "Wavefront.hpp"
+#include "Stats.hpp"
+
+long long WavefrontIntegrator::renderTile(const Scene& scene, const Camera& camera, const TileTask& tile,
+                                          const std::vector<int>& sampleCounts, std::vector<PixelStats>& pixels,
+                                          std::vector<uint64_t>& pixelCost) {
+	generate(camera, tile, sampleCounts, pixels, scene.width);
+	radiance.assign(samplePixel.size(), Vector3f(0));
+#ifdef RT_STATS
+	sampleCost.assign(samplePixel.size(), 0);
+#endif
+	long long rays = 0;
+	while (current.size() > 0) {
+		extend(scene);
+		shade(scene);
+		traceShadowRays(scene);
+		rays += current.size() + shadow.size();
+		// shade() only queued the paths that survived, continue with those
+		std::swap(current, next);
+		next.clear();
+	}
+
+	// samples were generated pixel by pixel in sample order
+	for (int i = 0; i < (int)samplePixel.size(); ++i)
+		pixels[samplePixel[i]].add(radiance[i]);
+#ifdef RT_STATS
+	for (int i = 0; i < (int)samplePixel.size(); ++i)
+		pixelCost[samplePixel[i]] += sampleCost[i];
+#endif
+	return rays;
+}
+
+void WavefrontIntegrator::generate(const Camera& camera, const TileTask& tile, const std::vector<int>& sampleCounts,
+                                   const std::vector<PixelStats>& pixels, int imageWidth) {
+	current.clear();
+	samplePixel.clear();
+	Sampler sampler;
+	for (int py = tile.y0; py < tile.y1; ++py) {
+		for (int px = tile.x0; px < tile.x1; ++px) {
+			int idx = py * imageWidth + px;
+			int n = sampleCounts[idx];
+			if (n == 0)
+				continue;
+			Ray ray = camera.generateRay(px, py);
+			int first = pixels[idx].count;
+			for (int s = first; s < first + n; ++s) {
+				sampler.startPixelSample(idx, s);
+				current.push(ray.origin, ray.direction, Vector3f(1), (int)samplePixel.size(), 0, 0, sampler);
+				samplePixel.push_back(idx);
+			}
+		}
+	}
+}
+
+void WavefrontIntegrator::extend(const Scene& scene) {
+	hits.resize(current.size());
+	for (int i = 0; i < current.size(); ++i) {
+#ifdef RT_STATS
+		uint64_t costBefore = threadStats().cost();
+		hits[i] = scene.intersect(current.ray(i));
+		sampleCost[current.pixel[i]] += threadStats().cost() - costBefore;
+#else
+		hits[i] = scene.intersect(current.ray(i));
+#endif
+	}
+}
+
+void WavefrontIntegrator::shade(const Scene& scene) {
+	shadow.clear();
+	for (int i = 0; i < current.size(); ++i) {
+		const Intersection& isect = hits[i];
+		int depth = current.depth[i];
+		if (!isect.happened) {
+			RT_STAT_PATH(depth + 1);
+			continue;
+		}
+		Vector3f throughput(current.tr[i], current.tg[i], current.tb[i]);
+		int pixel = current.pixel[i];
+
+		Vector3f wi(current.dx[i], current.dy[i], current.dz[i]);
+
+		// Emitters end the path. Seen directly they count fully, after a bounce
+		// they are the BSDF half of the MIS pair with light sampling.
+		if (isect.m->hasEmission()) {
+			float weight = depth == 0
+				               ? 1.0f
+				               : powerHeuristic(current.pdf[i], scene.lightPdf(isect, isect.distance, wi));
+			radiance[pixel] += throughput * isect.m->getEmission() * weight;
+			RT_STAT_PATH(depth + 1);
+			continue;
+		}
+
+		Sampler sampler = current.sampler[i];
+
+		Intersection lightPoint;
+		float lightPdf;
+		scene.sampleLight(lightPoint, lightPdf, sampler);
+		Vector3f toLight = lightPoint.coords - isect.coords;
+		float distanceSquare = dotProduct(toLight, toLight);
+		float distance = std::sqrt(distanceSquare);
+		toLight = toLight / distance;
+		float lightCos = dotProduct(-toLight, lightPoint.normal);
+		if (lightPdf > 0 && lightCos > 0) {
+			float lightSolidAnglePdf = lightPdf * distanceSquare / lightCos;
+			float bsdfPdf = isect.m->pdf(wi, toLight, isect.normal);
+			Vector3f weight = throughput
+				* lightPoint.emit
+				* isect.m->eval(wi, toLight, isect.normal)
+				* dotProduct(toLight, isect.normal)
+				/ lightSolidAnglePdf
+				* powerHeuristic(lightSolidAnglePdf, bsdfPdf);
+			shadow.push(isect.coords, toLight, distance * (1 - Scene::shadowEpsilon), weight, pixel);
+		}
+
+		if (sampler.get1D() < scene.RussianRoulette && depth + 1 < scene.maxPathDepth) {
+			Vector3f wo = isect.m->sample(wi, isect.normal, sampler).normalized();
+			float pdf = isect.m->pdf(wi, wo, isect.normal);
+			if (pdf > 0) {
+				Vector3f f = isect.m->eval(wi, wo, isect.normal);
+				Vector3f nextThroughput = throughput * f * dotProduct(wo, isect.normal) / pdf / scene.RussianRoulette;
+				next.push(isect.coords, wo, nextThroughput, pixel, depth + 1, pdf, sampler);
+				continue;
+			}
+		}
+		RT_STAT_PATH(depth + 1);
+	}
+}
+
+void WavefrontIntegrator::traceShadowRays(const Scene& scene) {
+	for (int i = 0; i < shadow.size(); ++i) {
+#ifdef RT_STATS
+		uint64_t costBefore = threadStats().cost();
+		bool occluded = scene.intersectP(shadow.ray(i), shadow.tMax[i]);
+		sampleCost[shadow.pixel[i]] += threadStats().cost() - costBefore;
+#else
+		bool occluded = scene.intersectP(shadow.ray(i), shadow.tMax[i]);
+#endif
+		if (!occluded)
+			radiance[shadow.pixel[i]] += Vector3f(shadow.wr[i], shadow.wg[i], shadow.wb[i]);
+	}
+}
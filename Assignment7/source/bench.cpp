@@ -0,0 +1,489 @@
+// Ray throughput benchmark over fixed scenes. Reports BVH build time and, for
+// primary, shadow and secondary rays, Mrays/s and, in an RT_STATS build
+// (bench_stats), BVH nodes entered per ray, plus the peak resident set size,
+// as JSON on stdout. Scenes with lights are
+// also path traced with the recursive and the wavefront integrator. Each
+// scene runs in a process of its own, so the peak resident set size is the
+// scene's. Progress goes to stderr.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "Camera.hpp"
+#include "Renderer.hpp"
+#include "Sampler.hpp"
+#include "Scene.hpp"
+#include "Scenes.hpp"
+#include "Stats.hpp"
+#include "ThreadPool.hpp"
+#include "Wavefront.hpp"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace {
+struct BenchOptions {
+	// primary rays are shot through a resolution x resolution grid
+	int resolution = 512;
+	int soupTriangles = 1000000;
+	int sliverTriangles = 20000;
+	int bunnyInstances = 10000;
+	// every ray batch is traced this many times and the fastest run counts
+	int repeat = 3;
+	// samples per pixel of the path tracing phases
+	int spp = 2;
+	std::vector<Integrator> integrators = {Integrator::Recursive, Integrator::Wavefront};
+	std::vector<std::string> scenes = {"cornell", "bunny", "soup", "slivers", "instances"};
+	std::string outPath;
+	// set in the process running a single scene for its parent: where to
+	// write the scene's JSON object
+	std::string sceneJsonPath;
+};
+
+struct PhaseResult {
+	const char* name;
+	long long rays = 0;
+	double seconds = 0;
+	double nodesPerRay = 0;
+};
+
+struct SceneResult {
+	std::string name;
+	long long triangles = 0;
+	long long instances = 0;
+	double buildMs = 0;
+	std::vector<PhaseResult> phases;
+	long long peakRssKb = 0;
+};
+
+long long peakRssKb() {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return (long long)(counters.PeakWorkingSetSize / 1024);
+	return 0;
+#else
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+	return usage.ru_maxrss / 1024;
+#else
+	return usage.ru_maxrss;
+#endif
+#endif
+}
+
+// Run batch() repeat times and keep the fastest run. batch returns the number
+// of rays it traced; counters are taken from the first run.
+template <typename F>
+PhaseResult timePhase(const char* name, int repeat, F&& batch) {
+	PhaseResult result;
+	result.name = name;
+	result.seconds = 1e30;
+	for (int run = 0; run < repeat; ++run) {
+		resetStats();
+		auto start = std::chrono::steady_clock::now();
+		long long rays = batch();
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		result.seconds = std::min(result.seconds, seconds);
+		if (run == 0) {
+			RayStats stats = collectStats();
+			result.rays = rays;
+			result.nodesPerRay = rays > 0 ? stats.nodesVisited / (double)rays : 0;
+		}
+	}
+	std::cerr << "  " << name << ": " << result.rays / result.seconds * 1e-6 << " Mrays/s\n";
+	return result;
+}
+
+// Trace the batch with trace(i) for ray i
+template <typename F>
+PhaseResult runPhase(const char* name, int nRays, int repeat, F&& trace) {
+	return timePhase(name, repeat, [&] {
+		parallelFor(nRays, 1024, [&](int begin, int end) {
+			for (int i = begin; i < end; ++i)
+				trace(i);
+		});
+		return (long long)nRays;
+	});
+}
+
+// Path trace the image with spp samples per pixel, in tiles on the thread
+// pool as Renderer does, once with each integrator. Both integrators trace
+// the same rays, so the count the wavefront one keeps serves for both; a
+// recursive-only run makes an untimed wavefront pass to get it.
+void benchPaths(const Scene& scene, const BenchOptions& options, SceneResult& result) {
+	int nPixels = scene.width * scene.height;
+	std::vector<int> sampleCounts(nPixels, options.spp);
+	std::vector<TileTask> tiles = makeTiles(scene.width, scene.height, 32);
+	Camera camera(scene);
+	auto render = [&](Integrator integrator) {
+		std::vector<PixelStats> pixels(nPixels);
+		std::vector<uint64_t> pixelCost(nPixels);
+		std::atomic<long long> rays(0);
+		parallelFor((int)tiles.size(), 1, [&](int begin, int end) {
+			for (int t = begin; t < end; ++t) {
+				const TileTask& tile = tiles[t];
+				if (integrator == Integrator::Wavefront) {
+					thread_local WavefrontIntegrator wavefront;
+					rays += wavefront.renderTile(scene, camera, tile, sampleCounts, pixels, pixelCost);
+					continue;
+				}
+				Sampler sampler;
+				for (int py = tile.y0; py < tile.y1; ++py) {
+					for (int px = tile.x0; px < tile.x1; ++px) {
+						int idx = py * scene.width + px;
+						Ray ray = camera.generateRay(px, py);
+						for (int s = 0; s < options.spp; ++s) {
+							sampler.startPixelSample(idx, s);
+							pixels[idx].add(scene.castRay(ray, 0, sampler));
+						}
+					}
+				}
+			}
+		});
+		return rays.load();
+	};
+
+	long long rays = -1;
+	for (Integrator integrator : options.integrators) {
+		if (integrator == Integrator::Wavefront) {
+			result.phases.push_back(timePhase("paths_wavefront", options.repeat, [&] {
+				return rays = render(Integrator::Wavefront);
+			}));
+		}
+		else {
+			if (rays < 0)
+				rays = render(Integrator::Wavefront);
+			result.phases.push_back(timePhase("paths_recursive", options.repeat, [&] {
+				render(Integrator::Recursive);
+				return rays;
+			}));
+		}
+	}
+}
+
+SceneResult benchScene(const std::string& name, const Scene& prototype, const BenchOptions& options) {
+	SceneResult result;
+	result.name = name;
+	std::cerr << name << "\n";
+
+	Scene scene(options.resolution, options.resolution);
+	scene.splitMethod = prototype.splitMethod;
+	scene.maxPrimsInNode = prototype.maxPrimsInNode;
+	scene.bvhWidth = prototype.bvhWidth;
+	SceneAssets assets;
+	if (name == "cornell")
+		addCornellBox(scene, assets);
+	else if (name == "bunny")
+		addBunny(scene, assets);
+	else if (name == "soup")
+		addTriangleSoup(scene, assets, options.soupTriangles, 1);
+	else if (name == "slivers")
+		addSliverSoup(scene, assets, options.sliverTriangles, 1);
+	else
+		addBunnyInstances(scene, assets, options.bunnyInstances, 1);
+	scene.buildBVH();
+
+	// Build time of the scene BVH plus the per-mesh BVHs
+	MeshSummary meshes = summarizeMeshes(assets);
+	result.triangles = meshes.triangles;
+	result.instances = meshes.instances;
+	result.buildMs = scene.bvh->stats.buildMs + meshes.buildMs;
+
+	// Camera on the -z side of the scene looking at its bounds, every
+	// pixel of the grid one primary ray
+	Bounds3 bounds = scene.bvh->WorldBound();
+	Vector3f center = bounds.Centroid();
+	Vector3f extent = bounds.Diagonal();
+	Vector3f eye = center - Vector3f(0, 0, 1.5f * std::max({extent.x, extent.y, extent.z}));
+	int n = options.resolution;
+	std::vector<Ray> primary;
+	primary.reserve((size_t)n * n);
+	for (int y = 0; y < n; ++y) {
+		for (int x = 0; x < n; ++x) {
+			Vector3f target = center + Vector3f(((x + 0.5f) / n - 0.5f) * extent.x,
+			                                    (0.5f - (y + 0.5f) / n) * extent.y, 0);
+			primary.emplace_back(eye, normalize(target - eye));
+		}
+	}
+	std::vector<Intersection> hits(primary.size());
+	result.phases.push_back(runPhase("primary", (int)primary.size(), options.repeat,
+	                                 [&](int i) { hits[i] = scene.intersect(primary[i]); }));
+
+	// Shadow rays from every primary hit to a point on a light, or to a point
+	// above the scene if it has no emitters
+	std::vector<Ray> shadow, secondary;
+	std::vector<float> shadowDistance;
+	Vector3f abovePoint = center + Vector3f(0, extent.y, 0);
+	for (int i = 0; i < (int)hits.size(); ++i) {
+		const Intersection& hit = hits[i];
+		if (!hit.happened)
+			continue;
+		Sampler sampler(i, 0);
+		Vector3f target = abovePoint;
+		if (!scene.emitters.empty()) {
+			Intersection lightPoint;
+			float pdf;
+			scene.sampleLight(lightPoint, pdf, sampler);
+			target = lightPoint.coords;
+		}
+		Vector3f toLight = target - hit.coords;
+		float distance = toLight.norm();
+		shadow.emplace_back(hit.coords, toLight / distance);
+		shadowDistance.push_back(distance * (1 - Scene::shadowEpsilon));
+
+		Vector3f wo = hit.m->sample(primary[i].direction, hit.normal, sampler);
+		secondary.emplace_back(hit.coords, wo.normalized());
+	}
+	std::vector<char> occluded(shadow.size());
+	result.phases.push_back(runPhase("shadow", (int)shadow.size(), options.repeat, [&](int i) {
+		occluded[i] = scene.intersectP(shadow[i], shadowDistance[i]);
+	}));
+	std::vector<Intersection> secondaryHits(secondary.size());
+	result.phases.push_back(runPhase("secondary", (int)secondary.size(), options.repeat,
+	                                 [&](int i) { secondaryHits[i] = scene.intersect(secondary[i]); }));
+
+	// the camera of the integrators only frames scenes with lights, the Cornell box
+	if (!scene.emitters.empty())
+		benchPaths(scene, options, result);
+	result.peakRssKb = peakRssKb();
+	return result;
+}
+
+// One element of the "scenes" array
+std::string sceneJson(const SceneResult& r) {
+	std::ostringstream json;
+	json << "    {\n";
+	json << "      \"name\": \"" << r.name << "\",\n";
+	json << "      \"triangles\": " << r.triangles << ",\n";
+	json << "      \"instances\": " << r.instances << ",\n";
+	json << "      \"bvh_build_ms\": " << r.buildMs;
+	for (const PhaseResult& p : r.phases) {
+		json << ",\n      \"" << p.name << "\": {\"rays\": " << p.rays
+			<< ", \"mrays_per_s\": " << p.rays / p.seconds * 1e-6;
+#ifdef RT_STATS
+		json << ", \"nodes_per_ray\": " << p.nodesPerRay;
+#endif
+		json << "}";
+	}
+	json << ",\n      \"peak_rss_kb\": " << r.peakRssKb;
+	json << "\n    }";
+	return json.str();
+}
+
+// Run the bench for one scene in a child process, given the arguments of this
+// one without --scenes and --out, and return its JSON object or an empty
+// string if it failed
+std::string benchSceneProcess(const std::string& program, const std::vector<std::string>& args,
+                              const std::string& name) {
+	auto stamp = std::chrono::steady_clock::now().time_since_epoch().count();
+	std::filesystem::path jsonPath = std::filesystem::temp_directory_path()
+		/ ("bench_" + name + "_" + std::to_string(stamp) + ".json");
+	std::string command = "\"" + program + "\"";
+	for (const std::string& arg : args)
+		command += " \"" + arg + "\"";
+	command += " --scenes " + name + " --scene-json \"" + jsonPath.string() + "\"";
+#ifdef _WIN32
+	// cmd.exe drops the outer pair of quotes of the command line
+	command = "\"" + command + "\"";
+#endif
+	std::string json;
+	if (std::system(command.c_str()) == 0) {
+		std::ifstream in(jsonPath);
+		json.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	}
+	std::error_code ec;
+	std::filesystem::remove(jsonPath, ec);
+	return json;
+}
+
+std::string toJson(const std::vector<std::string>& sceneObjects, const Scene& config, const BenchOptions& options) {
+	std::ostringstream json;
+	json << "{\n";
+	json << "  \"simd\": \"" << kernels().name << "\",\n";
+	json << "  \"threads\": " << ThreadPool::global().size() << ",\n";
+#ifdef RT_STATS
+	// the timings include the cost of counting
+	json << "  \"stats\": true,\n";
+#else
+	json << "  \"stats\": false,\n";
+#endif
+	json << "  \"bvh_width\": " << config.bvhWidth << ",\n";
+	json << "  \"leaf_size\": " << config.maxPrimsInNode << ",\n";
+	json << "  \"split\": \"" << (config.splitMethod == BVHAccel::SplitMethod::SBVH ? "sbvh"
+		: config.splitMethod == BVHAccel::SplitMethod::SAH ? "sah" : "naive") << "\",\n";
+	json << "  \"resolution\": " << options.resolution << ",\n";
+	json << "  \"spp\": " << options.spp << ",\n";
+	json << "  \"scenes\": [\n";
+	for (size_t s = 0; s < sceneObjects.size(); ++s)
+		json << sceneObjects[s] << (s + 1 < sceneObjects.size() ? "," : "") << "\n";
+	json << "  ]\n";
+	json << "}\n";
+	return json.str();
+}
+}
+
+int main(int argc, char** argv) {
+	BenchOptions options;
+	// holds the BVH settings every bench scene is built with
+	Scene config(0, 0);
+	// the arguments the per-scene processes get
+	std::vector<std::string> forwarded;
+
+	for (int i = 1; i < argc; ++i) {
+		int first = i;
+		std::string arg = argv[i];
+		if (arg == "--bvh" && i + 1 < argc) {
+			std::string method = argv[++i];
+			if (method == "naive") config.splitMethod = BVHAccel::SplitMethod::NAIVE;
+			else if (method == "sah") config.splitMethod = BVHAccel::SplitMethod::SAH;
+			else if (method == "sbvh") config.splitMethod = BVHAccel::SplitMethod::SBVH;
+			else {
+				std::cerr << "unknown split method: " << method << " (expected naive, sah or sbvh)\n";
+				return 1;
+			}
+		}
+		else if (arg == "--sbvh-budget" && i + 1 < argc) {
+			BVHAccel::spatialSplitBudget = std::max(0.0f, std::stof(argv[++i]));
+		}
+		else if (arg == "--leaf-size" && i + 1 < argc) {
+			config.maxPrimsInNode = std::stoi(argv[++i]);
+		}
+		else if (arg == "--bvh-width" && i + 1 < argc) {
+			int width = std::stoi(argv[++i]);
+			if (width != 2 && width != 4 && width != 8) {
+				std::cerr << "unsupported BVH width: " << width << " (expected 2, 4 or 8)\n";
+				return 1;
+			}
+			config.bvhWidth = width;
+		}
+		else if (arg == "--threads" && i + 1 < argc) {
+			int threads = std::stoi(argv[++i]);
+			if (threads > 0) ThreadPool::defaultThreadCount = threads;
+		}
+		else if (arg == "--simd" && i + 1 < argc) {
+			std::string level = argv[++i];
+			if (level == "scalar") setSimdLevel(SimdLevel::Scalar);
+			else if (level == "sse") setSimdLevel(SimdLevel::SSE);
+			else if (level == "avx2") setSimdLevel(SimdLevel::AVX2);
+			else {
+				std::cerr << "unknown simd level: " << level << " (expected scalar, sse or avx2)\n";
+				return 1;
+			}
+		}
+		else if (arg == "--resolution" && i + 1 < argc) {
+			options.resolution = std::max(1, std::stoi(argv[++i]));
+		}
+		else if (arg == "--soup" && i + 1 < argc) {
+			options.soupTriangles = std::max(1, std::stoi(argv[++i]));
+		}
+		else if (arg == "--slivers" && i + 1 < argc) {
+			options.sliverTriangles = std::max(1, std::stoi(argv[++i]));
+		}
+		else if (arg == "--instances" && i + 1 < argc) {
+			options.bunnyInstances = std::max(1, std::stoi(argv[++i]));
+		}
+		else if (arg == "--spp" && i + 1 < argc) {
+			options.spp = std::max(1, std::stoi(argv[++i]));
+		}
+		else if (arg == "--integrator" && i + 1 < argc) {
+			std::string integrator = argv[++i];
+			if (integrator == "recursive") options.integrators = {Integrator::Recursive};
+			else if (integrator == "wavefront") options.integrators = {Integrator::Wavefront};
+			else if (integrator == "both") options.integrators = {Integrator::Recursive, Integrator::Wavefront};
+			else {
+				std::cerr << "unknown integrator: " << integrator << " (expected recursive, wavefront or both)\n";
+				return 1;
+			}
+		}
+		else if (arg == "--repeat" && i + 1 < argc) {
+			options.repeat = std::max(1, std::stoi(argv[++i]));
+		}
+		else if (arg == "--scenes" && i + 1 < argc) {
+			// comma separated subset of cornell, bunny, soup, slivers and instances
+			options.scenes.clear();
+			std::stringstream list(argv[++i]);
+			for (std::string name; std::getline(list, name, ',');)
+				options.scenes.push_back(name);
+		}
+		else if (arg == "--out" && i + 1 < argc) {
+			options.outPath = argv[++i];
+		}
+		else if (arg == "--scene-json" && i + 1 < argc) {
+			options.sceneJsonPath = argv[++i];
+		}
+		else {
+			std::cerr << "usage: " << argv[0]
+				<< " [--bvh naive|sah|sbvh] [--sbvh-budget X] [--leaf-size N] [--bvh-width 2|4|8] [--threads N] [--simd scalar|sse|avx2]"
+				<< " [--resolution N] [--soup TRIANGLES] [--slivers TRIANGLES] [--instances N] [--repeat N]"
+				<< " [--spp N] [--integrator recursive|wavefront|both]"
+				<< " [--scenes cornell,bunny,soup,slivers,instances]"
+				<< " [--out FILE]\n";
+			return 1;
+		}
+		if (arg != "--scenes" && arg != "--out" && arg != "--scene-json")
+			forwarded.insert(forwarded.end(), argv + first, argv + i + 1);
+	}
+	for (const std::string& name : options.scenes) {
+		if (name != "cornell" && name != "bunny" && name != "soup" && name != "slivers"
+		    && name != "instances") {
+			std::cerr << "unknown scene: " << name << " (expected cornell, bunny, soup, slivers or instances)\n";
+			return 1;
+		}
+	}
+
+	// stdout is reserved for the JSON report
+	BVHAccel::printBuildStats = false;
+
+	if (!options.sceneJsonPath.empty()) {
+		if (options.scenes.size() != 1) {
+			std::cerr << "--scene-json needs exactly one scene\n";
+			return 1;
+		}
+		std::ofstream out(options.sceneJsonPath);
+		out << sceneJson(benchScene(options.scenes[0], config, options));
+		return out ? 0 : 1;
+	}
+
+	std::vector<std::string> sceneObjects;
+	for (const std::string& name : options.scenes) {
+		if (options.scenes.size() == 1) {
+			sceneObjects.push_back(sceneJson(benchScene(name, config, options)));
+			continue;
+		}
+		std::string json = benchSceneProcess(argv[0], forwarded, name);
+		if (json.empty()) {
+			std::cerr << "bench of scene " << name << " failed\n";
+			return 1;
+		}
+		sceneObjects.push_back(json);
+	}
+
+	std::string json = toJson(sceneObjects, config, options);
+	std::cout << json;
+	if (!options.outPath.empty()) {
+		FILE* fp = fopen(options.outPath.c_str(), "w");
+		if (!fp) {
+			std::cerr << "cannot write " << options.outPath << "\n";
+			return 1;
+		}
+		fputs(json.c_str(), fp);
+		fclose(fp);
+	}
+	return 0;
+}
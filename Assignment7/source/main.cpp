@@ -1,10 +1,15 @@
 #include "Renderer.hpp"
 #include "Scene.hpp"
-#include "Triangle.hpp"
-#include "Sphere.hpp"
+#include "Scenes.hpp"
 #include "Vector.hpp"
 #include "global.hpp"
+#include "ThreadPool.hpp"
 #include <chrono>
+#include <csignal>
+#include <string>
+
+// Finish the current pass and checkpoint instead of losing the render
+static void requestStop(int) { Renderer::stopRequested = 1; }
 
 // In the main function of the program, we create the scene (create objects and
 // lights) as well as set the options for the render (image width and height,
@@ -13,50 +18,190 @@
 int main(int argc, char** argv) {
 	// Change the definition here to change resolution
 	Scene scene(784, 784);
+	RenderOptions options;
+	std::string resumePath;
+	// distributed rendering: coordinator port, or the coordinator a worker connects to
+	int coordinatorPort = 0;
+	std::string workerHost;
+	int workerPort = 0;
+	// tone map an earlier render's PFM output instead of rendering
+	std::string tonemapInput;
+	bool toneOperatorsSet = false;
 
-	Material* red = new Material(DIFFUSE, Vector3f(0.0f));
-	red->Kd = Vector3f(0.63f, 0.065f, 0.05f);
-	Material* green = new Material(DIFFUSE, Vector3f(0.0f));
-	green->Kd = Vector3f(0.14f, 0.45f, 0.091f);
-	Material* white = new Material(DIFFUSE, Vector3f(0.0f));
-	white->Kd = Vector3f(0.725f, 0.71f, 0.68f);
-	Material* light = new Material(
-		DIFFUSE,
-		(8.0f * Vector3f(0.747f + 0.058f, 0.747f + 0.258f, 0.747f) + 15.6f *
-			Vector3f(0.740f + 0.287f, 0.740f + 0.160f, 0.740f) + 18.4f * Vector3f(
-				0.737f + 0.642f, 0.737f + 0.159f, 0.737f)));
-	light->Kd = Vector3f(0.65f);
-
-
-	Material* Microfacet = new Material(MICROFACET, Vector3f(0.0f));
-	Microfacet->Kd = Vector3f(0.5, 0.5, 0.5);
-	Microfacet->Ks = Vector3f(0.5, 0.5, 0.5);
-	Microfacet->ior = 2;
-
-	Sphere sphere(Vector3f(140, 250, 200), 50, Microfacet);
-
-	MeshTriangle floor(std::string(ASSIGNMENT7_SOURCE_DIR) + "/models/cornellbox/floor.obj", white);
-	MeshTriangle shortbox(std::string(ASSIGNMENT7_SOURCE_DIR) + "/models/cornellbox/shortbox.obj", white);
-	MeshTriangle tallbox(std::string(ASSIGNMENT7_SOURCE_DIR) + "/models/cornellbox/tallbox.obj", white);
-	MeshTriangle left(std::string(ASSIGNMENT7_SOURCE_DIR) + "/models/cornellbox/left.obj", red);
-	MeshTriangle right(std::string(ASSIGNMENT7_SOURCE_DIR) + "/models/cornellbox/right.obj", green);
-	MeshTriangle light_(std::string(ASSIGNMENT7_SOURCE_DIR) + "/models/cornellbox/light.obj", light);
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--bvh" && i + 1 < argc) {
+			std::string method = argv[++i];
+			if (method == "naive") scene.splitMethod = BVHAccel::SplitMethod::NAIVE;
+			else if (method == "sah") scene.splitMethod = BVHAccel::SplitMethod::SAH;
+			else if (method == "sbvh") scene.splitMethod = BVHAccel::SplitMethod::SBVH;
+			else {
+				std::cerr << "unknown split method: " << method << " (expected naive, sah or sbvh)\n";
+				return 1;
+			}
+		}
+		else if (arg == "--sbvh-budget" && i + 1 < argc) {
+			// extra references spatial splits may add, as a fraction of the primitives
+			BVHAccel::spatialSplitBudget = std::max(0.0f, std::stof(argv[++i]));
+		}
+		else if (arg == "--leaf-size" && i + 1 < argc) {
+			scene.maxPrimsInNode = std::stoi(argv[++i]);
+		}
+		else if (arg == "--bvh-width" && i + 1 < argc) {
+			int width = std::stoi(argv[++i]);
+			if (width != 2 && width != 4 && width != 8) {
+				std::cerr << "unsupported BVH width: " << width << " (expected 2, 4 or 8)\n";
+				return 1;
+			}
+			scene.bvhWidth = width;
+		}
+		else if (arg == "--threads" && i + 1 < argc) {
+			// 0 keeps the default of one thread per hardware thread
+			int threads = std::stoi(argv[++i]);
+			if (threads > 0) ThreadPool::defaultThreadCount = threads;
+		}
+		else if (arg == "--spp" && i + 1 < argc) {
+			options.spp = std::max(1, std::stoi(argv[++i]));
+		}
+		else if (arg == "--tile-size" && i + 1 < argc) {
+			options.tileSize = std::max(1, std::stoi(argv[++i]));
+		}
+		else if (arg == "--adaptive") {
+			options.adaptive = true;
+		}
+		else if (arg == "--error-threshold" && i + 1 < argc) {
+			options.errorThreshold = std::stof(argv[++i]);
+		}
+		else if (arg == "--passes" && i + 1 < argc) {
+			options.adaptivePasses = std::max(1, std::stoi(argv[++i]));
+		}
+		else if (arg == "--pass-spp" && i + 1 < argc) {
+			options.passSpp = std::max(1, std::stoi(argv[++i]));
+		}
+		else if (arg == "--checkpoint" && i + 1 < argc) {
+			options.checkpointPath = argv[++i];
+		}
+		else if (arg == "--checkpoint-interval" && i + 1 < argc) {
+			options.checkpointInterval = std::max(0, std::stoi(argv[++i]));
+		}
+		else if (arg == "--resume" && i + 1 < argc) {
+			resumePath = argv[++i];
+		}
+		else if (arg == "--coordinator" && i + 1 < argc) {
+			coordinatorPort = std::stoi(argv[++i]);
+		}
+		else if (arg == "--job-tile-size" && i + 1 < argc) {
+			options.jobTileSize = std::max(1, std::stoi(argv[++i]));
+		}
+		else if (arg == "--worker" && i + 1 < argc) {
+			std::string address = argv[++i];
+			size_t colon = address.rfind(':');
+			if (colon == std::string::npos) {
+				std::cerr << "expected HOST:PORT after --worker\n";
+				return 1;
+			}
+			workerHost = address.substr(0, colon);
+			workerPort = std::stoi(address.substr(colon + 1));
+		}
+		else if (arg == "--hdr" && i + 1 < argc) {
+			options.hdrPath = argv[++i];
+		}
+		else if (arg == "--tonemap" && i + 1 < argc) {
+			ToneOperator op;
+			std::string name = argv[++i];
+			if (!parseToneOperator(name, op)) {
+				std::cerr << "unknown tone operator: " << name << " (expected clamp, reinhard or aces)\n";
+				return 1;
+			}
+			if (!toneOperatorsSet)
+				options.toneOperators.clear();
+			options.toneOperators.push_back(op);
+			toneOperatorsSet = true;
+		}
+		else if (arg == "--exposure" && i + 1 < argc) {
+			options.exposure = std::stof(argv[++i]);
+		}
+		else if (arg == "--tonemap-only" && i + 1 < argc) {
+			tonemapInput = argv[++i];
+		}
+		else if (arg == "--integrator" && i + 1 < argc) {
+			std::string integrator = argv[++i];
+			if (integrator == "recursive") options.integrator = Integrator::Recursive;
+			else if (integrator == "wavefront") options.integrator = Integrator::Wavefront;
+			else {
+				std::cerr << "unknown integrator: " << integrator << " (expected recursive or wavefront)\n";
+				return 1;
+			}
+		}
+		else if (arg == "--simd" && i + 1 < argc) {
+			std::string level = argv[++i];
+			if (level == "scalar") setSimdLevel(SimdLevel::Scalar);
+			else if (level == "sse") setSimdLevel(SimdLevel::SSE);
+			else if (level == "avx2") setSimdLevel(SimdLevel::AVX2);
+			else {
+				std::cerr << "unknown simd level: " << level << " (expected scalar, sse or avx2)\n";
+				return 1;
+			}
+		}
+		else {
+			std::cerr << "usage: " << argv[0]
+				<< " [--bvh naive|sah|sbvh] [--sbvh-budget X] [--leaf-size N] [--bvh-width 2|4|8] [--threads N] [--spp N] [--tile-size N]"
+				<< " [--adaptive] [--error-threshold E] [--passes N] [--pass-spp N]"
+				<< " [--checkpoint FILE] [--checkpoint-interval SECONDS] [--resume FILE]"
+				<< " [--hdr FILE.pfm] [--tonemap clamp|reinhard|aces]... [--exposure X] [--tonemap-only FILE.pfm]"
+				<< " [--coordinator PORT] [--job-tile-size N] [--worker HOST:PORT] [--integrator recursive|wavefront] [--simd scalar|sse|avx2]\n";
+			return 1;
+		}
+	}
 
-	scene.Add(&floor);
-	scene.Add(&shortbox);
-	scene.Add(&tallbox);
-	scene.Add(&left);
-	scene.Add(&right);
-	scene.Add(&light_);
-	scene.Add(&sphere);
+	if (!tonemapInput.empty()) {
+		int width, height;
+		std::vector<Vector3f> image;
+		if (!readPFM(tonemapInput, width, height, image)) {
+			std::cerr << "cannot read " << tonemapInput << "\n";
+			return 1;
+		}
+		Scene image_scene(width, height);
+		Renderer r(width, height, options);
+		if (!r.LoadHDR(tonemapInput))
+			return 1;
+		r.Save(image_scene);
+		return 0;
+	}
 
+	SceneAssets assets;
+	addCornellBox(scene, assets);
 	scene.buildBVH();
+	std::cout << "Ray kernels: " << kernels().name << "\n";
 
-	Renderer r(scene.width, scene.height);
+	// keep checkpointing into the file we resume from unless told otherwise
+	if (!resumePath.empty() && options.checkpointPath.empty())
+		options.checkpointPath = resumePath;
+	Renderer r(scene.width, scene.height, options);
+	if (!resumePath.empty() && !r.LoadCheckpoint(resumePath))
+		return 1;
+	std::signal(SIGINT, requestStop);
+	std::signal(SIGTERM, requestStop);
 
 	auto start = std::chrono::system_clock::now();
-	r.Render(scene);
+	if (!workerHost.empty())
+		return r.RenderWorker(scene, workerHost, workerPort) ? 0 : 1;
+	bool finished = coordinatorPort > 0 ? r.RenderCoordinator(scene, coordinatorPort) : r.Render(scene);
 	r.Save(scene);
+	if (!finished) {
+		std::cout << "Render interrupted";
+		// the coordinator does not checkpoint, only a local render can resume
+		if (coordinatorPort == 0 && !options.checkpointPath.empty())
+			std::cout << ", continue with --resume " << options.checkpointPath;
+		std::cout << "\n";
+		return 2;
+	}
+	if (r.getOptions().adaptive)
+		r.SaveSampleHeatmap(scene, "samples.ppm");
+#ifdef RT_STATS
+	if (coordinatorPort == 0)
+		r.SaveCostHeatmap(scene, "cost.ppm");
+#endif
 	auto stop = std::chrono::system_clock::now();
 
 	std::cout << "Render complete: \n";